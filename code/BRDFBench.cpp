@@ -0,0 +1,774 @@
+#include "stdlib.h"
+#include "math.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "brdf.h"
+#include "brdfblend.h"
+#include "frame.h"
+#include "gbuffer.h"
+#include "image.h"
+#include "matrix3.h"
+#include "perfcounters.h"
+#include "render.h"
+
+// The renderer's camera, sphere and first light position.
+static const Vector3 CAMERA = Vector3(0, 0, -2.5);
+static const Vector3 SPHERE = Vector3(0, 0, 0);
+static const Vector3 LIGHT = Vector3(5, 5, -5);
+
+// Results are summed into this so that no benchmark is optimised away.
+static volatile double sink;
+
+struct BenchResult {
+	std::string name;
+	// Frame width and height the inputs come from, or 0.
+	int size;
+	double ops;
+	// Pixels processed per run, or 0 where that has no meaning.
+	double pixels;
+	double seconds;
+	unsigned long long counters[PerfCounters::NUM_COUNTERS];
+};
+
+// Time `body`, which performs `ops` operations on `pixels` pixels, as the
+// fastest of `repeat` runs after one untimed run, with the counters of that
+// run.
+template <class Body>
+static BenchResult run_bench(PerfCounters& counters, const char* name, int size, double ops, double pixels,
+	int repeat, const Body& body)
+{
+	BenchResult result;
+	result.name = name;
+	result.size = size;
+	result.ops = ops;
+	result.pixels = pixels;
+	result.seconds = 0;
+	for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++)
+	{
+		result.counters[c] = 0;
+	}
+
+	sink = sink + body();
+	for (int r = 0; r < repeat; r++)
+	{
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		counters.start();
+		double sum = body();
+		counters.stop();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		sink = sink + sum;
+		if (r == 0 || seconds < result.seconds)
+		{
+			result.seconds = seconds;
+			for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++)
+			{
+				result.counters[c] = counters.value((PerfCounters::Counter)c);
+			}
+		}
+	}
+	return result;
+}
+
+static void print_result(const BenchResult& result, bool counted)
+{
+	const unsigned long long* c = result.counters;
+	char mpix[32] = "-";
+	char ipc[32] = "-";
+	char misses[32] = "-";
+	char l1d[32] = "-";
+	if (result.pixels > 0)
+	{
+		snprintf(mpix, sizeof(mpix), "%.2f", result.pixels / result.seconds * 1e-6);
+	}
+	if (counted && c[PerfCounters::CYCLES] > 0)
+	{
+		snprintf(ipc, sizeof(ipc), "%.2f", (double)c[PerfCounters::INSTRUCTIONS] / c[PerfCounters::CYCLES]);
+	}
+	if (counted)
+	{
+		snprintf(misses, sizeof(misses), "%.3f", c[PerfCounters::CACHE_MISSES] / result.ops);
+		snprintf(l1d, sizeof(l1d), "%.3f", c[PerfCounters::L1D_READ_MISSES] / result.ops);
+	}
+	fprintf(stdout, "%-32s %6d %12.2f %10s %6s %12s %12s\n", result.name.c_str(), result.size,
+		result.seconds * 1e9 / result.ops, mpix, ipc, misses, l1d);
+}
+
+static void write_json_string(FILE* file, const char* s)
+{
+	fputc('"', file);
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(file, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(file, "\\u%04x", *s);
+		else
+			fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+// One object per benchmark with the raw counter values as well as the
+// derived rates, so that other figures can be worked out later. Fields
+// that cannot be measured are null.
+static bool write_json(const char* filename, const char* brdf, BRDFLayout layout, bool counted,
+	const std::vector<BenchResult>& results)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n\t\"brdf\": ");
+	write_json_string(file, brdf);
+	const char* layout_names[] = { "planar", "interleaved", "tiled" };
+	fprintf(file, ",\n\t\"layout\": \"%s\"", layout_names[layout]);
+	fprintf(file, ",\n\t\"batch_kernel\": \"%s\",\n\t\"counters\": %s,\n\t\"benchmarks\": [",
+		brdf_batch_kernel(), counted ? "true" : "false");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& result = results[i];
+		const unsigned long long* c = result.counters;
+		fprintf(file, "%s\n\t\t{\"name\": ", i == 0 ? "" : ",");
+		write_json_string(file, result.name.c_str());
+		fprintf(file, ", \"size\": %d, \"ops\": %.0f, \"seconds\": %.9g, \"ns_per_op\": %.6g",
+			result.size, result.ops, result.seconds, result.seconds * 1e9 / result.ops);
+		if (result.pixels > 0)
+			fprintf(file, ", \"mpix_per_s\": %.6g", result.pixels / result.seconds * 1e-6);
+		else
+			fprintf(file, ", \"mpix_per_s\": null");
+		if (counted && c[PerfCounters::CYCLES] > 0)
+			fprintf(file, ", \"ipc\": %.4g", (double)c[PerfCounters::INSTRUCTIONS] / c[PerfCounters::CYCLES]);
+		else
+			fprintf(file, ", \"ipc\": null");
+		for (int k = 0; k < PerfCounters::NUM_COUNTERS; k++)
+		{
+			fprintf(file, ", \"%s\": ", PerfCounters::name((PerfCounters::Counter)k));
+			if (counted)
+				fprintf(file, "%llu", c[k]);
+			else
+				fprintf(file, "null");
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n\t]\n}\n");
+	return fclose(file) == 0;
+}
+
+// Tangent-space light and view directions of every sample of a frame that
+// faces the renderer's first light, as the renderer computes them.
+struct FrameInputs {
+	std::vector<int> pixel;
+	std::vector<double> wi[3];
+	std::vector<double> wo[3];
+};
+
+static void frame_inputs(const GBuffer& gbuffer, FrameInputs& inputs)
+{
+	for (int s = 0; s < gbuffer.count; s++)
+	{
+		Vector3 intersection = Vector3(gbuffer.px[s], gbuffer.py[s], gbuffer.pz[s]);
+		Vector3 normal = Vector3(gbuffer.nx[s], gbuffer.ny[s], gbuffer.nz[s]);
+		Vector3 toLight = (LIGHT - intersection).normal();
+		if (normal.dot_product(toLight) <= 0)
+			continue;
+		inputs.pixel.push_back(gbuffer.pixel[s]);
+		inputs.wi[0].push_back(gbuffer.tx[s] * toLight.x + gbuffer.ty[s] * toLight.y + gbuffer.tz[s] * toLight.z);
+		inputs.wi[1].push_back(gbuffer.bx[s] * toLight.x + gbuffer.by[s] * toLight.y + gbuffer.bz[s] * toLight.z);
+		inputs.wi[2].push_back(normal.dot_product(toLight));
+		inputs.wo[0].push_back(gbuffer.wox[s]);
+		inputs.wo[1].push_back(gbuffer.woy[s]);
+		inputs.wo[2].push_back(gbuffer.woz[s]);
+	}
+}
+
+// Shade one frame on the calling thread with the renderer's own code, and
+// resolve it as the writer would.
+static double shade_frame(Scene& scene, GBuffer& gbuffer, Image& image)
+{
+	shade_samples(scene, gbuffer, image, 0, gbuffer.count);
+	image.resolve();
+	return image.output_row(gbuffer.size / 2)[3 * (gbuffer.size / 2)];
+}
+
+// Whether `frame` is orthonormal and right-handed, s x t = n, to within
+// rounding.
+static bool frame_valid(const Frame& frame)
+{
+	const double tolerance = 1e-9;
+	Vector3 axes[3] = { frame.s, frame.t, frame.n };
+	for (int a = 0; a < 3; a++)
+	{
+		if (fabs(axes[a].dot_product(axes[a]) - 1) > tolerance)
+			return false;
+		for (int b = a + 1; b < 3; b++)
+		{
+			if (fabs(axes[a].dot_product(axes[b])) > tolerance)
+				return false;
+		}
+	}
+	Vector3 n = frame.s.cross_product(frame.t);
+	return fabs(n.x - frame.n.x) < tolerance && fabs(n.y - frame.n.y) < tolerance &&
+		fabs(n.z - frame.n.z) < tolerance;
+}
+
+// Normals over the sphere, including the axes and normals just off -z and
+// the poles of the latitude frame, where each frame construction has its
+// special case.
+static std::vector<Vector3> test_normals()
+{
+	std::vector<Vector3> normals;
+	for (int i = 0; i <= 64; i++)
+	{
+		double theta = i * PI / 64;
+		for (int j = 0; j < 64; j++)
+		{
+			double phi = j * 2 * PI / 64;
+			normals.push_back(Vector3(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta)));
+		}
+	}
+	for (int sign = -1; sign <= 1; sign += 2)
+	{
+		normals.push_back(Vector3(sign, 0, 0));
+		normals.push_back(Vector3(0, sign, 0));
+		normals.push_back(Vector3(0, 0, sign));
+		normals.push_back(Vector3(1e-9, 0, sign).normal());
+		normals.push_back(Vector3(0, sign, 1e-9).normal());
+	}
+	return normals;
+}
+
+// Check both tangent frame constructions over test_normals().
+static bool check_frames()
+{
+	std::vector<Vector3> normals = test_normals();
+	for (size_t i = 0; i < normals.size(); i++)
+	{
+		const Vector3& n = normals[i];
+		if (!frame_valid(Frame::from_normal(n)) || !frame_valid(Frame::latitude(n)))
+		{
+			fprintf(stderr, "Invalid tangent frame for the normal (%g, %g, %g)\n", n.x, n.y, n.z);
+			return false;
+		}
+	}
+	return true;
+}
+
+// The float variants are not used by the renderer, which stays in double,
+// so compile every member of them here.
+template struct Vector3T<float>;
+template struct Matrix3T<float>;
+template struct FrameT<float>;
+
+static double max_difference(const Vector3f& a, const Vector3& b)
+{
+	return std::max(fabs(a.x - b.x), std::max(fabs(a.y - b.y), fabs(a.z - b.z)));
+}
+
+// Check Vector3f, Matrix3f and Framef against the double reference on
+// test_normals(): both frame constructions, moving a direction into and
+// out of them, and the matrix of the frame and its inverse. Then report
+// how often the batch lookup's indices change when the tangent-space
+// directions of a frame are computed in float.
+static bool check_float_types(const FrameInputs& frame)
+{
+	// A few float roundings on unit-length values.
+	const double tolerance = 1e-6;
+	std::vector<Vector3> normals = test_normals();
+	double worst = 0;
+	for (size_t i = 0; i < normals.size(); i++)
+	{
+		const Vector3& n = normals[i];
+		Vector3f nf = Vector3f(n);
+		Vector3 v = Vector3(0.3, -0.5, 0.8).normal();
+		Vector3f vf = Vector3f(v);
+		Frame frames[2] = { Frame::from_normal(n), Frame::latitude(n) };
+		Framef frames_f[2] = { Framef::from_normal(nf), Framef::latitude(nf) };
+		for (int f = 0; f < 2; f++)
+		{
+			worst = std::max(worst, max_difference(frames_f[f].s, frames[f].s));
+			worst = std::max(worst, max_difference(frames_f[f].t, frames[f].t));
+			worst = std::max(worst, max_difference(frames_f[f].to_local(vf), frames[f].to_local(v)));
+			worst = std::max(worst, max_difference(frames_f[f].to_world(vf), frames[f].to_world(v)));
+
+			Matrix3 m = Matrix3(frames[f].s, frames[f].t, frames[f].n);
+			Matrix3f mf = Matrix3f(frames_f[f].s, frames_f[f].t, frames_f[f].n);
+			worst = std::max(worst, max_difference(mf * vf, m * v));
+			worst = std::max(worst, max_difference(mf.inverse() * vf, m.inverse() * v));
+		}
+		if (worst > tolerance)
+		{
+			fprintf(stderr, "Float and double tangent frames differ by %g for the normal (%g, %g, %g)\n",
+				worst, n.x, n.y, n.z);
+			return false;
+		}
+	}
+
+	// The frame's tangent-space directions, rounded to float and
+	// renormalised there.
+	int n = (int)frame.pixel.size();
+	std::vector<float> wi_f[3], wo_f[3];
+	for (int i = 0; i < n; i++)
+	{
+		Vector3 in = Vector3(frame.wi[0][i], frame.wi[1][i], frame.wi[2][i]);
+		Vector3 out = Vector3(frame.wo[0][i], frame.wo[1][i], frame.wo[2][i]);
+		Vector3f in_f = Vector3f(in).normal();
+		Vector3f out_f = Vector3f(out).normal();
+		wi_f[0].push_back(in_f.x); wi_f[1].push_back(in_f.y); wi_f[2].push_back(in_f.z);
+		wo_f[0].push_back(out_f.x); wo_f[1].push_back(out_f.y); wo_f[2].push_back(out_f.z);
+	}
+	const float* wi_float[3] = { &wi_f[0][0], &wi_f[1][0], &wi_f[2][0] };
+	const float* wo_float[3] = { &wo_f[0][0], &wo_f[1][0], &wo_f[2][0] };
+	const double* wi[3] = { &frame.wi[0][0], &frame.wi[1][0], &frame.wi[2][0] };
+	const double* wo[3] = { &frame.wo[0][0], &frame.wo[1][0], &frame.wo[2][0] };
+	std::vector<int> ind(3 * n), ind_f(3 * n);
+	std::vector<double> sin_2phi(n);
+	brdf_dir_indices_batch(wi, wo, n, &ind[0], &ind[n], &ind[2*n], &sin_2phi[0]);
+	brdf_dir_indices_batch(wi_float, wo_float, n, &ind_f[0], &ind_f[n], &ind_f[2*n], &sin_2phi[0]);
+	int moved = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (ind[i] != ind_f[i] || ind[n + i] != ind_f[n + i] || ind[2*n + i] != ind_f[2*n + i])
+			moved++;
+	}
+	fprintf(stdout, "Float types within %.2g of double; float directions move %.3f%% of the lookups by a bin.\n",
+		worst, 100.0 * moved / n);
+	return true;
+}
+
+// Direction pairs for check_kernels(): random ones over the whole sphere,
+// so including pairs below the horizon, with the degenerate cases of wo
+// equal to wi, mirrored about the normal and along the normal.
+static void random_pairs(int n, std::vector<double> wi[3], std::vector<double> wo[3])
+{
+	std::mt19937 random(1);
+	std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+	for (int i = 0; i < n; i++)
+	{
+		Vector3 in = Vector3(uniform(random), uniform(random), uniform(random)).normal();
+		Vector3 out = Vector3(uniform(random), uniform(random), uniform(random)).normal();
+		switch (i % 8)
+		{
+		case 0: out = in; break;
+		case 1: out = Vector3(-in.x, -in.y, in.z); break;
+		case 2: in = Vector3(0, 0, 1); break;
+		}
+		wi[0].push_back(in.x); wi[1].push_back(in.y); wi[2].push_back(in.z);
+		wo[0].push_back(out.x); wo[1].push_back(out.y); wo[2].push_back(out.z);
+	}
+}
+
+static bool same_bits(const std::vector<double>& a, const std::vector<double>& b)
+{
+	return memcmp(&a[0], &b[0], a.size() * sizeof(double)) == 0;
+}
+
+static bool same_bits(const std::vector<int>& a, const std::vector<int>& b)
+{
+	return memcmp(&a[0], &b[0], a.size() * sizeof(int)) == 0;
+}
+
+// Run every batch entry point with every kernel the CPU has and compare
+// the results bit for bit with the scalar functions they batch, on the
+// frame's pairs and on random ones, and for the angle lookup on a grid
+// with pairs exactly on bin edges and on angles out of range. Leaves the
+// active kernel as it was.
+static bool check_kernels(const BRDF& brdf1, const BRDF& brdf2, const FrameInputs& frame)
+{
+	std::vector<double> wi_d[3], wo_d[3];
+	for (int c = 0; c < 3; c++)
+	{
+		wi_d[c] = frame.wi[c];
+		wo_d[c] = frame.wo[c];
+	}
+	random_pairs(1 << 16, wi_d, wo_d);
+	int n = (int)wi_d[0].size();
+	std::vector<float> wi_f[3], wo_f[3];
+	for (int c = 0; c < 3; c++)
+	{
+		wi_f[c].assign(wi_d[c].begin(), wi_d[c].end());
+		wo_f[c].assign(wo_d[c].begin(), wo_d[c].end());
+	}
+	const double* wi[3] = { &wi_d[0][0], &wi_d[1][0], &wi_d[2][0] };
+	const double* wo[3] = { &wo_d[0][0], &wo_d[1][0], &wo_d[2][0] };
+	const float* wi_float[3] = { &wi_f[0][0], &wi_f[1][0], &wi_f[2][0] };
+	const float* wo_float[3] = { &wo_f[0][0], &wo_f[1][0], &wo_f[2][0] };
+
+	// BRDFRead's grid at half the resolution, then random angles.
+	std::vector<double> theta_in, fi_in, theta_out, fi_out;
+	const int grid = 8;
+	for (int i = 0; i < grid * 4 * grid * 4 * grid; i++)
+	{
+		theta_in.push_back(i / (16 * grid * grid) * 0.5 * PI / grid);
+		fi_in.push_back(i / (4 * grid * grid) % (4 * grid) * 2.0 * PI / (4 * grid));
+		theta_out.push_back(i / (4 * grid) % grid * 0.5 * PI / grid);
+		fi_out.push_back(i % (4 * grid) * 2.0 * PI / (4 * grid));
+	}
+	std::mt19937 random(2);
+	std::uniform_real_distribution<double> uniform(-0.2, 1.2);
+	for (int i = 0; i < (1 << 16); i++)
+	{
+		theta_in.push_back(uniform(random) * PI / 2);
+		fi_in.push_back(uniform(random) * 2 * PI);
+		theta_out.push_back(uniform(random) * PI / 2);
+		fi_out.push_back(uniform(random) * 2 * PI);
+	}
+	int angles = (int)theta_in.size();
+
+	// The scalar references.
+	std::vector<int> ind_ref(3 * n);
+	std::vector<int> ind_float_ref(3 * n);
+	std::vector<double> sin_ref(n), sin_float_ref(n), coords_ref(4 * n);
+	std::vector<double> aniso_ref(3 * n), interpolated_ref(3 * n, 0.0), val_ref(3 * angles);
+	for (int i = 0; i < n; i++)
+	{
+		double in[3] = { wi[0][i], wi[1][i], wi[2][i] };
+		double out[3] = { wo[0][i], wo[1][i], wo[2][i] };
+		brdf_dir_indices(in, out, ind_ref[i], ind_ref[n + i], ind_ref[2*n + i], sin_ref[i]);
+		double in_float[3] = { wi_float[0][i], wi_float[1][i], wi_float[2][i] };
+		double out_float[3] = { wo_float[0][i], wo_float[1][i], wo_float[2][i] };
+		brdf_dir_indices(in_float, out_float, ind_float_ref[i], ind_float_ref[n + i], ind_float_ref[2*n + i],
+			sin_float_ref[i]);
+		brdf_dir_coords(in, out, coords_ref[i], coords_ref[n + i], coords_ref[2*n + i], coords_ref[3*n + i]);
+		if (!lookup_aniso_brdf_dir(brdf1, brdf2, in, out, aniso_ref[3*i], aniso_ref[3*i + 1], aniso_ref[3*i + 2]))
+			aniso_ref[3*i] = aniso_ref[3*i + 1] = aniso_ref[3*i + 2] = 0.0;
+		if (!lookup_aniso_brdf_dir_interpolated(brdf1, brdf2, in, out,
+				interpolated_ref[3*i], interpolated_ref[3*i + 1], interpolated_ref[3*i + 2]))
+			interpolated_ref[3*i] = interpolated_ref[3*i + 1] = interpolated_ref[3*i + 2] = 0.0;
+	}
+	for (int i = 0; i < angles; i++)
+	{
+		lookup_brdf_val(brdf1, theta_in[i], fi_in[i], theta_out[i], fi_out[i],
+			val_ref[3*i], val_ref[3*i + 1], val_ref[3*i + 2]);
+	}
+
+	std::string active = brdf_batch_kernel();
+	const char* kernels[] = { "scalar", "avx2", "avx512" };
+	bool passed = true;
+	for (int k = 0; k < 3 && passed; k++)
+	{
+		if (!select_brdf_batch_kernel(kernels[k]))
+			continue;
+		std::vector<int> ind(3 * n);
+		std::vector<double> sin_2phi(n), coords(4 * n), rgb(3 * n), val(3 * angles);
+		const char* failed = NULL;
+
+		brdf_dir_indices_batch(wi, wo, n, &ind[0], &ind[n], &ind[2*n], &sin_2phi[0]);
+		if (!same_bits(ind, ind_ref) || !same_bits(sin_2phi, sin_ref))
+			failed = "brdf_dir_indices_batch";
+		brdf_dir_indices_batch(wi_float, wo_float, n, &ind[0], &ind[n], &ind[2*n], &sin_2phi[0]);
+		if (!same_bits(ind, ind_float_ref) || !same_bits(sin_2phi, sin_float_ref))
+			failed = "brdf_dir_indices_batch (float)";
+		lookup_aniso_brdf_batch(brdf1, brdf2, wi, wo, n, &rgb[0]);
+		if (!same_bits(rgb, aniso_ref))
+			failed = "lookup_aniso_brdf_batch";
+		brdf_dir_coords_batch(wi, wo, n, &coords[0], &coords[n], &coords[2*n], &coords[3*n]);
+		if (!same_bits(coords, coords_ref))
+			failed = "brdf_dir_coords_batch";
+		lookup_aniso_brdf_batch_interpolated(brdf1, brdf2, wi, wo, n, &rgb[0]);
+		if (!same_bits(rgb, interpolated_ref))
+			failed = "lookup_aniso_brdf_batch_interpolated";
+		lookup_brdf_val_batch(brdf1, &theta_in[0], &fi_in[0], &theta_out[0], &fi_out[0], angles, &val[0]);
+		if (!same_bits(val, val_ref))
+			failed = "lookup_brdf_val_batch";
+
+		if (failed)
+		{
+			fprintf(stderr, "The %s kernel of %s differs from the scalar lookup\n", kernels[k], failed);
+			passed = false;
+		}
+	}
+	select_brdf_batch_kernel(active.c_str());
+	return passed;
+}
+
+static bool parse_sizes(const char* list, std::vector<int>& sizes)
+{
+	sizes.clear();
+	const char* s = list;
+	while (*s)
+	{
+		char* end;
+		long size = strtol(s, &end, 10);
+		if (end == s || size < 1 || size > 16384 || (*end != ',' && *end != '\0'))
+			return false;
+		sizes.push_back((int)size);
+		s = *end == ',' ? end + 1 : end;
+	}
+	return !sizes.empty();
+}
+
+// Microbenchmarks of the lookup path, file I/O and whole frames, reported
+// as time per operation, pixel throughput and, where perf_event_open is
+// allowed, instructions per cycle and cache misses per operation.
+int main(int argc, char *argv[])
+{
+	const char* json = NULL;
+	const char* sizes_arg = "128,256,512";
+	const char* save_file = "brdfbench.bmp";
+	BRDFLayout layout = BRDF_LAYOUT_INTERLEAVED;
+	bool layout_valid = true;
+	bool kernel_valid = true;
+	int repeat = 10;
+	std::vector<const char*> inputs;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			json = argv[++i];
+		}
+		else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+		{
+			sizes_arg = argv[++i];
+		}
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+		{
+			repeat = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--save-file") == 0 && i + 1 < argc)
+		{
+			save_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+		{
+			layout_valid = parse_brdf_layout(argv[++i], layout) && layout_valid;
+		}
+		else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+		{
+			kernel_valid = select_brdf_batch_kernel(argv[++i]) && kernel_valid;
+		}
+		else
+		{
+			inputs.push_back(argv[i]);
+		}
+	}
+	std::vector<int> sizes;
+	if (inputs.empty() || inputs.size() > 2 || repeat < 1 || !layout_valid || !kernel_valid || !parse_sizes(sizes_arg, sizes))
+	{
+		fprintf(stdout, "USAGE: [--json file] [--sizes list] [--repeat n] [--save-file file] [--layout name] [--kernel name]\n"
+			"\tbrdf, [brdf2]\n"
+			"\tbrdf:\tFilename of the brdf to use.\n"
+			"\tbrdf2:\tSecond brdf of the anisotropic lookups (default: brdf).\n"
+			"\t--json:\tAlso write the results to this file as JSON.\n"
+			"\t--sizes:\tComma-separated frame sizes (default: 128,256,512).\n"
+			"\t--repeat:\tTimed runs per benchmark, of which the fastest is kept (default: 10).\n"
+			"\t--save-file:\tScratch file for the Image::save benchmark (default: brdfbench.bmp).\n"
+			"\t--layout:\tBRDF table layout: planar, interleaved or tiled (default: interleaved,\n"
+			"\t\tas the renderer).\n"
+			"\t--kernel:\tBatch lookup kernel to time: scalar, avx2 or avx512, if the CPU has it\n"
+			"\t\t(default: the widest the CPU has). Every kernel is checked against the\n"
+			"\t\tscalar lookups before timing either way.\n");
+		exit(1);
+	}
+	const char* filename = inputs[0];
+	const char* filename2 = inputs.size() > 1 ? inputs[1] : inputs[0];
+
+	BRDF brdf1, brdf2;
+	if (!read_brdf(filename, brdf1, layout) || !read_brdf(filename2, brdf2, layout))
+	{
+		fprintf(stderr, "Error reading %s\n", filename);
+		exit(1);
+	}
+
+	if (!check_frames())
+	{
+		exit(1);
+	}
+	{
+		GBuffer gbuffer;
+		gbuffer.build(CAMERA, SPHERE, 1, *std::max_element(sizes.begin(), sizes.end()));
+		FrameInputs frame;
+		frame_inputs(gbuffer, frame);
+		if (!check_kernels(brdf1, brdf2, frame) || !check_float_types(frame))
+		{
+			exit(1);
+		}
+	}
+
+	PerfCounters counters;
+	bool counted = counters.available();
+	if (!counted)
+	{
+		fprintf(stdout, "Hardware counters unavailable, reporting time only.\n");
+	}
+	fprintf(stdout, "%-32s %6s %12s %10s %6s %12s %12s\n", "benchmark", "size", "ns/op", "Mpix/s", "IPC",
+		"misses/op", "l1d/op");
+
+	std::vector<BenchResult> results;
+	for (size_t z = 0; z < sizes.size(); z++)
+	{
+		int size = sizes[z];
+		GBuffer gbuffer;
+		gbuffer.build(CAMERA, SPHERE, 1, size);
+		FrameInputs frame;
+		frame_inputs(gbuffer, frame);
+		int n = (int)frame.pixel.size();
+		if (n == 0)
+			continue;
+
+		// Both tangent frame constructions over the frame's normals.
+		results.push_back(run_bench(counters, "Frame::latitude", size, gbuffer.count, gbuffer.count, repeat, [&]()
+		{
+			double sum = 0;
+			for (int s = 0; s < gbuffer.count; s++)
+			{
+				Frame tangent = Frame::latitude(Vector3(gbuffer.nx[s], gbuffer.ny[s], gbuffer.nz[s]));
+				sum += tangent.s.x + tangent.t.y;
+			}
+			return sum;
+		}));
+		print_result(results.back(), counted);
+
+		results.push_back(run_bench(counters, "Frame::from_normal", size, gbuffer.count, gbuffer.count, repeat, [&]()
+		{
+			double sum = 0;
+			for (int s = 0; s < gbuffer.count; s++)
+			{
+				Frame tangent = Frame::from_normal(Vector3(gbuffer.nx[s], gbuffer.ny[s], gbuffer.nz[s]));
+				sum += tangent.s.x + tangent.t.y;
+			}
+			return sum;
+		}));
+		print_result(results.back(), counted);
+
+		// The original angle-based entry points take spherical angles.
+		std::vector<double> theta_in(n), fi_in(n), theta_out(n), fi_out(n);
+		for (int i = 0; i < n; i++)
+		{
+			theta_in[i] = acos(std::min(1.0, frame.wi[2][i]));
+			fi_in[i] = atan2(frame.wi[1][i], frame.wi[0][i]);
+			theta_out[i] = acos(std::min(1.0, frame.wo[2][i]));
+			fi_out[i] = atan2(frame.wo[1][i], frame.wo[0][i]);
+		}
+
+		results.push_back(run_bench(counters, "std_coords_to_half_diff_coords", size, n, n, repeat, [&]()
+		{
+			double sum = 0;
+			for (int i = 0; i < n; i++)
+			{
+				double theta_half, fi_half, theta_diff, fi_diff;
+				std_coords_to_half_diff_coords(theta_in[i], fi_in[i], theta_out[i], fi_out[i],
+					theta_half, fi_half, theta_diff, fi_diff);
+				sum += theta_half + fi_half + theta_diff + fi_diff;
+			}
+			return sum;
+		}));
+		print_result(results.back(), counted);
+
+		results.push_back(run_bench(counters, "lookup_brdf_val", size, n, n, repeat, [&]()
+		{
+			double sum = 0;
+			for (int i = 0; i < n; i++)
+			{
+				double red, green, blue;
+				lookup_brdf_val(brdf1, theta_in[i], fi_in[i], theta_out[i], fi_out[i], red, green, blue);
+				sum += red + green + blue;
+			}
+			return sum;
+		}));
+		print_result(results.back(), counted);
+
+		results.push_back(run_bench(counters, "lookup_aniso_brdf_val", size, n, n, repeat, [&]()
+		{
+			double sum = 0;
+			for (int i = 0; i < n; i++)
+			{
+				double red, green, blue;
+				lookup_aniso_brdf_val(brdf1, brdf2, theta_in[i], fi_in[i], theta_out[i], fi_out[i],
+					red, green, blue);
+				sum += red + green + blue;
+			}
+			return sum;
+		}));
+		print_result(results.back(), counted);
+
+		// The direction-based batch the renderer uses.
+		std::vector<double> rgb(3 * n);
+		const double* wi[3] = { &frame.wi[0][0], &frame.wi[1][0], &frame.wi[2][0] };
+		const double* wo[3] = { &frame.wo[0][0], &frame.wo[1][0], &frame.wo[2][0] };
+		results.push_back(run_bench(counters, "lookup_aniso_brdf_batch", size, n, n, repeat, [&]()
+		{
+			lookup_aniso_brdf_batch(brdf1, brdf2, wi, wo, n, &rgb[0]);
+			return rgb[0] + rgb[3 * n - 1];
+		}));
+		print_result(results.back(), counted);
+
+		// The renderer's default scene: the two materials mixed
+		// anisotropically, under one white light.
+		Image image(size, size);
+		BRDFBlend blend;
+		std::vector<float> weights(size * size, 1.0f);
+		blend.allocate(size * size);
+		blend.add_layer(&brdf1, BLEND_AZIMUTH_SIN, weights);
+		blend.add_layer(&brdf2, BLEND_AZIMUTH_COMPLEMENT, weights);
+		Light light;
+		light.position = LIGHT;
+		light.color = Vector3(25, 25, 25) * 255;
+		Scene scene;
+		scene.blend = &blend;
+		scene.interpolate = false;
+		scene.preview1 = NULL;
+		scene.preview2 = NULL;
+		scene.camera = CAMERA;
+		scene.lights.push_back(light);
+		scene.light_samples = 0;
+		scene.frame = 0;
+		scene.environment = NULL;
+		scene.environment_transfer = NULL;
+		scene.environment_scale = 0;
+		scene.supersample = 1;
+		scene.sphere = SPHERE;
+		scene.radius = 1;
+		scene.img_size = size;
+		results.push_back(run_bench(counters, "frame", size, 1, (double)size * size, repeat, [&]()
+		{
+			return shade_frame(scene, gbuffer, image);
+		}));
+		print_result(results.back(), counted);
+
+		bool saved = true;
+		results.push_back(run_bench(counters, "Image::save", size, 1, (double)size * size, repeat, [&]()
+		{
+			saved = image.save(save_file) && saved;
+			return 0.0;
+		}));
+		remove(save_file);
+		if (!saved)
+		{
+			fprintf(stderr, "Error writing %s\n", save_file);
+			exit(1);
+		}
+		print_result(results.back(), counted);
+	}
+	free_brdf(brdf1);
+	free_brdf(brdf2);
+
+	// The table is loaded afresh each time, so this is the cost of opening
+	// and mapping it and, for every layout but planar, copying it into that
+	// layout, with the file already in the page cache.
+	results.push_back(run_bench(counters, "read_brdf", 0, 1, 0, repeat, [&]()
+	{
+		BRDF brdf;
+		if (!read_brdf(filename, brdf, layout))
+		{
+			fprintf(stderr, "Error reading %s\n", filename);
+			exit(1);
+		}
+		double red, green, blue;
+		brdf_fetch(brdf, 0, 0, 0, red, green, blue);
+		free_brdf(brdf);
+		return red;
+	}));
+	print_result(results.back(), counted);
+
+	if (json && !write_json(json, filename, layout, counted, results))
+	{
+		fprintf(stderr, "Error writing %s\n", json);
+		exit(1);
+	}
+	return 0;
+}
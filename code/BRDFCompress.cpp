@@ -0,0 +1,222 @@
+#include "stdlib.h"
+#include "math.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "brdf.h"
+#include "brdflowrank.h"
+#include "threadpool.h"
+
+#define COMPRESS_SAMPLES 1000000
+
+// Read a written file back and check that its direction lookups give the
+// same values as the table it was written from, on the error samples.
+static bool verify_output(const char* filename, const LowRankBRDF& written, const std::vector<double>& directions)
+{
+	LowRankBRDF read;
+	if (!read_low_rank_brdf(filename, read))
+	{
+		fprintf(stderr, "Error reading back %s\n", filename);
+		return false;
+	}
+	for (size_t i = 0; i < directions.size() / 4; i++)
+	{
+		const double* d = &directions[4*i];
+		double wi[3] = { sin(d[0]) * cos(d[1]), sin(d[0]) * sin(d[1]), cos(d[0]) };
+		double wo[3] = { sin(d[2]) * cos(d[3]), sin(d[2]) * sin(d[3]), cos(d[2]) };
+		double expected[3], value[3];
+		int expected_ok = lookup_low_rank_brdf_dir(written, wi, wo, expected[0], expected[1], expected[2]);
+		int value_ok = lookup_low_rank_brdf_dir(read, wi, wo, value[0], value[1], value[2]);
+		if (value_ok != expected_ok || value[0] != expected[0] || value[1] != expected[1] || value[2] != expected[2])
+		{
+			fprintf(stderr, "%s reads back differently from what was written\n", filename);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Compress a BRDF to a low-rank file, reporting for each rank tried the
+// memory it takes, its error against lookup_brdf_val() and the cost of a
+// lookup, both whole and for the table fetch alone. The error is measured
+// on random direction pairs with cosine-weighted incident directions, as a
+// renderer would weight them: the relative RMS error over all channels and
+// the largest absolute one. A written file is read back and checked.
+int main(int argc, char *argv[])
+{
+	int rank = 8;
+	bool sweep = false;
+	int threads = ThreadPool::default_threads();
+	std::vector<const char*> args;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc)
+		{
+			rank = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--sweep") == 0)
+		{
+			sweep = true;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else
+		{
+			args.push_back(argv[i]);
+		}
+	}
+	if (args.empty() || rank < 1 || rank > BRDF_SAMPLING_RES_THETA_D)
+	{
+		fprintf(stdout, "USAGE: [--rank n] [--sweep] [--threads n] input, [output]\n"
+			"\tinput:\tFilename of the brdf to compress.\n"
+			"\toutput:\tFilename of the low-rank brdf to write, at --rank. The renderer\n"
+			"\t\treads it like any other brdf.\n"
+			"\t--rank:\tTerms kept per theta_half bin and channel, 1 to 90 (default: 8).\n"
+			"\t--sweep:\tAlso report ranks 1, 2, 4, ... 32.\n"
+			"\t--threads:\tNumber of fitting threads (default: all cores).\n");
+		exit(1);
+	}
+	const char *infilename = args[0];
+	const char *outfilename = args.size() > 1 ? args[1] : NULL;
+
+	BRDF brdf;
+	if (!read_brdf(infilename, brdf, BRDF_LAYOUT_INTERLEAVED))
+	{
+		fprintf(stderr, "Error reading %s\n", infilename);
+		exit(1);
+	}
+
+	std::vector<double> directions(4 * COMPRESS_SAMPLES);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	for (int i = 0; i < COMPRESS_SAMPLES; i++)
+	{
+		directions[4*i] = acos(sqrt(uniform(random)));
+		directions[4*i + 1] = 2.0 * PI * uniform(random);
+		directions[4*i + 2] = acos(uniform(random));
+		directions[4*i + 3] = 2.0 * PI * uniform(random);
+	}
+
+	std::vector<int> indices(3 * COMPRESS_SAMPLES);
+	for (int i = 0; i < COMPRESS_SAMPLES; i++)
+	{
+		const double* d = &directions[4*i];
+		double theta_half, fi_half, theta_diff, fi_diff;
+		std_coords_to_half_diff_coords(d[0], d[1], d[2], d[3], theta_half, fi_half, theta_diff, fi_diff);
+		indices[3*i] = theta_half_index(theta_half);
+		indices[3*i + 1] = theta_diff_index(theta_diff);
+		indices[3*i + 2] = phi_diff_index(fi_diff);
+	}
+
+	// The dense reference, and the time it takes.
+	std::vector<double> reference(3 * COMPRESS_SAMPLES);
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < COMPRESS_SAMPLES; i++)
+	{
+		const double* d = &directions[4*i];
+		lookup_brdf_val(brdf, d[0], d[1], d[2], d[3], reference[3*i], reference[3*i + 1], reference[3*i + 2]);
+	}
+	double dense_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	double sum = 0.0;
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < COMPRESS_SAMPLES; i++)
+	{
+		double red, green, blue;
+		brdf_fetch(brdf, indices[3*i], indices[3*i + 1], indices[3*i + 2], red, green, blue);
+		sum += red + green + blue;
+	}
+	double dense_fetch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	fprintf(stdout, "%-6s %10s %8s %12s %12s %10s %10s %10s\n",
+		"rank", "MB", "ratio", "rel. RMS", "max abs", "ns/lookup", "ns/fetch", "fit s");
+	fprintf(stdout, "%-6s %10.2f %8.2f %12s %12s %10.2f %10.2f %10s\n", "dense",
+		brdf_memory_size(brdf) / (1024.0 * 1024.0), 1.0, "-", "-",
+		dense_seconds * 1e9 / COMPRESS_SAMPLES, dense_fetch_seconds * 1e9 / COMPRESS_SAMPLES, "-");
+
+	std::vector<int> ranks;
+	if (sweep)
+	{
+		for (int r = 1; r <= 32; r *= 2)
+		{
+			if (r != rank)
+				ranks.push_back(r);
+		}
+	}
+	ranks.push_back(rank);
+
+	ThreadPool pool(threads);
+	bool ok = true;
+	for (size_t n = 0; n < ranks.size(); n++)
+	{
+		LowRankBRDF compressed;
+		begin = std::chrono::steady_clock::now();
+		compressed.allocate(ranks[n]);
+		pool.parallel_for(BRDF_SAMPLING_RES_THETA_H, [&](int bin)
+		{
+			compressed.build(brdf, bin, bin + 1);
+		});
+		double fit_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		std::vector<double> values(3 * COMPRESS_SAMPLES);
+		begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < COMPRESS_SAMPLES; i++)
+		{
+			const double* d = &directions[4*i];
+			lookup_low_rank_brdf_val(compressed, d[0], d[1], d[2], d[3], values[3*i], values[3*i + 1], values[3*i + 2]);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < COMPRESS_SAMPLES; i++)
+		{
+			double red, green, blue;
+			low_rank_brdf_fetch(compressed, indices[3*i], indices[3*i + 1], indices[3*i + 2], red, green, blue);
+			sum += red + green + blue;
+		}
+		double fetch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		// Missing entries match exactly, so they add nothing either way.
+		double error = 0.0, total = 0.0, largest = 0.0;
+		for (int i = 0; i < 3 * COMPRESS_SAMPLES; i++)
+		{
+			double expected = std::max(reference[i], 0.0);
+			double difference = std::max(values[i], 0.0) - expected;
+			error += difference * difference;
+			total += expected * expected;
+			largest = std::max(largest, fabs(difference));
+		}
+
+		size_t bytes = low_rank_brdf_memory_size(compressed);
+		fprintf(stdout, "%-6i %10.2f %8.2f %12.3e %12.3e %10.2f %10.2f %10.2f\n", ranks[n],
+			bytes / (1024.0 * 1024.0), (double)brdf_memory_size(brdf) / bytes,
+			total > 0.0 ? sqrt(error / total) : 0.0, largest,
+			seconds * 1e9 / COMPRESS_SAMPLES, fetch_seconds * 1e9 / COMPRESS_SAMPLES, fit_seconds);
+
+		if (n + 1 == ranks.size() && outfilename)
+		{
+			if (!write_low_rank_brdf(outfilename, compressed))
+			{
+				fprintf(stderr, "Error writing %s\n", outfilename);
+				ok = false;
+			}
+			else if (!verify_output(outfilename, compressed, directions))
+			{
+				ok = false;
+			}
+		}
+	}
+
+	// Keep the fetches from being optimised away.
+	if (sum == 0.123)
+	{
+		fprintf(stdout, " ");
+	}
+	free_brdf(brdf);
+	return ok ? 0 : 1;
+}
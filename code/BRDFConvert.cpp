@@ -0,0 +1,34 @@
+#include "stdlib.h"
+#include <stdio.h>
+#include "brdf.h"
+
+// Convert a MERL .binary file to the compact float format read by
+// read_brdf(). The compact file is half the size and has the channel scales
+// already applied.
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		fprintf(stdout, "USAGE: input, output\n"
+			"\tinput:\tFilename of the MERL brdf to convert.\n"
+			"\toutput:\tFilename of the compact brdf to write.\n");
+		exit(1);
+	}
+	const char *infilename = argv[1];
+	const char *outfilename = argv[2];
+	BRDF brdf;
+
+	if (!read_brdf(infilename, brdf))
+	{
+		fprintf(stderr, "Error reading %s\n", infilename);
+		exit(1);
+	}
+	if (!write_compact_brdf(outfilename, brdf))
+	{
+		fprintf(stderr, "Error writing %s\n", outfilename);
+		free_brdf(brdf);
+		exit(1);
+	}
+	free_brdf(brdf);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "stdlib.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "brdf.h"
+#include "analyticbrdf.h"
+#include "threadpool.h"
+
+// Fit analytic lobes to each BRDF given and write the parameters next to
+// it, with the extension replaced by .fit, for the renderer's --preview.
+// Materials are fitted in parallel; the error of each fit is reported as
+// the relative RMS difference over the whole table.
+int main(int argc, char *argv[])
+{
+	int lobes = 2;
+	int threads = ThreadPool::default_threads();
+	std::vector<const char*> inputs;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--lobes") == 0 && i + 1 < argc)
+		{
+			lobes = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else
+		{
+			inputs.push_back(argv[i]);
+		}
+	}
+	if (inputs.empty() || lobes < 1 || lobes > ANALYTIC_BRDF_MAX_LOBES)
+	{
+		fprintf(stdout, "USAGE: [--lobes n] [--threads n] brdf...\n"
+			"\tbrdf:\tFilenames of the brdfs to fit.\n"
+			"\t--lobes:\tSpecular lobes per material, 1 to %i (default: 2).\n"
+			"\t--threads:\tNumber of materials fitted at once (default: all cores).\n",
+			ANALYTIC_BRDF_MAX_LOBES);
+		exit(1);
+	}
+
+	int count = (int)inputs.size();
+	std::vector<double> errors(count, -1.0);
+	std::vector<std::string> outputs(count);
+	ThreadPool pool(threads);
+	pool.parallel_for(count, [&](int i)
+	{
+		std::string name = inputs[i];
+		size_t dot = name.find_last_of('.');
+		size_t slash = name.find_last_of("/\\");
+		if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+		{
+			name.resize(dot);
+		}
+		outputs[i] = name + ".fit";
+
+		BRDF brdf;
+		if (!read_brdf(inputs[i], brdf))
+		{
+			return;
+		}
+		AnalyticBRDF analytic;
+		double error = analytic.fit(brdf, lobes);
+		free_brdf(brdf);
+
+		char comment[1024];
+		snprintf(comment, sizeof(comment), "%s, %i lobes, relative RMS error %.4f", inputs[i], lobes, error);
+		if (write_analytic_brdf(outputs[i].c_str(), analytic, comment))
+		{
+			errors[i] = error;
+		}
+	});
+
+	int failed = 0;
+	fprintf(stdout, "%-40s %12s\n", "material", "rel. RMS");
+	for (int i = 0; i < count; i++)
+	{
+		if (errors[i] < 0.0)
+		{
+			fprintf(stderr, "Error fitting %s\n", inputs[i]);
+			failed++;
+			continue;
+		}
+		fprintf(stdout, "%-40s %12.4f\n", outputs[i].c_str(), errors[i]);
+	}
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+#include "stdlib.h"
+#include "math.h"
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "brdf.h"
+#include "gbuffer.h"
+#include "perfcounters.h"
+
+// Compare the table layouts on the lookups one frame of the renderer makes.
+// The table indices are computed up front, so only the fetches are timed.
+// Whole direction lookups are then timed both nearest and interpolated.
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stdout, "USAGE: brdf, [size], [repeat]\n"
+			"\tbrdf:\tFilename of the brdf to use.\n"
+			"\tsize:\tThe width and height of the frame (default: 512).\n"
+			"\trepeat:\tNumber of passes over the frame (default: 20).\n");
+		exit(1);
+	}
+	const char *filename = argv[1];
+	int img_size = argc > 2 ? atoi(argv[2]) : 512;
+	int repeat = argc > 3 ? atoi(argv[3]) : 20;
+
+	// Indices for every hit pixel of a frame, in pixel order, lit from the
+	// renderer's first light position.
+	GBuffer gbuffer;
+	gbuffer.build(Vector3(0, 0, -2.5), Vector3(0), 1, img_size);
+	Vector3 light = Vector3(5, 5, -5);
+	std::vector<int> theta_half_ind(gbuffer.count);
+	std::vector<int> theta_diff_ind(gbuffer.count);
+	std::vector<int> phi_diff_ind(gbuffer.count);
+	std::vector<double> directions(6 * gbuffer.count);
+	for (int i = 0; i < gbuffer.count; i++)
+	{
+		Vector3 intersection = Vector3(gbuffer.px[i], gbuffer.py[i], gbuffer.pz[i]);
+		Vector3 normal = Vector3(gbuffer.nx[i], gbuffer.ny[i], gbuffer.nz[i]);
+		Vector3 toLight = (light - intersection).normal();
+		double wi[3] = {
+			gbuffer.tx[i] * toLight.x + gbuffer.ty[i] * toLight.y + gbuffer.tz[i] * toLight.z,
+			gbuffer.bx[i] * toLight.x + gbuffer.by[i] * toLight.y + gbuffer.bz[i] * toLight.z,
+			normal.dot_product(toLight)
+		};
+		double wo[3] = { gbuffer.wox[i], gbuffer.woy[i], gbuffer.woz[i] };
+		for (int a = 0; a < 3; a++)
+		{
+			directions[6*i + a] = wi[a];
+			directions[6*i + 3 + a] = wo[a];
+		}
+		double sin_2phi_half;
+		brdf_dir_indices(wi, wo, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], sin_2phi_half);
+	}
+
+	const char* names[] = { "planar", "interleaved", "tiled" };
+	BRDFLayout layouts[] = { BRDF_LAYOUT_PLANAR, BRDF_LAYOUT_INTERLEAVED, BRDF_LAYOUT_TILED };
+
+	PerfCounters counters;
+	if (!counters.available())
+	{
+		fprintf(stdout, "Hardware counters unavailable, reporting time only.\n");
+	}
+	fprintf(stdout, "%-12s %10s %14s %14s %10s %10s\n", "layout", "ns/lookup", "misses/lookup", "l1d/lookup",
+		"ns/dir", "ns/interp");
+
+	std::chrono::steady_clock::time_point begin;
+	for (int l = 0; l < 3; l++)
+	{
+		BRDF brdf;
+		if (!read_brdf(filename, brdf, layouts[l]))
+		{
+			fprintf(stderr, "Error reading %s\n", filename);
+			exit(1);
+		}
+
+		// One untimed pass so that page faults on the mapping are not counted.
+		double sum = 0;
+		for (int pass = 0; pass <= repeat; pass++)
+		{
+			if (pass == 1)
+			{
+				begin = std::chrono::steady_clock::now();
+				counters.start();
+			}
+			for (int i = 0; i < gbuffer.count; i++)
+			{
+				double red, green, blue;
+				brdf_fetch(brdf, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], red, green, blue);
+				sum += red + green + blue;
+			}
+		}
+		counters.stop();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		double lookups = (double)gbuffer.count * repeat;
+
+		double dir_seconds[2];
+		for (int interpolate = 0; interpolate < 2; interpolate++)
+		{
+			begin = std::chrono::steady_clock::now();
+			for (int pass = 0; pass < repeat; pass++)
+			{
+				for (int i = 0; i < gbuffer.count; i++)
+				{
+					double red, green, blue;
+					const double* d = &directions[6*i];
+					if (interpolate)
+						lookup_brdf_dir_interpolated(brdf, d, d + 3, red, green, blue);
+					else
+						lookup_brdf_dir(brdf, d, d + 3, red, green, blue);
+					sum += red + green + blue;
+				}
+			}
+			dir_seconds[interpolate] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		}
+
+		fprintf(stdout, "%-12s %10.2f %14.3f %14.3f %10.2f %10.2f\n", names[l],
+			seconds * 1e9 / lookups,
+			counters.value(PerfCounters::CACHE_MISSES) / lookups,
+			counters.value(PerfCounters::L1D_READ_MISSES) / lookups,
+			dir_seconds[0] * 1e9 / lookups, dir_seconds[1] * 1e9 / lookups);
+
+		// Keep the loads from being optimised away.
+		if (sum == 0.123)
+		{
+			fprintf(stdout, " ");
+		}
+		free_brdf(brdf);
+	}
+	return 0;
+}
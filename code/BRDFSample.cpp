@@ -0,0 +1,144 @@
+#include "stdlib.h"
+#include "math.h"
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include "brdf.h"
+#include "brdfsampler.h"
+
+// Relative difference allowed between the pdf sample() returns and pdf()
+// for the same direction. They only differ where the two round a half
+// vector on a theta_half bin edge into different bins.
+#define PDF_TOLERANCE 1e-4
+// Share of samples allowed to differ by more than that.
+#define PDF_MISMATCH_SHARE 1e-3
+// Allowed error of the pdf's integral, which should be 1 less the share of
+// samples rejected below the horizon, in standard errors of the uniform
+// estimate of it.
+#define INTEGRAL_TOLERANCE 4.0
+
+static double luminance(double red, double green, double blue)
+{
+	return 0.2126 * red + 0.7152 * green + 0.0722 * blue;
+}
+
+// f(wi, wo) cos(theta_in), as luminance.
+static double reflected(const BRDF& brdf, const double* wi, const double* wo)
+{
+	double red, green, blue;
+	if (!lookup_brdf_dir(brdf, wi, wo, red, green, blue))
+	{
+		return 0.0;
+	}
+	return luminance(red, green, blue) * wi[2];
+}
+
+// Mean and variance per sample of an estimator.
+struct Estimate {
+	double sum;
+	double sum2;
+	int n;
+
+	void add(double x) { sum += x; sum2 += x * x; n++; }
+	double mean() const { return sum / n; }
+	double variance() const { return std::max(0.0, sum2 / n - mean() * mean()); }
+};
+
+// Check BRDFSampler against itself and against uniform sampling for a range
+// of view elevations:
+// - the pdf returned with each sample agrees with pdf() for that direction;
+// - pdf() integrates to 1 over the hemisphere, less the samples rejected
+//   below the horizon;
+// - the variance of the albedo estimate, f cos(theta_in) / pdf, compared
+//   with uniform hemisphere sampling at the same sample count.
+// Exits with 1 if one of the first two does not hold.
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stdout, "USAGE: brdf, [samples]\n"
+			"\tbrdf:\tFilename of the brdf to use.\n"
+			"\tsamples:\tSamples per view direction (default: 200000).\n");
+		exit(1);
+	}
+	const char *filename = argv[1];
+	int samples = argc > 2 ? atoi(argv[2]) : 200000;
+
+	BRDF brdf;
+	if (!read_brdf(filename, brdf))
+	{
+		fprintf(stderr, "Error reading %s\n", filename);
+		exit(1);
+	}
+	BRDFSampler sampler;
+	sampler.build(brdf);
+
+	std::mt19937 random(1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const double angles[] = { 0, 15, 30, 45, 60, 75, 85 };
+	bool passed = true;
+
+	fprintf(stdout, "%8s %10s %10s %10s %10s %10s %14s %14s %10s\n", "theta_o", "rejected", "mismatch", "integral",
+		"std err", "albedo", "var uniform", "var sampler", "ratio");
+	for (size_t a = 0; a < sizeof(angles) / sizeof(angles[0]); a++)
+	{
+		double theta_out = angles[a] * PI / 180.0;
+		double wo[3] = { sin(theta_out) * cos(0.3), sin(theta_out) * sin(0.3), cos(theta_out) };
+
+		Estimate uniform_estimate = {};
+		Estimate sampler_estimate = {};
+		Estimate integral = {};
+		int rejected = 0;
+		int mismatched = 0;
+		for (int s = 0; s < samples; s++)
+		{
+			// Uniform over the hemisphere, pdf 1 / (2 pi).
+			double z = uniform(random);
+			double phi = 2.0 * PI * uniform(random);
+			double r = sqrt(std::max(0.0, 1.0 - z * z));
+			double wi[3] = { r * cos(phi), r * sin(phi), z };
+			uniform_estimate.add(reflected(brdf, wi, wo) * 2.0 * PI);
+			integral.add(sampler.pdf(wo, wi) * 2.0 * PI);
+
+			double p = sampler.sample(wo, uniform(random), uniform(random), wi);
+			if (p <= 0.0)
+			{
+				rejected++;
+				sampler_estimate.add(0.0);
+				continue;
+			}
+			sampler_estimate.add(reflected(brdf, wi, wo) / p);
+			double q = sampler.pdf(wo, wi);
+			if (fabs(p - q) > PDF_TOLERANCE * std::max(p, q))
+			{
+				mismatched++;
+			}
+		}
+		double rejected_share = (double)rejected / samples;
+		double mismatched_share = (double)mismatched / samples;
+		double error = integral.mean() - (1.0 - rejected_share);
+		double standard_error = sqrt(integral.variance() / samples);
+		double ratio = sampler_estimate.variance() > 0.0
+			? uniform_estimate.variance() / sampler_estimate.variance() : 0.0;
+		fprintf(stdout, "%8.0f %10.4f %10.4f %10.4f %10.4f %10.4f %14.6g %14.6g %10.2f\n", angles[a], rejected_share,
+			mismatched_share, integral.mean(), standard_error, sampler_estimate.mean(), uniform_estimate.variance(),
+			sampler_estimate.variance(), ratio);
+
+		if (mismatched_share > PDF_MISMATCH_SHARE)
+		{
+			fprintf(stderr, "theta_o %.0f: sample() and pdf() disagree on %.2f%% of samples\n", angles[a],
+				100.0 * mismatched_share);
+			passed = false;
+		}
+		if (fabs(error) > INTEGRAL_TOLERANCE * standard_error)
+		{
+			fprintf(stderr, "theta_o %.0f: pdf integrates to %.4f +- %.4f, expected %.4f\n", angles[a],
+				integral.mean(), standard_error, 1.0 - rejected_share);
+			passed = false;
+		}
+	}
+	fprintf(stdout, "ratio: variance of uniform hemisphere sampling over that of the sampler.\n");
+
+	free_brdf(brdf);
+	return passed ? 0 : 1;
+}
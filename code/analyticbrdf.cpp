@@ -0,0 +1,397 @@
+#include "analyticbrdf.h"
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+// Table entries used by the fit: every theta_half bin, and every
+// FIT_STEP_TD-th theta_diff and FIT_STEP_PD-th phi_diff bin.
+#define FIT_STEP_TD 3
+#define FIT_STEP_PD 6
+#define FIT_ITERATIONS 200
+#define FIT_MAX_PARAMS (3 + 5 * ANALYTIC_BRDF_MAX_LOBES)
+
+// Directions at the centre of a table entry, with the half vector in the
+// xz plane.
+static bool entry_directions(int theta_half_ind, int theta_diff_ind, int phi_diff_ind, double* wi, double* wo)
+{
+	double t = (theta_half_ind + 0.5) / BRDF_SAMPLING_RES_THETA_H;
+	double theta_half = t * t * 0.5 * PI;
+	double theta_diff = (theta_diff_ind + 0.5) / BRDF_SAMPLING_RES_THETA_D * 0.5 * PI;
+	double phi_diff = (phi_diff_ind + 0.5) / (BRDF_SAMPLING_RES_PHI_D / 2) * PI;
+
+	double d[3] = { sin(theta_diff) * cos(phi_diff), sin(theta_diff) * sin(phi_diff), cos(theta_diff) };
+	double h[3] = { sin(theta_half), 0.0, cos(theta_half) };
+	wi[0] = d[0] * cos(theta_half) + d[2] * sin(theta_half);
+	wi[1] = d[1];
+	wi[2] = d[2] * cos(theta_half) - d[0] * sin(theta_half);
+	double dot = 2.0 * (wi[0] * h[0] + wi[2] * h[2]);
+	wo[0] = dot * h[0] - wi[0];
+	wo[1] = -wi[1];
+	wo[2] = dot * h[2] - wi[2];
+	return wi[2] > 0.0 && wo[2] > 0.0;
+}
+
+struct FitSample {
+	double wi[3];
+	double wo[3];
+	// log(1 + f cos(theta_in)) of the table, per channel.
+	double target[3];
+};
+
+// Parameters are optimised unconstrained: logs of the colours and
+// roughness, and the logit of f0.
+static void decode(const double* p, int lobes, AnalyticBRDF& brdf)
+{
+	brdf.lobes = lobes;
+	for (int channel = 0; channel < 3; channel++)
+	{
+		brdf.diffuse[channel] = exp(p[channel]);
+	}
+	for (int l = 0; l < lobes; l++)
+	{
+		const double* q = p + 3 + 5 * l;
+		for (int channel = 0; channel < 3; channel++)
+		{
+			brdf.lobe[l].specular[channel] = exp(q[channel]);
+		}
+		brdf.lobe[l].roughness = std::min(1.0, std::max(1e-3, exp(q[3])));
+		brdf.lobe[l].f0 = 1.0 / (1.0 + exp(-q[4]));
+	}
+}
+
+static void residuals(const double* p, int lobes, const FitSample& sample, double* r)
+{
+	AnalyticBRDF brdf;
+	decode(p, lobes, brdf);
+	double rgb[3];
+	eval_analytic_brdf_dir(brdf, sample.wi, sample.wo, rgb[0], rgb[1], rgb[2]);
+	for (int channel = 0; channel < 3; channel++)
+	{
+		r[channel] = log(1.0 + rgb[channel] * sample.wi[2]) - sample.target[channel];
+	}
+}
+
+static double cost(const double* p, int lobes, const std::vector<FitSample>& samples)
+{
+	double sum = 0.0;
+	for (size_t s = 0; s < samples.size(); s++)
+	{
+		double r[3];
+		residuals(p, lobes, samples[s], r);
+		sum += r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+	}
+	return sum;
+}
+
+// Solve the n x n system a x = b in place by Gaussian elimination with
+// partial pivoting. Returns false if it is singular.
+static bool solve(double* a, double* b, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		int pivot = i;
+		for (int r = i + 1; r < n; r++)
+		{
+			if (fabs(a[r * n + i]) > fabs(a[pivot * n + i]))
+				pivot = r;
+		}
+		if (a[pivot * n + i] == 0.0)
+			return false;
+		for (int j = 0; j < n; j++)
+		{
+			std::swap(a[i * n + j], a[pivot * n + j]);
+		}
+		std::swap(b[i], b[pivot]);
+		for (int r = i + 1; r < n; r++)
+		{
+			double f = a[r * n + i] / a[i * n + i];
+			for (int j = i; j < n; j++)
+			{
+				a[r * n + j] -= f * a[i * n + j];
+			}
+			b[r] -= f * b[i];
+		}
+	}
+	for (int i = n - 1; i >= 0; i--)
+	{
+		for (int j = i + 1; j < n; j++)
+		{
+			b[i] -= a[i * n + j] * b[j];
+		}
+		b[i] /= a[i * n + i];
+	}
+	return true;
+}
+
+// Levenberg-Marquardt from `p`, with a forward-difference Jacobian.
+// Returns the final cost.
+static double minimise(double* p, int lobes, const std::vector<FitSample>& samples)
+{
+	const int n = 3 + 5 * lobes;
+	const double step = 1e-5;
+	double lambda = 1e-3;
+	double current = cost(p, lobes, samples);
+
+	for (int iteration = 0; iteration < FIT_ITERATIONS; iteration++)
+	{
+		double jtj[FIT_MAX_PARAMS * FIT_MAX_PARAMS] = { 0.0 };
+		double jtr[FIT_MAX_PARAMS] = { 0.0 };
+		for (size_t s = 0; s < samples.size(); s++)
+		{
+			double r[3];
+			double jacobian[FIT_MAX_PARAMS][3];
+			residuals(p, lobes, samples[s], r);
+			for (int k = 0; k < n; k++)
+			{
+				double moved[FIT_MAX_PARAMS];
+				std::copy(p, p + n, moved);
+				moved[k] += step;
+				double rk[3];
+				residuals(moved, lobes, samples[s], rk);
+				for (int channel = 0; channel < 3; channel++)
+				{
+					jacobian[k][channel] = (rk[channel] - r[channel]) / step;
+				}
+			}
+			for (int k = 0; k < n; k++)
+			{
+				for (int channel = 0; channel < 3; channel++)
+				{
+					jtr[k] += jacobian[k][channel] * r[channel];
+				}
+				for (int m = k; m < n; m++)
+				{
+					double sum = 0.0;
+					for (int channel = 0; channel < 3; channel++)
+					{
+						sum += jacobian[k][channel] * jacobian[m][channel];
+					}
+					jtj[k * n + m] += sum;
+				}
+			}
+		}
+		for (int k = 0; k < n; k++)
+		{
+			for (int m = 0; m < k; m++)
+			{
+				jtj[k * n + m] = jtj[m * n + k];
+			}
+		}
+
+		// Raise the damping until a step lowers the cost.
+		bool improved = false;
+		while (!improved && lambda < 1e12)
+		{
+			double a[FIT_MAX_PARAMS * FIT_MAX_PARAMS];
+			double delta[FIT_MAX_PARAMS];
+			std::copy(jtj, jtj + n * n, a);
+			for (int k = 0; k < n; k++)
+			{
+				a[k * n + k] += lambda * (jtj[k * n + k] + 1e-12);
+				delta[k] = -jtr[k];
+			}
+			if (solve(a, delta, n))
+			{
+				double candidate[FIT_MAX_PARAMS];
+				for (int k = 0; k < n; k++)
+				{
+					candidate[k] = p[k] + delta[k];
+				}
+				double next = cost(candidate, lobes, samples);
+				if (next < current)
+				{
+					improved = true;
+					double gain = current - next;
+					std::copy(candidate, candidate + n, p);
+					current = next;
+					lambda = std::max(lambda / 3.0, 1e-9);
+					if (gain < 1e-9 * current)
+						return current;
+					break;
+				}
+			}
+			lambda *= 4.0;
+		}
+		if (!improved)
+			break;
+	}
+	return current;
+}
+
+double AnalyticBRDF::fit(const BRDF& table, int lobes)
+{
+	lobes = std::max(1, std::min(lobes, ANALYTIC_BRDF_MAX_LOBES));
+
+	std::vector<FitSample> samples;
+	double peak[3] = { 0.0, 0.0, 0.0 };
+	double diffuse_sum[3] = { 0.0, 0.0, 0.0 };
+	int diffuse_count = 0;
+	for (int h = 0; h < BRDF_SAMPLING_RES_THETA_H; h++)
+	{
+		for (int d = 0; d < BRDF_SAMPLING_RES_THETA_D; d += FIT_STEP_TD)
+		{
+			for (int p = 0; p < BRDF_SAMPLING_RES_PHI_D / 2; p += FIT_STEP_PD)
+			{
+				FitSample sample;
+				double rgb[3];
+				brdf_fetch(table, h, d, p, rgb[0], rgb[1], rgb[2]);
+				if (rgb[0] < 0.0 || rgb[1] < 0.0 || rgb[2] < 0.0 ||
+					!entry_directions(h, d, p, sample.wi, sample.wo))
+					continue;
+				for (int channel = 0; channel < 3; channel++)
+				{
+					sample.target[channel] = log(1.0 + rgb[channel] * sample.wi[2]);
+					peak[channel] = std::max(peak[channel], rgb[channel]);
+					if (h >= BRDF_SAMPLING_RES_THETA_H * 3 / 4)
+						diffuse_sum[channel] += rgb[channel];
+				}
+				if (h >= BRDF_SAMPLING_RES_THETA_H * 3 / 4)
+					diffuse_count++;
+				samples.push_back(sample);
+			}
+		}
+	}
+
+	// Start from a diffuse level taken far from the highlight and lobes of
+	// increasing width sharing the peak, from a few first roughnesses, and
+	// keep the best result.
+	const double starts[] = { 0.03, 0.1, 0.3 };
+	double best_cost = -1.0;
+	double best[FIT_MAX_PARAMS];
+	const int n = 3 + 5 * lobes;
+	for (int start = 0; start < 3; start++)
+	{
+		double p[FIT_MAX_PARAMS];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			double level = diffuse_count > 0 ? diffuse_sum[channel] / diffuse_count : 0.0;
+			p[channel] = log(std::max(level * PI, 1e-4));
+		}
+		for (int l = 0; l < lobes; l++)
+		{
+			double roughness = std::min(1.0, starts[start] * pow(4.0, l));
+			double share = pow(0.1, l);
+			for (int channel = 0; channel < 3; channel++)
+			{
+				// At normal incidence D = 1 / (pi a^2) and G / (4 cos cos) = 1 / 4.
+				double specular = peak[channel] * 4.0 * PI * roughness * roughness * share / 0.5;
+				p[3 + 5 * l + channel] = log(std::max(specular, 1e-4));
+			}
+			p[3 + 5 * l + 3] = log(roughness);
+			p[3 + 5 * l + 4] = 0.0;
+		}
+		double c = minimise(p, lobes, samples);
+		if (best_cost < 0.0 || c < best_cost)
+		{
+			best_cost = c;
+			std::copy(p, p + n, best);
+		}
+	}
+	decode(best, lobes, *this);
+
+	// Error over the whole table, weighted by cos(theta_in) as the
+	// renderer weights it.
+	double error = 0.0, total = 0.0;
+	for (int h = 0; h < BRDF_SAMPLING_RES_THETA_H; h++)
+	{
+		for (int d = 0; d < BRDF_SAMPLING_RES_THETA_D; d++)
+		{
+			for (int p = 0; p < BRDF_SAMPLING_RES_PHI_D / 2; p++)
+			{
+				double wi[3], wo[3], rgb[3], model[3];
+				brdf_fetch(table, h, d, p, rgb[0], rgb[1], rgb[2]);
+				if (rgb[0] < 0.0 || rgb[1] < 0.0 || rgb[2] < 0.0 ||
+					!entry_directions(h, d, p, wi, wo))
+					continue;
+				eval_analytic_brdf_dir(*this, wi, wo, model[0], model[1], model[2]);
+				for (int channel = 0; channel < 3; channel++)
+				{
+					double difference = (model[channel] - rgb[channel]) * wi[2];
+					error += difference * difference;
+					total += rgb[channel] * wi[2] * rgb[channel] * wi[2];
+				}
+			}
+		}
+	}
+	return total > 0.0 ? sqrt(error / total) : 0.0;
+}
+
+void eval_aniso_analytic_brdf_batch(const AnalyticBRDF& brdf1, const AnalyticBRDF& brdf2,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out)
+{
+	for (int i = 0; i < n; i++)
+	{
+		double in[3] = { wi[0][i], wi[1][i], wi[2][i] };
+		double out[3] = { wo[0][i], wo[1][i], wo[2][i] };
+		double rgb1[3], rgb2[3];
+		eval_analytic_brdf_dir(brdf1, in, out, rgb1[0], rgb1[1], rgb1[2]);
+		eval_analytic_brdf_dir(brdf2, in, out, rgb2[0], rgb2[1], rgb2[2]);
+
+		double hx = in[0] + out[0];
+		double hy = in[1] + out[1];
+		double r2 = hx*hx + hy*hy;
+		double mix = 0.5 * ((r2 > 0.0 ? 2.0 * hx * hy / r2 : 0.0) + 1.0);
+		for (int channel = 0; channel < 3; channel++)
+		{
+			rgb_out[3*i + channel] = mix * rgb1[channel] + (1 - mix) * rgb2[channel];
+		}
+	}
+}
+
+bool read_analytic_brdf(const char* filename, AnalyticBRDF& brdf)
+{
+	FILE* file = fopen(filename, "r");
+	if (!file)
+		return false;
+
+	char line[1024];
+	bool ok = true;
+	bool have_diffuse = false;
+	brdf.lobes = 0;
+	while (ok && fgets(line, sizeof(line), file))
+	{
+		char* start = line;
+		while (*start == ' ' || *start == '\t')
+			start++;
+		if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0')
+			continue;
+
+		if (strncmp(start, "diffuse", 7) == 0)
+		{
+			ok = sscanf(start + 7, "%lf %lf %lf", &brdf.diffuse[0], &brdf.diffuse[1], &brdf.diffuse[2]) == 3;
+			have_diffuse = true;
+		}
+		else if (strncmp(start, "lobe", 4) == 0 && brdf.lobes < ANALYTIC_BRDF_MAX_LOBES)
+		{
+			AnalyticLobe& lobe = brdf.lobe[brdf.lobes++];
+			ok = sscanf(start + 4, "%lf %lf %lf %lf %lf", &lobe.specular[0], &lobe.specular[1],
+				&lobe.specular[2], &lobe.roughness, &lobe.f0) == 5;
+		}
+		else
+		{
+			ok = false;
+		}
+	}
+	fclose(file);
+	return ok && have_diffuse;
+}
+
+bool write_analytic_brdf(const char* filename, const AnalyticBRDF& brdf, const char* comment)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
+
+	if (comment)
+	{
+		fprintf(file, "# %s\n", comment);
+	}
+	fprintf(file, "diffuse %.9g %.9g %.9g\n", brdf.diffuse[0], brdf.diffuse[1], brdf.diffuse[2]);
+	for (int l = 0; l < brdf.lobes; l++)
+	{
+		const AnalyticLobe& lobe = brdf.lobe[l];
+		fprintf(file, "lobe %.9g %.9g %.9g %.9g %.9g\n", lobe.specular[0], lobe.specular[1],
+			lobe.specular[2], lobe.roughness, lobe.f0);
+	}
+	return fclose(file) == 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __ANALYTICBRDF_H__
+#define __ANALYTICBRDF_H__
+
+#include "brdf.h"
+
+#define ANALYTIC_BRDF_MAX_LOBES 3
+
+// One Cook-Torrance lobe: GGX distribution, Smith shadowing and Schlick
+// Fresnel, tinted by `specular`.
+struct AnalyticLobe {
+	double specular[3];
+	double roughness;
+	double f0;
+};
+
+// A closed-form stand-in for a measured BRDF: Lambertian diffuse plus up to
+// ANALYTIC_BRDF_MAX_LOBES specular lobes, in the same scaled units as the
+// tables. Evaluating it reads a few dozen bytes instead of a table entry.
+struct AnalyticBRDF {
+	double diffuse[3];
+	int lobes;
+	AnalyticLobe lobe[ANALYTIC_BRDF_MAX_LOBES];
+
+	// Levenberg-Marquardt fit to the table, minimising the difference of
+	// log(1 + f cos(theta_in)) over a subsampled grid of table entries.
+	// Returns the relative RMS error of f cos(theta_in) over the full table.
+	double fit(const BRDF&, int lobes);
+};
+
+// Value for a pair of unit tangent-space directions (z along the normal),
+// like lookup_brdf_dir(). Returns 0 below the horizon.
+inline int eval_analytic_brdf_dir(const AnalyticBRDF& brdf, const double* wi, const double* wo,
+	double& red_val, double& green_val, double& blue_val)
+{
+	double cos_in = wi[2];
+	double cos_out = wo[2];
+	if (cos_in <= 0.0 || cos_out <= 0.0)
+	{
+		red_val = green_val = blue_val = 0.0;
+		return 0;
+	}
+	double hx = wi[0] + wo[0];
+	double hy = wi[1] + wo[1];
+	double hz = wi[2] + wo[2];
+	double len = sqrt(hx*hx + hy*hy + hz*hz);
+	double cos_half = hz / len;
+	double cos_diff = (hx*wi[0] + hy*wi[1] + hz*wi[2]) / len;
+	double schlick = 1.0 - cos_diff;
+	schlick = schlick * schlick * schlick * schlick * schlick;
+
+	double rgb[3] = { brdf.diffuse[0] / PI, brdf.diffuse[1] / PI, brdf.diffuse[2] / PI };
+	for (int l = 0; l < brdf.lobes; l++)
+	{
+		const AnalyticLobe& lobe = brdf.lobe[l];
+		double a2 = lobe.roughness * lobe.roughness;
+		double t = cos_half * cos_half * (a2 - 1.0) + 1.0;
+		double d = a2 / (PI * t * t);
+		// Smith G divided by 4 cos_in cos_out.
+		double g = 1.0 / ((cos_in + sqrt(a2 + (1.0 - a2) * cos_in * cos_in)) *
+			(cos_out + sqrt(a2 + (1.0 - a2) * cos_out * cos_out)));
+		double f = lobe.f0 + (1.0 - lobe.f0) * schlick;
+		double s = d * g * f;
+		for (int channel = 0; channel < 3; channel++)
+		{
+			rgb[channel] += lobe.specular[channel] * s;
+		}
+	}
+	red_val = rgb[0];
+	green_val = rgb[1];
+	blue_val = rgb[2];
+	return 1;
+}
+
+// The analytic form of lookup_aniso_brdf_batch(): the two materials mixed
+// by half-vector azimuth, zero below the horizon.
+void eval_aniso_analytic_brdf_batch(const AnalyticBRDF&, const AnalyticBRDF&,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out);
+
+// Read or write the fitted parameters as text: "diffuse r g b" and then one
+// "lobe r g b roughness f0" line per lobe, with lines starting with '#'
+// ignored.
+bool read_analytic_brdf(const char*, AnalyticBRDF&);
+bool write_analytic_brdf(const char*, const AnalyticBRDF&, const char* comment);
+
+#endif
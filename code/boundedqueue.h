@@ -0,0 +1,86 @@
+#ifndef __BOUNDEDQUEUE_H__
+#define __BOUNDEDQUEUE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// FIFO shared between pipeline stages. push() blocks while the queue holds
+// `capacity` items, which caps how far a producer can run ahead.
+template <typename T>
+class BoundedQueue {
+private:
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+	std::mutex lock;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+
+public:
+	BoundedQueue(size_t capacity)
+		: capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+	void push(const T& item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		not_full.wait(guard, [this] { return items.size() < capacity; });
+		items.push_back(item);
+		not_empty.notify_one();
+	}
+
+	// Returns false once the queue is closed and drained.
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		not_empty.wait(guard, [this] { return closed || !items.empty(); });
+		if (items.empty())
+		{
+			return false;
+		}
+		item = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		not_empty.notify_all();
+	}
+};
+
+// Hands items numbered 0, 1, 2, ... to a stage that takes them in order.
+// wait(n) blocks until n is within `window` of the next item that stage
+// needs, so items finished early cannot pile up behind a slow one. This
+// cannot deadlock as long as items are started in order, since the one
+// needed next is then never among those waiting.
+class SequenceWindow {
+private:
+	int next;
+	int window;
+	std::mutex lock;
+	std::condition_variable advanced;
+
+public:
+	SequenceWindow(int window)
+		: next(0), window(window > 0 ? window : 1) {}
+
+	void wait(int number)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		advanced.wait(guard, [this, number] { return number < next + window; });
+	}
+
+	// The stage is done with the next item.
+	void advance()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		next++;
+		advanced.notify_all();
+	}
+};
+
+#endif
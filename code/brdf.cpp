@@ -0,0 +1,817 @@
+// Copyright 2005 Mitsubishi Electric Research Laboratories All Rights Reserved.
+
+// Permission to use, copy and modify this software and its documentation without
+// fee for educational, research and non-profit purposes, is hereby granted, provided
+// that the above copyright notice and the following three paragraphs appear in all copies.
+
+// To request permission to incorporate this software into commercial products contact:
+// Vice President of Marketing and Business Development;
+// Mitsubishi Electric Research Laboratories (MERL), 201 Broadway, Cambridge, MA 02139 or 
+// <license@merl.com>.
+
+// IN NO EVENT SHALL MERL BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL,
+// OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND
+// ITS DOCUMENTATION, EVEN IF MERL HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+
+// MERL SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED
+// HEREUNDER IS ON AN "AS IS" BASIS, AND MERL HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT,
+// UPDATES, ENHANCEMENTS OR MODIFICATIONS.
+
+
+#include "brdf.h"
+#include "brdflowrank.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// cross product of two vectors
+void cross_product (double* v1, double* v2, double* out)
+{
+	out[0] = v1[1]*v2[2] - v1[2]*v2[1];
+	out[1] = v1[2]*v2[0] - v1[0]*v2[2];
+	out[2] = v1[0]*v2[1] - v1[1]*v2[0];
+}
+
+// normalize vector
+void normalize(double* v)
+{
+	// normalize
+	double len = sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+	v[0] = v[0] / len;
+	v[1] = v[1] / len;
+	v[2] = v[2] / len;
+}
+
+// rotate vector along one axis
+void rotate_vector(double* vector, double* axis, double angle, double* out)
+{
+	double temp;
+	double cross[3];
+	double cos_ang = cos(angle);
+	double sin_ang = sin(angle);
+
+	out[0] = vector[0] * cos_ang;
+	out[1] = vector[1] * cos_ang;
+	out[2] = vector[2] * cos_ang;
+
+	temp = axis[0]*vector[0]+axis[1]*vector[1]+axis[2]*vector[2];
+	temp = temp*(1.0-cos_ang);
+
+	out[0] += axis[0] * temp;
+	out[1] += axis[1] * temp;
+	out[2] += axis[2] * temp;
+
+	cross_product (axis,vector,cross);
+
+	out[0] += cross[0] * sin_ang;
+	out[1] += cross[1] * sin_ang;
+	out[2] += cross[2] * sin_ang;
+}
+
+
+// convert standard coordinates to half vector/difference vector coordinates
+void std_coords_to_half_diff_coords(double theta_in, double fi_in, double theta_out, double fi_out,
+								double& theta_half,double& fi_half,double& theta_diff,double& fi_diff )
+{
+
+	// compute in vector
+	double in_vec_z = cos(theta_in);
+	double proj_in_vec = sin(theta_in);
+	double in_vec_x = proj_in_vec*cos(fi_in);
+	double in_vec_y = proj_in_vec*sin(fi_in);
+	double in[3]= {in_vec_x,in_vec_y,in_vec_z};
+	normalize(in);
+
+
+	// compute out vector
+	double out_vec_z = cos(theta_out);
+	double proj_out_vec = sin(theta_out);
+	double out_vec_x = proj_out_vec*cos(fi_out);
+	double out_vec_y = proj_out_vec*sin(fi_out);
+	double out[3]= {out_vec_x,out_vec_y,out_vec_z};
+	normalize(out);
+
+
+	// compute halfway vector
+	double half_x = (in_vec_x + out_vec_x)/2.0f;
+	double half_y = (in_vec_y + out_vec_y)/2.0f;
+	double half_z = (in_vec_z + out_vec_z)/2.0f;
+	double half[3] = {half_x,half_y,half_z};
+	normalize(half);
+
+	// compute  theta_half, fi_half
+	theta_half = acos(half[2]);
+	fi_half = atan2(half[1], half[0]);
+
+
+	double bi_normal[3] = {0.0, 1.0, 0.0};
+	double normal[3] = { 0.0, 0.0, 1.0 };
+	double temp[3];
+	double diff[3];
+
+	// compute diff vector
+	rotate_vector(in, normal , -fi_half, temp);
+	rotate_vector(temp, bi_normal, -theta_half, diff);
+
+	// compute  theta_diff, fi_diff
+	theta_diff = acos(diff[2]);
+	fi_diff = atan2(diff[1], diff[0]);
+
+}
+
+
+// Given a pair of incoming/outgoing angles, look up the BRDF.
+int lookup_brdf_val(const BRDF& brdf, double theta_in, double fi_in,
+			  double theta_out, double fi_out, 
+			  double& red_val,double& green_val,double& blue_val)
+{
+	// Convert to halfangle / difference angle coordinates
+	double theta_half, fi_half, theta_diff, fi_diff;
+	
+	std_coords_to_half_diff_coords(theta_in, fi_in, theta_out, fi_out,
+		       theta_half, fi_half, theta_diff, fi_diff);
+
+
+	// Find index.
+	// Note that phi_half is ignored, since isotropic BRDFs are assumed
+	int theta_half_ind = theta_half_index(theta_half);
+	int theta_diff_ind = theta_diff_index(theta_diff);
+	int phi_diff_ind = phi_diff_index(fi_diff);
+
+	brdf_fetch(brdf, theta_half_ind, theta_diff_ind, phi_diff_ind, red_val, green_val, blue_val);
+
+	
+	if (red_val < 0.0 || green_val < 0.0 || blue_val < 0.0)
+	{
+		//fprintf(stderr, "Below horizon.\n");
+		return 0;
+	}
+	return 1;
+}
+// Given a pair of incoming/outgoing angles, look up the BRDF.
+int lookup_aniso_brdf_val(const BRDF& brdf1, const BRDF& brdf2, double theta_in, double fi_in,
+			  double theta_out, double fi_out, 
+			  double& red_val,double& green_val,double& blue_val)
+{
+	// Convert to halfangle / difference angle coordinates
+	double theta_half, fi_half, theta_diff, fi_diff;
+	
+	std_coords_to_half_diff_coords(theta_in, fi_in, theta_out, fi_out,
+		       theta_half, fi_half, theta_diff, fi_diff);
+
+
+	// Find index.
+	// Note that phi_half is ignored, since isotropic BRDFs are assumed
+	int theta_half_ind = theta_half_index(theta_half);
+	int theta_diff_ind = theta_diff_index(theta_diff);
+	int phi_diff_ind = phi_diff_index(fi_diff);
+	double mix = 0.5 * (sin(2 * fi_half) + 1.0);
+	double red1 = 0;
+	double red2 = 0;
+	double green1 = 0;
+	double green2 = 0;
+	double blue1 = 0;
+	double blue2 = 0;
+
+	brdf_fetch(brdf1, theta_half_ind, theta_diff_ind, phi_diff_ind, red1, green1, blue1);
+
+	if (red1 < 0.0 || green1 < 0.0 || blue1 < 0.0)
+	{
+		//fprintf(stderr, "Below horizon.\n");
+		return 0;
+	}
+
+	brdf_fetch(brdf2, theta_half_ind, theta_diff_ind, phi_diff_ind, red2, green2, blue2);
+
+	if (red2 < 0.0 || green2 < 0.0 || blue2 < 0.0)
+	{
+		//fprintf(stderr, "Below horizon.\n");
+		return 0;
+	}
+
+	red_val = mix * red1 + (1 - mix) * red2;
+	green_val = mix * green1 + (1 - mix) * green2;
+	blue_val = mix * blue1 + (1 - mix) * blue2;
+	
+	return 1;
+}
+
+
+
+// Build the bin edges once. Each edge is the first value of its bin mapped
+// through the same function as the searched value.
+static BRDFIndexEdges make_index_edges()
+{
+	BRDFIndexEdges edges;
+	for (int k = 0; k < BRDF_THETA_EDGES; k++)
+	{
+		edges.theta_half[k] = -2.0;
+		edges.theta_diff[k] = -2.0;
+	}
+	for (int k = 0; k < BRDF_PHI_EDGES; k++)
+	{
+		edges.phi_diff[k] = -2.0;
+	}
+	edges.theta_half[0] = 2.0;
+	edges.theta_diff[0] = 2.0;
+	edges.phi_diff[0] = 2.0;
+
+	// theta_half_index() takes sqrt(theta / (pi/2) * 90 * 90), so bin k
+	// starts at (k / 90)^2 * pi/2.
+	for (int k = 1; k < BRDF_SAMPLING_RES_THETA_H; k++)
+	{
+		double t = (double)k / BRDF_SAMPLING_RES_THETA_H;
+		edges.theta_half[k] = cos(t * t * PI / 2.0);
+	}
+	for (int k = 1; k < BRDF_SAMPLING_RES_THETA_D; k++)
+	{
+		edges.theta_diff[k] = cos((double)k / BRDF_SAMPLING_RES_THETA_D * PI / 2.0);
+	}
+	for (int k = 1; k < BRDF_SAMPLING_RES_PHI_D / 2; k++)
+	{
+		double phi = (double)k / (BRDF_SAMPLING_RES_PHI_D / 2) * PI;
+		edges.phi_diff[k] = cos(phi) / (fabs(cos(phi)) + sin(phi));
+	}
+	return edges;
+}
+
+const BRDFIndexEdges& brdf_index_edges()
+{
+	static const BRDFIndexEdges edges = make_index_edges();
+	return edges;
+}
+
+static BRDFLerpTables make_lerp_tables()
+{
+	BRDFLerpTables tables;
+	for (int k = 0; k <= BRDF_LERP_ENTRIES; k++)
+	{
+		double x = (double)k / BRDF_LERP_ENTRIES;
+		double theta_half = 2.0 * asin(x * x);
+		double theta_diff = 2.0 * asin(x);
+		// Invert the pseudo-angle: the direction is (p, 1 - |p|) up to scale.
+		double p = 2.0 * x - 1.0;
+		double phi_diff = atan2(1.0 - fabs(p), p);
+		tables.theta_half[k] = (float)(sqrt(theta_half / (PI / 2.0)) * BRDF_SAMPLING_RES_THETA_H - 0.5);
+		tables.theta_diff[k] = (float)(theta_diff / (PI / 2.0) * BRDF_SAMPLING_RES_THETA_D - 0.5);
+		tables.phi_diff[k] = (float)(phi_diff / PI * (BRDF_SAMPLING_RES_PHI_D / 2) - 0.5);
+	}
+	return tables;
+}
+
+const BRDFLerpTables& brdf_lerp_tables()
+{
+	static const BRDFLerpTables tables = make_lerp_tables();
+	return tables;
+}
+
+// The two bins around a theta coordinate and the weight of the second,
+// clamped to the table. Coordinates are at least -0.5, so truncating
+// pos + 1 is floor(pos) + 1.
+static inline void theta_cell(double pos, int size, int& first, double& weight)
+{
+	first = (int)(pos + 1.0) - 1;
+	if (first < 0)
+	{
+		first = 0;
+		weight = 0.0;
+	}
+	else if (first > size - 2)
+	{
+		first = size - 2;
+		weight = 1.0;
+	}
+	else
+	{
+		weight = pos - first;
+	}
+}
+
+// Scaled entry `ind` of a planar table.
+static inline void planar_entry(const BRDF& brdf, int ind, double* rgb)
+{
+	if (brdf.format == BRDF_FORMAT_COMPACT)
+	{
+		rgb[0] = brdf.values[ind];
+		rgb[1] = brdf.values[ind + BRDF_TABLE_SIZE];
+		rgb[2] = brdf.values[ind + BRDF_TABLE_SIZE*2];
+	}
+	else if (brdf.format == BRDF_FORMAT_LOW_RANK)
+	{
+		const int phi_bins = BRDF_SAMPLING_RES_PHI_D / 2;
+		low_rank_brdf_fetch(*brdf.low_rank, ind / (phi_bins * BRDF_SAMPLING_RES_THETA_D),
+			ind / phi_bins % BRDF_SAMPLING_RES_THETA_D, ind % phi_bins, rgb[0], rgb[1], rgb[2]);
+	}
+	else
+	{
+		rgb[0] = brdf_merl_value(brdf.merl, ind) * RED_SCALE;
+		rgb[1] = brdf_merl_value(brdf.merl, ind + BRDF_TABLE_SIZE) * GREEN_SCALE;
+		rgb[2] = brdf_merl_value(brdf.merl, ind + BRDF_TABLE_SIZE*2) * BLUE_SCALE;
+	}
+}
+
+// The general blend of eight entries, given the offsets of their indices
+// along each axis and the weights of the second entry along each axis.
+// Weights of missing entries are dropped.
+static int blend_entries(const BRDF& brdf, const int* offset_th, const int* offset_td, const int* offset_pd,
+	double wth, double wtd, double wpd, double& red_val, double& green_val, double& blue_val)
+{
+	double sum[3] = { 0.0, 0.0, 0.0 };
+	double total = 0.0;
+	for (int corner = 0; corner < 8; corner++)
+	{
+		int ind = offset_th[corner >> 2] + offset_td[(corner >> 1) & 1] + offset_pd[corner & 1];
+		double rgb[3];
+		if (brdf.layout != BRDF_LAYOUT_PLANAR)
+		{
+			const float* entry = brdf.rgb + 3 * ind;
+			rgb[0] = entry[0];
+			rgb[1] = entry[1];
+			rgb[2] = entry[2];
+		}
+		else
+		{
+			planar_entry(brdf, ind, rgb);
+		}
+		if (rgb[0] < 0.0 || rgb[1] < 0.0 || rgb[2] < 0.0)
+			continue;
+		double weight = (corner & 4 ? wth : 1.0 - wth) *
+			(corner & 2 ? wtd : 1.0 - wtd) *
+			(corner & 1 ? wpd : 1.0 - wpd);
+		sum[0] += weight * rgb[0];
+		sum[1] += weight * rgb[1];
+		sum[2] += weight * rgb[2];
+		total += weight;
+	}
+
+	if (total <= 0.0)
+	{
+		red_val = green_val = blue_val = -1.0;
+		return 0;
+	}
+	red_val = sum[0] / total;
+	green_val = sum[1] / total;
+	blue_val = sum[2] / total;
+	return 1;
+}
+
+static BRDFAxisOffsets make_axis_offsets(bool tiled)
+{
+	BRDFAxisOffsets offsets;
+	for (int i = 0; i < BRDF_SAMPLING_RES_THETA_H; i++)
+		offsets.theta_half[i] = tiled ? brdf_tiled_index(i, 0, 0) : brdf_planar_index(i, 0, 0);
+	for (int i = 0; i < BRDF_SAMPLING_RES_THETA_D; i++)
+		offsets.theta_diff[i] = tiled ? brdf_tiled_index(0, i, 0) : brdf_planar_index(0, i, 0);
+	for (int i = 0; i <= BRDF_SAMPLING_RES_PHI_D / 2; i++)
+	{
+		int p = i % (BRDF_SAMPLING_RES_PHI_D / 2);
+		offsets.phi_diff[i] = tiled ? brdf_tiled_index(0, 0, p) : brdf_planar_index(0, 0, p);
+	}
+	return offsets;
+}
+
+const BRDFAxisOffsets& brdf_axis_offsets(BRDFLayout layout)
+{
+	static const BRDFAxisOffsets linear_offsets = make_axis_offsets(false);
+	static const BRDFAxisOffsets tiled_offsets = make_axis_offsets(true);
+	return layout == BRDF_LAYOUT_TILED ? tiled_offsets : linear_offsets;
+}
+
+// Trilinear blend of the entries around a table position. Both layouts
+// index separably, so the eight corners cost three pairs of table reads
+// and eight additions.
+int brdf_fetch_interpolated(const BRDF& brdf, double theta_half_pos, double theta_diff_pos,
+	double phi_diff_pos, double& red_val, double& green_val, double& blue_val)
+{
+	const int phi_bins = BRDF_SAMPLING_RES_PHI_D / 2;
+	int th, td, pd;
+	double wth, wtd;
+	theta_cell(theta_half_pos, BRDF_SAMPLING_RES_THETA_H, th, wth);
+	theta_cell(theta_diff_pos, BRDF_SAMPLING_RES_THETA_D, td, wtd);
+	pd = (int)(phi_diff_pos + 1.0) - 1;
+	double wpd = phi_diff_pos - pd;
+	if (pd < 0)
+		pd += phi_bins;
+
+	const BRDFAxisOffsets& axes = brdf_axis_offsets(brdf.layout);
+	int offset_th[2] = { axes.theta_half[th], axes.theta_half[th + 1] };
+	int offset_td[2] = { axes.theta_diff[td], axes.theta_diff[td + 1] };
+	int offset_pd[2] = { axes.phi_diff[pd], axes.phi_diff[pd + 1] };
+
+	if (brdf.layout != BRDF_LAYOUT_PLANAR)
+	{
+		// Blend in float along phi_diff first, watching for missing
+		// entries, which need the general blend.
+		float wpd1 = (float)wpd, wpd0 = 1.0f - wpd1;
+		float weights_th[2] = { 1.0f - (float)wth, (float)wth };
+		float weights_td[2] = { 1.0f - (float)wtd, (float)wtd };
+		float sum[3] = { 0.0f, 0.0f, 0.0f };
+		float lowest = 0.0f;
+		for (int i = 0; i < 2; i++)
+		{
+			for (int j = 0; j < 2; j++)
+			{
+				float weight = weights_th[i] * weights_td[j];
+				const float* e0 = brdf.rgb + 3 * (offset_th[i] + offset_td[j] + offset_pd[0]);
+				const float* e1 = brdf.rgb + 3 * (offset_th[i] + offset_td[j] + offset_pd[1]);
+				for (int c = 0; c < 3; c++)
+				{
+					sum[c] += weight * (wpd0 * e0[c] + wpd1 * e1[c]);
+					lowest = std::min(lowest, std::min(e0[c], e1[c]));
+				}
+			}
+		}
+		if (lowest >= 0.0f)
+		{
+			red_val = sum[0];
+			green_val = sum[1];
+			blue_val = sum[2];
+			return 1;
+		}
+	}
+	return blend_entries(brdf, offset_th, offset_td, offset_pd, wth, wtd, wpd, red_val, green_val, blue_val);
+}
+
+int lookup_brdf_dir_interpolated(const BRDF& brdf, const double* wi, const double* wo,
+			  double& red_val, double& green_val, double& blue_val)
+{
+	double theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half;
+	brdf_dir_coords(wi, wo, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+	return brdf_fetch_interpolated(brdf, theta_half_pos, theta_diff_pos, phi_diff_pos, red_val, green_val, blue_val);
+}
+
+int lookup_aniso_brdf_dir_interpolated(const BRDF& brdf1, const BRDF& brdf2, const double* wi, const double* wo,
+			  double& red_val, double& green_val, double& blue_val)
+{
+	double theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half;
+	brdf_dir_coords(wi, wo, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+
+	double mix = 0.5 * (sin_2phi_half + 1.0);
+	double red1, green1, blue1;
+	double red2, green2, blue2;
+	if (!brdf_fetch_interpolated(brdf1, theta_half_pos, theta_diff_pos, phi_diff_pos, red1, green1, blue1) ||
+		!brdf_fetch_interpolated(brdf2, theta_half_pos, theta_diff_pos, phi_diff_pos, red2, green2, blue2))
+	{
+		return 0;
+	}
+
+	red_val = mix * red1 + (1 - mix) * red2;
+	green_val = mix * green1 + (1 - mix) * green2;
+	blue_val = mix * blue1 + (1 - mix) * blue2;
+	return 1;
+}
+
+// Given a pair of unit tangent-space directions, look up the BRDF.
+// Equivalent to lookup_brdf_val() on their angles, up to rounding at bin
+// edges.
+int lookup_brdf_dir(const BRDF& brdf, const double* wi, const double* wo,
+			  double& red_val, double& green_val, double& blue_val)
+{
+	int theta_half_ind, theta_diff_ind, phi_diff_ind;
+	double sin_2phi_half;
+	brdf_dir_indices(wi, wo, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+
+	brdf_fetch(brdf, theta_half_ind, theta_diff_ind, phi_diff_ind, red_val, green_val, blue_val);
+
+	if (red_val < 0.0 || green_val < 0.0 || blue_val < 0.0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+// Direction form of lookup_aniso_brdf_val().
+int lookup_aniso_brdf_dir(const BRDF& brdf1, const BRDF& brdf2, const double* wi, const double* wo,
+			  double& red_val, double& green_val, double& blue_val)
+{
+	int theta_half_ind, theta_diff_ind, phi_diff_ind;
+	double sin_2phi_half;
+	brdf_dir_indices(wi, wo, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+
+	double mix = 0.5 * (sin_2phi_half + 1.0);
+	double red1, green1, blue1;
+	double red2, green2, blue2;
+
+	brdf_fetch(brdf1, theta_half_ind, theta_diff_ind, phi_diff_ind, red1, green1, blue1);
+	if (red1 < 0.0 || green1 < 0.0 || blue1 < 0.0)
+	{
+		return 0;
+	}
+
+	brdf_fetch(brdf2, theta_half_ind, theta_diff_ind, phi_diff_ind, red2, green2, blue2);
+	if (red2 < 0.0 || green2 < 0.0 || blue2 < 0.0)
+	{
+		return 0;
+	}
+
+	red_val = mix * red1 + (1 - mix) * red2;
+	green_val = mix * green1 + (1 - mix) * green2;
+	blue_val = mix * blue1 + (1 - mix) * blue2;
+
+	return 1;
+}
+
+
+
+// Map `filename` read-only. Falls back to reading it into memory where
+// mmap is unavailable.
+static void* map_file(const char* filename, size_t& size)
+{
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	size = (size_t)info.st_size;
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	return data;
+#else
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (length <= 0)
+	{
+		fclose(f);
+		return NULL;
+	}
+	size = (size_t)length;
+	void* data = malloc(size);
+	if (data && fread(data, 1, size, f) != size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+#endif
+}
+
+static void unmap_file(void* data, size_t size)
+{
+#ifndef _WIN32
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+
+// Cache-line aligned allocation for rearranged tables.
+static float* alloc_table(size_t count)
+{
+#ifndef _WIN32
+	void* memory = NULL;
+	if (posix_memalign(&memory, 64, sizeof(float)*count) != 0)
+		return NULL;
+	return (float*)memory;
+#else
+	return (float*)_aligned_malloc(sizeof(float)*count, 64);
+#endif
+}
+
+static void free_table(float* table)
+{
+#ifndef _WIN32
+	free(table);
+#else
+	_aligned_free(table);
+#endif
+}
+
+// Copy a freshly mapped table into `layout`. The mapping, or the low-rank
+// factors, are released once the copy exists, since lookups no longer read
+// from them.
+static bool arrange_brdf(BRDF& brdf, BRDFLayout layout)
+{
+	if (layout == BRDF_LAYOUT_PLANAR)
+		return true;
+
+	float* rgb = alloc_table(3*BRDF_TABLE_SIZE);
+	if (!rgb)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free_brdf(brdf);
+		return false;
+	}
+	for (int i = 0; i < BRDF_SAMPLING_RES_THETA_H; i++)
+	{
+		for (int j = 0; j < BRDF_SAMPLING_RES_THETA_D; j++)
+		{
+			for (int k = 0; k < BRDF_SAMPLING_RES_PHI_D / 2; k++)
+			{
+				int ind = layout == BRDF_LAYOUT_TILED ?
+					brdf_tiled_index(i, j, k) : brdf_planar_index(i, j, k);
+				double red, green, blue;
+				brdf_fetch(brdf, i, j, k, red, green, blue);
+				rgb[3*ind] = (float)red;
+				rgb[3*ind + 1] = (float)green;
+				rgb[3*ind + 2] = (float)blue;
+			}
+		}
+	}
+
+	if (brdf.mapping)
+		unmap_file(brdf.mapping, brdf.mapping_size);
+	delete brdf.low_rank;
+	brdf.mapping = NULL;
+	brdf.mapping_size = 0;
+	brdf.merl = NULL;
+	brdf.values = NULL;
+	brdf.low_rank = NULL;
+	brdf.rgb = rgb;
+	brdf.layout = layout;
+	return true;
+}
+
+bool parse_brdf_layout(const char* name, BRDFLayout& layout)
+{
+	if (strcmp(name, "planar") == 0)
+		layout = BRDF_LAYOUT_PLANAR;
+	else if (strcmp(name, "interleaved") == 0)
+		layout = BRDF_LAYOUT_INTERLEAVED;
+	else if (strcmp(name, "tiled") == 0)
+		layout = BRDF_LAYOUT_TILED;
+	else
+		return false;
+	return true;
+}
+
+// Read BRDF data
+// Accepts a MERL .binary file, a compact file written by
+// write_compact_brdf() or a low-rank file written by write_low_rank_brdf().
+// The header and the file size are validated; with BRDF_LAYOUT_PLANAR the
+// table itself is referenced in place, and a low-rank one is kept as its
+// factors.
+bool read_brdf(const char *filename, BRDF& brdf, BRDFLayout layout)
+{
+	size_t size = 0;
+	void* data = map_file(filename, size);
+	if (!data)
+		return false;
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	brdf.layout = BRDF_LAYOUT_PLANAR;
+	brdf.mapping = data;
+	brdf.mapping_size = size;
+	brdf.merl = NULL;
+	brdf.values = NULL;
+	brdf.low_rank = NULL;
+	brdf.rgb = NULL;
+
+	if (size >= sizeof(LowRankBRDFHeader) &&
+		memcmp(bytes, LOW_RANK_BRDF_MAGIC, sizeof(LOW_RANK_BRDF_MAGIC)) == 0)
+	{
+		LowRankBRDF* low_rank = new LowRankBRDF();
+		bool ok = parse_low_rank_brdf(bytes, size, *low_rank);
+		free_brdf(brdf);
+		if (!ok)
+		{
+			delete low_rank;
+			return false;
+		}
+		brdf.format = BRDF_FORMAT_LOW_RANK;
+		brdf.low_rank = low_rank;
+		return arrange_brdf(brdf, layout);
+	}
+
+	if (size >= sizeof(CompactBRDFHeader) &&
+		memcmp(bytes, COMPACT_BRDF_MAGIC, sizeof(COMPACT_BRDF_MAGIC)) == 0)
+	{
+		CompactBRDFHeader header;
+		memcpy(&header, bytes, sizeof(header));
+		if (header.version != COMPACT_BRDF_VERSION ||
+			header.dims[0] != BRDF_SAMPLING_RES_THETA_H ||
+			header.dims[1] != BRDF_SAMPLING_RES_THETA_D ||
+			header.dims[2] != BRDF_SAMPLING_RES_PHI_D / 2 ||
+			header.channels != 3 ||
+			size != sizeof(header) + sizeof(float)*3*BRDF_TABLE_SIZE)
+		{
+			fprintf(stderr, "Invalid compact BRDF header\n");
+			free_brdf(brdf);
+			return false;
+		}
+		brdf.format = BRDF_FORMAT_COMPACT;
+		brdf.values = (const float*)(bytes + sizeof(header));
+		return arrange_brdf(brdf, layout);
+	}
+
+	int dims[3];
+	if (size < sizeof(dims))
+	{
+		fprintf(stderr, "Dimensions don't match\n");
+		free_brdf(brdf);
+		return false;
+	}
+	memcpy(dims, bytes, sizeof(dims));
+	if (dims[0] != BRDF_SAMPLING_RES_THETA_H ||
+		dims[1] != BRDF_SAMPLING_RES_THETA_D ||
+		dims[2] != BRDF_SAMPLING_RES_PHI_D / 2)
+	{
+		fprintf(stderr, "Dimensions don't match\n");
+		free_brdf(brdf);
+		return false;
+	}
+	if (size != sizeof(dims) + sizeof(double)*3*BRDF_TABLE_SIZE)
+	{
+		fprintf(stderr, "Unexpected file size\n");
+		free_brdf(brdf);
+		return false;
+	}
+
+	brdf.format = BRDF_FORMAT_MERL;
+	brdf.merl = bytes + sizeof(dims);
+	return arrange_brdf(brdf, layout);
+}
+
+void free_brdf(BRDF& brdf)
+{
+	if (brdf.mapping)
+		unmap_file(brdf.mapping, brdf.mapping_size);
+	if (brdf.rgb)
+		free_table(brdf.rgb);
+	delete brdf.low_rank;
+	brdf.mapping = NULL;
+	brdf.mapping_size = 0;
+	brdf.merl = NULL;
+	brdf.values = NULL;
+	brdf.low_rank = NULL;
+	brdf.rgb = NULL;
+}
+
+// Bytes held by a loaded BRDF: its file mapping or low-rank factors plus
+// any rearranged table.
+size_t brdf_memory_size(const BRDF& brdf)
+{
+	size_t size = brdf.mapping ? brdf.mapping_size : 0;
+	if (brdf.low_rank)
+		size += low_rank_brdf_memory_size(*brdf.low_rank);
+	if (brdf.rgb)
+		size += sizeof(float)*3*BRDF_TABLE_SIZE;
+	return size;
+}
+
+// Write `brdf` in the compact float format with the channel scales applied.
+bool write_compact_brdf(const char *filename, const BRDF& brdf)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	CompactBRDFHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, COMPACT_BRDF_MAGIC, sizeof(COMPACT_BRDF_MAGIC));
+	header.version = COMPACT_BRDF_VERSION;
+	header.dims[0] = BRDF_SAMPLING_RES_THETA_H;
+	header.dims[1] = BRDF_SAMPLING_RES_THETA_D;
+	header.dims[2] = BRDF_SAMPLING_RES_PHI_D / 2;
+	header.channels = 3;
+
+	float* values = (float*) malloc (sizeof(float)*3*BRDF_TABLE_SIZE);
+	if (!values)
+	{
+		fclose(f);
+		return false;
+	}
+	for (int i = 0; i < BRDF_SAMPLING_RES_THETA_H; i++)
+	{
+		for (int j = 0; j < BRDF_SAMPLING_RES_THETA_D; j++)
+		{
+			for (int k = 0; k < BRDF_SAMPLING_RES_PHI_D / 2; k++)
+			{
+				int ind = brdf_planar_index(i, j, k);
+				double red, green, blue;
+				brdf_fetch(brdf, i, j, k, red, green, blue);
+				values[ind] = (float)red;
+				values[ind + BRDF_TABLE_SIZE] = (float)green;
+				values[ind + BRDF_TABLE_SIZE*2] = (float)blue;
+			}
+		}
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(values, sizeof(float), 3*BRDF_TABLE_SIZE, f) == 3*BRDF_TABLE_SIZE;
+	free(values);
+	if (fclose(f) != 0)
+		ok = false;
+	return ok;
+}
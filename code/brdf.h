@@ -0,0 +1,442 @@
+#ifndef __BRDF_H__
+#define __BRDF_H__
+
+#include "math.h"
+#include <stddef.h>
+#include <string.h>
+
+#define BRDF_SAMPLING_RES_THETA_H       90
+#define BRDF_SAMPLING_RES_THETA_D       90
+#define BRDF_SAMPLING_RES_PHI_D         360
+
+// Number of entries in one colour channel of the table.
+#define BRDF_TABLE_SIZE (BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D/2)
+
+#define RED_SCALE (1.0/1500.0)
+#define GREEN_SCALE (1.15/1500.0)
+#define BLUE_SCALE (1.66/1500.0)
+#define PI	3.1415926535897932384626433832795
+
+// Payload formats read_brdf() understands.
+enum BRDFFormat {
+	// The MERL .binary file: three int dimensions followed by the red,
+	// green and blue planes as unscaled doubles.
+	BRDF_FORMAT_MERL,
+	// Written by BRDFConvert: a CompactBRDFHeader followed by the three
+	// planes as floats with the channel scales already applied.
+	BRDF_FORMAT_COMPACT,
+	// Written by BRDFCompress: the factors of a LowRankBRDF, see
+	// brdflowrank.h.
+	BRDF_FORMAT_LOW_RANK
+};
+
+// In-memory arrangements of the table, chosen when the file is loaded.
+enum BRDFLayout {
+	// Red, green and blue planes as stored in the file, used in place. A
+	// lookup touches three cache lines about 4.4 MB apart. Low-rank files
+	// stay compressed, and each lookup reconstructs its entry.
+	BRDF_LAYOUT_PLANAR,
+	// Copied to floats with red, green and blue next to each other, so a
+	// lookup touches a single cache line.
+	BRDF_LAYOUT_INTERLEAVED,
+	// Interleaved, and grouped into blocks of BRDF_TILE_TH x BRDF_TILE_TD x
+	// BRDF_TILE_PD entries so that lookups for neighbouring pixels, which
+	// differ by a step or two in each index, tend to share cache lines.
+	BRDF_LAYOUT_TILED
+};
+
+#define BRDF_TILE_TH 2
+#define BRDF_TILE_TD 2
+#define BRDF_TILE_PD 4
+
+#define COMPACT_BRDF_MAGIC "MERLF32"
+#define COMPACT_BRDF_VERSION 1
+
+struct CompactBRDFHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int dims[3];
+	unsigned int channels;
+	unsigned int reserved;
+};
+
+struct LowRankBRDF;
+
+// A loaded BRDF table. With BRDF_LAYOUT_PLANAR the payload is used in place
+// from a read-only file mapping, so loading only validates the header and
+// costs no copy. The other layouts copy the table into `rgb`.
+struct BRDF {
+	BRDFFormat format;
+	BRDFLayout layout;
+	// BRDF_FORMAT_MERL: start of the doubles. They follow a 12 byte header,
+	// so they are not 8-byte aligned and are read with brdf_merl_value().
+	const unsigned char* merl;
+	// BRDF_FORMAT_COMPACT: scaled floats.
+	const float* values;
+	// BRDF_FORMAT_LOW_RANK: the factors, copied out of the file.
+	const LowRankBRDF* low_rank;
+	// BRDF_LAYOUT_INTERLEAVED and BRDF_LAYOUT_TILED: scaled floats, three
+	// per entry.
+	float* rgb;
+
+	void* mapping;
+	size_t mapping_size;
+};
+
+void cross_product(double*, double*, double*);
+void normalize(double*);
+void rotate_vector(double*, double*, double, double*);
+void std_coords_to_half_diff_coords(double, double, double, double,
+	double&, double&, double&, double&);
+
+// Lookup theta_half index
+// This is a non-linear mapping!
+// In:  [0 .. pi/2]
+// Out: [0 .. 89]
+inline int theta_half_index(double theta_half)
+{
+	if (theta_half <= 0.0)
+		return 0;
+	double theta_half_deg = ((theta_half / (PI/2.0))*BRDF_SAMPLING_RES_THETA_H);
+	double temp = theta_half_deg*BRDF_SAMPLING_RES_THETA_H;
+	temp = sqrt(temp);
+	int ret_val = (int)temp;
+	if (ret_val < 0) ret_val = 0;
+	if (ret_val >= BRDF_SAMPLING_RES_THETA_H)
+		ret_val = BRDF_SAMPLING_RES_THETA_H-1;
+	return ret_val;
+}
+
+
+// Lookup theta_diff index
+// In:  [0 .. pi/2]
+// Out: [0 .. 89]
+inline int theta_diff_index(double theta_diff)
+{
+	int tmp = int(theta_diff / (PI * 0.5) * BRDF_SAMPLING_RES_THETA_D);
+	if (tmp < 0)
+		return 0;
+	else if (tmp < BRDF_SAMPLING_RES_THETA_D - 1)
+		return tmp;
+	else
+		return BRDF_SAMPLING_RES_THETA_D - 1;
+}
+
+
+// Lookup phi_diff index
+inline int phi_diff_index(double phi_diff)
+{
+	// Because of reciprocity, the BRDF is unchanged under
+	// phi_diff -> phi_diff + PI
+	if (phi_diff < 0.0)
+		phi_diff += PI;
+
+	// In: phi_diff in [0 .. pi]
+	// Out: tmp in [0 .. 179]
+	int tmp = int(phi_diff / PI * BRDF_SAMPLING_RES_PHI_D / 2);
+	if (tmp < 0)
+		return 0;
+	else if (tmp < BRDF_SAMPLING_RES_PHI_D / 2 - 1)
+		return tmp;
+	else
+		return BRDF_SAMPLING_RES_PHI_D / 2 - 1;
+}
+
+// Bin edges of the three table indices, for finding indices straight from
+// direction vectors. Entry k is the value that starts bin k, so the index
+// of a value v is the largest k with edge[k] >= v. Entry 0 is +2 and the
+// tail is padded with -2 to a power of two, which lets the search run a
+// fixed number of steps.
+//
+// theta_half and theta_diff edges are cosines. phi_diff edges are the
+// pseudo-angle x / (|x| + y) of the direction (cos phi, sin phi), which
+// decreases over [0, pi] just like the cosine but needs no sqrt.
+#define BRDF_THETA_EDGES 128
+#define BRDF_PHI_EDGES 256
+
+struct BRDFIndexEdges {
+	double theta_half[BRDF_THETA_EDGES];
+	double theta_diff[BRDF_THETA_EDGES];
+	double phi_diff[BRDF_PHI_EDGES];
+};
+
+const BRDFIndexEdges& brdf_index_edges();
+
+// Largest k with edges[k] >= value, for `size` edges.
+inline int brdf_edge_search(const double* edges, int size, double value)
+{
+	int k = 0;
+	for (int step = size / 2; step > 0; step /= 2)
+	{
+		if (edges[k + step] >= value)
+			k += step;
+	}
+	return k;
+}
+
+// Bin coordinates for interpolated lookups, tabulated against variables
+// they are smooth in so that linear interpolation between entries is
+// accurate to well under a thousandth of a bin, with no acos or asin per
+// lookup. Coordinates have bin centres at integers:
+//   theta_half at evenly spaced v in [0, 1], theta_half = 2 asin(v^2)
+//   theta_diff at evenly spaced u in [0, 1], theta_diff = 2 asin(u)
+//   phi_diff at evenly spaced (x + 1) / 2 in [0, 1], x the pseudo-angle
+//     used by BRDFIndexEdges
+#define BRDF_LERP_ENTRIES 1024
+
+struct BRDFLerpTables {
+	float theta_half[BRDF_LERP_ENTRIES + 1];
+	float theta_diff[BRDF_LERP_ENTRIES + 1];
+	float phi_diff[BRDF_LERP_ENTRIES + 1];
+};
+
+const BRDFLerpTables& brdf_lerp_tables();
+
+// An entry's index split into one offset per axis, for the planar and
+// interleaved layouts or for the tiled one, as both index separably.
+// phi_diff has one extra entry, the offset of bin 0, so that the last bin
+// wraps around.
+struct BRDFAxisOffsets {
+	int theta_half[BRDF_SAMPLING_RES_THETA_H];
+	int theta_diff[BRDF_SAMPLING_RES_THETA_D];
+	int phi_diff[BRDF_SAMPLING_RES_PHI_D / 2 + 1];
+};
+
+const BRDFAxisOffsets& brdf_axis_offsets(BRDFLayout);
+
+// Linear interpolation in one of the tables, for x in [0, 1].
+inline double brdf_lerp(const float* table, double x)
+{
+	double f = x * BRDF_LERP_ENTRIES;
+	int k = (int)f;
+	if (k < 0)
+		k = 0;
+	else if (k > BRDF_LERP_ENTRIES - 1)
+		k = BRDF_LERP_ENTRIES - 1;
+	return table[k] + (table[k + 1] - table[k]) * (f - k);
+}
+
+// Half/diff angles of a pair of unit tangent-space directions (z along the
+// normal): the cosines of theta_half and theta_diff, and phi_diff as the
+// pseudo-angle of BRDFIndexEdges. This is the vector form of
+// std_coords_to_half_diff_coords(): the half vector is left unnormalised
+// and the diff vector is only needed up to a positive scale, so the whole
+// conversion costs one sqrt. `sin_2phi_half` receives sin(2 * phi_half)
+// for the anisotropic mix.
+inline void brdf_dir_half_diff(const double* wi, const double* wo,
+	double& cos_theta_half, double& cos_theta_diff, double& phi_diff,
+	double& sin_2phi_half)
+{
+	double hx = wi[0] + wo[0];
+	double hy = wi[1] + wo[1];
+	double hz = wi[2] + wo[2];
+	double r2 = hx*hx + hy*hy;
+	double len = sqrt(r2 + hz*hz);
+
+	cos_theta_half = hz / len;
+	cos_theta_diff = (hx*wi[0] + hy*wi[1] + hz*wi[2]) / len;
+
+	// wi rotated by -phi_half about the normal and by -theta_half about the
+	// bitangent, scaled by len * sqrt(r2).
+	double diff_x, diff_y;
+	if (r2 > 0.0)
+	{
+		diff_x = hz * (hx*wi[0] + hy*wi[1]) - r2 * wi[2];
+		diff_y = len * (hx*wi[1] - hy*wi[0]);
+		sin_2phi_half = 2.0 * hx * hy / r2;
+	}
+	else
+	{
+		diff_x = hz * wi[0];
+		diff_y = len * wi[1];
+		sin_2phi_half = 0.0;
+	}
+
+	// Reciprocity: phi_diff and phi_diff + pi share a bin.
+	if (diff_y < 0.0)
+	{
+		diff_x = -diff_x;
+		diff_y = -diff_y;
+	}
+	double extent = fabs(diff_x) + diff_y;
+	phi_diff = extent > 0.0 ? diff_x / extent : 1.0;
+}
+
+// Table indices for a pair of unit tangent-space directions, as the index
+// functions would give for the angles of brdf_dir_half_diff().
+inline void brdf_dir_indices(const double* wi, const double* wo,
+	int& theta_half_ind, int& theta_diff_ind, int& phi_diff_ind,
+	double& sin_2phi_half)
+{
+	const BRDFIndexEdges& edges = brdf_index_edges();
+
+	double cos_theta_half, cos_theta_diff, phi_diff;
+	brdf_dir_half_diff(wi, wo, cos_theta_half, cos_theta_diff, phi_diff, sin_2phi_half);
+
+	theta_half_ind = brdf_edge_search(edges.theta_half, BRDF_THETA_EDGES, cos_theta_half);
+	theta_diff_ind = brdf_edge_search(edges.theta_diff, BRDF_THETA_EDGES, cos_theta_diff);
+	phi_diff_ind = brdf_edge_search(edges.phi_diff, BRDF_PHI_EDGES, phi_diff);
+}
+
+// Continuous table coordinates for a pair of unit tangent-space
+// directions, with bin centres at integers. The sqrt of theta_half_index()
+// is folded into its table, so only the half-angle sines are computed.
+inline void brdf_dir_coords(const double* wi, const double* wo,
+	double& theta_half_pos, double& theta_diff_pos, double& phi_diff_pos,
+	double& sin_2phi_half)
+{
+	const BRDFLerpTables& tables = brdf_lerp_tables();
+
+	double cos_theta_half, cos_theta_diff, phi_diff;
+	brdf_dir_half_diff(wi, wo, cos_theta_half, cos_theta_diff, phi_diff, sin_2phi_half);
+
+	// sin(theta / 2) = sqrt((1 - cos(theta)) / 2)
+	double half_theta_half = 0.5 * (1.0 - cos_theta_half);
+	double half_theta_diff = 0.5 * (1.0 - cos_theta_diff);
+	double sin_half_theta_half = sqrt(half_theta_half > 0.0 ? half_theta_half : 0.0);
+	double sin_half_theta_diff = sqrt(half_theta_diff > 0.0 ? half_theta_diff : 0.0);
+	theta_half_pos = brdf_lerp(tables.theta_half, sqrt(sin_half_theta_half));
+	theta_diff_pos = brdf_lerp(tables.theta_diff, sin_half_theta_diff);
+	phi_diff_pos = brdf_lerp(tables.phi_diff, 0.5 * (phi_diff + 1.0));
+}
+
+// Index of an entry in one plane of the file layout.
+inline int brdf_planar_index(int theta_half_ind, int theta_diff_ind, int phi_diff_ind)
+{
+	return phi_diff_ind +
+		theta_diff_ind * BRDF_SAMPLING_RES_PHI_D / 2 +
+		theta_half_ind * BRDF_SAMPLING_RES_PHI_D / 2 * BRDF_SAMPLING_RES_THETA_D;
+}
+
+// Index of an entry in BRDF_LAYOUT_TILED, in units of RGB triples.
+inline int brdf_tiled_index(int theta_half_ind, int theta_diff_ind, int phi_diff_ind)
+{
+	// Unsigned so that the divisions by the tile sizes become shifts.
+	unsigned int th = theta_half_ind;
+	unsigned int td = theta_diff_ind;
+	unsigned int pd = phi_diff_ind;
+	unsigned int block = (th / BRDF_TILE_TH *
+			(BRDF_SAMPLING_RES_THETA_D / BRDF_TILE_TD) +
+			td / BRDF_TILE_TD) *
+		(BRDF_SAMPLING_RES_PHI_D / 2 / BRDF_TILE_PD) +
+		pd / BRDF_TILE_PD;
+	unsigned int within = ((th % BRDF_TILE_TH) * BRDF_TILE_TD +
+			td % BRDF_TILE_TD) * BRDF_TILE_PD +
+		pd % BRDF_TILE_PD;
+	return (int)(block * (BRDF_TILE_TH * BRDF_TILE_TD * BRDF_TILE_PD) + within);
+}
+
+// Read entry `ind` of the unaligned MERL payload.
+inline double brdf_merl_value(const unsigned char* merl, int ind)
+{
+	double value;
+	memcpy(&value, merl + (size_t)ind * sizeof(double), sizeof(double));
+	return value;
+}
+
+// low_rank_brdf_fetch() on `brdf.low_rank`, out of line so that this header
+// does not need brdflowrank.h.
+void brdf_fetch_low_rank(const BRDF&, int, int, int, double&, double&, double&);
+
+// Scaled red, green and blue values of a table entry.
+inline void brdf_fetch(const BRDF& brdf, int theta_half_ind, int theta_diff_ind, int phi_diff_ind,
+	double& red_val, double& green_val, double& blue_val)
+{
+	const float* rgb;
+	switch (brdf.layout)
+	{
+	case BRDF_LAYOUT_INTERLEAVED:
+		rgb = brdf.rgb + 3 * brdf_planar_index(theta_half_ind, theta_diff_ind, phi_diff_ind);
+		break;
+	case BRDF_LAYOUT_TILED:
+		rgb = brdf.rgb + 3 * brdf_tiled_index(theta_half_ind, theta_diff_ind, phi_diff_ind);
+		break;
+	default:
+		{
+			int ind = brdf_planar_index(theta_half_ind, theta_diff_ind, phi_diff_ind);
+			if (brdf.format == BRDF_FORMAT_COMPACT)
+			{
+				red_val = brdf.values[ind];
+				green_val = brdf.values[ind + BRDF_TABLE_SIZE];
+				blue_val = brdf.values[ind + BRDF_TABLE_SIZE*2];
+			}
+			else if (brdf.format == BRDF_FORMAT_LOW_RANK)
+			{
+				brdf_fetch_low_rank(brdf, theta_half_ind, theta_diff_ind, phi_diff_ind,
+					red_val, green_val, blue_val);
+			}
+			else
+			{
+				red_val = brdf_merl_value(brdf.merl, ind) * RED_SCALE;
+				green_val = brdf_merl_value(brdf.merl, ind + BRDF_TABLE_SIZE) * GREEN_SCALE;
+				blue_val = brdf_merl_value(brdf.merl, ind + BRDF_TABLE_SIZE*2) * BLUE_SCALE;
+			}
+		}
+		return;
+	}
+	red_val = rgb[0];
+	green_val = rgb[1];
+	blue_val = rgb[2];
+}
+
+int lookup_brdf_val(const BRDF&, double, double, double, double,
+	double&, double&, double&);
+int lookup_aniso_brdf_val(const BRDF&, const BRDF&, double, double, double, double,
+	double&, double&, double&);
+int lookup_brdf_dir(const BRDF&, const double*, const double*,
+	double&, double&, double&);
+int lookup_aniso_brdf_dir(const BRDF&, const BRDF&, const double*, const double*,
+	double&, double&, double&);
+
+// Trilinear forms of the direction lookups, blending the eight entries
+// around brdf_dir_coords(). Missing entries are left out of the blend; the
+// lookup fails only if all of them are missing. Any layout works, but
+// BRDF_LAYOUT_TILED keeps most of the eight in one or two cache lines.
+int lookup_brdf_dir_interpolated(const BRDF&, const double*, const double*,
+	double&, double&, double&);
+// The blend at a position from brdf_dir_coords(), for lookups that share one.
+int brdf_fetch_interpolated(const BRDF&, double, double, double,
+	double&, double&, double&);
+int lookup_aniso_brdf_dir_interpolated(const BRDF&, const BRDF&, const double*, const double*,
+	double&, double&, double&);
+
+// Batched forms of brdf_dir_indices() and the direction lookups, for n
+// direction pairs given as separate x, y and z arrays. They use AVX-512 or
+// AVX2 when the CPU has it and give exactly the same indices as the scalar
+// path. rgb_out receives 3 * n values. The isotropic lookup stores the
+// table values as they are, like lookup_brdf_val(); the anisotropic ones
+// store zero for pairs below the horizon.
+void brdf_dir_indices_batch(const float* const wi[3], const float* const wo[3], int n,
+	int*, int*, int*, double*);
+void brdf_dir_indices_batch(const double* const wi[3], const double* const wo[3], int n,
+	int*, int*, int*, double*);
+void lookup_brdf_batch(const BRDF&, const float* const wi[3], const float* const wo[3], int n, double* rgb_out);
+void lookup_brdf_batch(const BRDF&, const double* const wi[3], const double* const wo[3], int n, double* rgb_out);
+void lookup_aniso_brdf_batch(const BRDF&, const BRDF&,
+	const float* const wi[3], const float* const wo[3], int n, double* rgb_out);
+void lookup_aniso_brdf_batch(const BRDF&, const BRDF&,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out);
+// lookup_brdf_val() on n angle quadruples. Unlike the direction lookups,
+// which can break ties on bin edges differently, this stores exactly what
+// lookup_brdf_val() returns.
+void lookup_brdf_val_batch(const BRDF&, const double* theta_in, const double* fi_in,
+	const double* theta_out, const double* fi_out, int n, double* rgb_out);
+// The same for the interpolated lookups, with results bit for bit those of
+// the scalar functions. The fetch stores -1 for all three values where
+// brdf_fetch_interpolated() fails.
+void brdf_dir_coords_batch(const double* const wi[3], const double* const wo[3], int n,
+	double*, double*, double*, double*);
+void brdf_fetch_interpolated_batch(const BRDF&, const double* theta_half_pos, const double* theta_diff_pos,
+	const double* phi_diff_pos, int n, double* rgb_out);
+void lookup_aniso_brdf_batch_interpolated(const BRDF&, const BRDF&,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out);
+const char* brdf_batch_kernel();
+bool select_brdf_batch_kernel(const char*);
+
+bool read_brdf(const char*, BRDF&, BRDFLayout layout = BRDF_LAYOUT_PLANAR);
+bool parse_brdf_layout(const char*, BRDFLayout&);
+void free_brdf(BRDF&);
+size_t brdf_memory_size(const BRDF&);
+bool write_compact_brdf(const char*, const BRDF&);
+
+#endif
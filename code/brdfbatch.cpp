@@ -0,0 +1,863 @@
+#include "brdf.h"
+#include <string.h>
+
+// The vector kernels must produce the same indices as brdf_dir_indices(),
+// so products may not be fused into FMAs that round differently.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BRDF_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+// Entries processed per pass through the index buffers.
+#define BATCH_CHUNK 256
+
+enum BatchKernel {
+	KERNEL_SCALAR,
+	KERNEL_AVX2,
+	KERNEL_AVX512
+};
+
+static BatchKernel detect_kernel()
+{
+#ifdef BRDF_BATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return KERNEL_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return KERNEL_AVX2;
+#endif
+	return KERNEL_SCALAR;
+}
+
+static BatchKernel supported_kernel = detect_kernel();
+static BatchKernel active_kernel = supported_kernel;
+
+// Indices for entries [begin, end), one pair at a time.
+template <typename T>
+static void dir_indices_scalar(const T* const wi[3], const T* const wo[3], int begin, int end,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	for (int i = begin; i < end; i++)
+	{
+		double in[3] = { wi[0][i], wi[1][i], wi[2][i] };
+		double out[3] = { wo[0][i], wo[1][i], wo[2][i] };
+		brdf_dir_indices(in, out, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], sin_2phi_half[i]);
+	}
+}
+
+// Coordinates for entries [begin, end), one pair at a time.
+static void dir_coords_scalar(const double* const wi[3], const double* const wo[3], int begin, int end,
+	double* theta_half_pos, double* theta_diff_pos, double* phi_diff_pos, double* sin_2phi_half)
+{
+	for (int i = begin; i < end; i++)
+	{
+		double in[3] = { wi[0][i], wi[1][i], wi[2][i] };
+		double out[3] = { wo[0][i], wo[1][i], wo[2][i] };
+		brdf_dir_coords(in, out, theta_half_pos[i], theta_diff_pos[i], phi_diff_pos[i], sin_2phi_half[i]);
+	}
+}
+
+// theta_half_index(), theta_diff_index() and phi_diff_index() for entries
+// [begin, end).
+static void angle_indices_scalar(const double* theta_half, const double* theta_diff, const double* phi_diff,
+	int begin, int end, int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind)
+{
+	for (int i = begin; i < end; i++)
+	{
+		theta_half_ind[i] = theta_half_index(theta_half[i]);
+		theta_diff_ind[i] = theta_diff_index(theta_diff[i]);
+		phi_diff_ind[i] = phi_diff_index(phi_diff[i]);
+	}
+}
+
+#ifdef BRDF_BATCH_X86
+
+// The kernels work in double precision so that every operation rounds
+// exactly as in brdf_dir_indices(). Float inputs widen without loss.
+
+__attribute__((target("avx2")))
+static inline __m256d load_avx2(const float* p)
+{
+	return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d load_avx2(const double* p)
+{
+	return _mm256_loadu_pd(p);
+}
+
+// brdf_edge_search() on four values, gathering the edges.
+__attribute__((target("avx2")))
+static inline __m128i edge_search_avx2(const double* edges, int size, __m256d value)
+{
+	const __m256i narrow = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	__m128i k = _mm_setzero_si128();
+	for (int step = size / 2; step > 0; step /= 2)
+	{
+		__m128i candidate = _mm_add_epi32(k, _mm_set1_epi32(step));
+		__m256d edge = _mm256_i32gather_pd(edges, candidate, 8);
+		__m256d ge = _mm256_cmp_pd(edge, value, _CMP_GE_OQ);
+		__m128i mask = _mm256_castsi256_si128(
+			_mm256_permutevar8x32_epi32(_mm256_castpd_si256(ge), narrow));
+		k = _mm_blendv_epi8(k, candidate, mask);
+	}
+	return k;
+}
+
+// brdf_dir_half_diff() on four pairs.
+__attribute__((target("avx2")))
+static inline void half_diff_avx2(__m256d wi0, __m256d wi1, __m256d wi2, __m256d wo0, __m256d wo1, __m256d wo2,
+	__m256d& cos_theta_half, __m256d& cos_theta_diff, __m256d& phi_diff, __m256d& sin_2phi)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+
+	__m256d hx = _mm256_add_pd(wi0, wo0);
+	__m256d hy = _mm256_add_pd(wi1, wo1);
+	__m256d hz = _mm256_add_pd(wi2, wo2);
+
+	__m256d r2 = _mm256_add_pd(_mm256_mul_pd(hx, hx), _mm256_mul_pd(hy, hy));
+	__m256d len = _mm256_sqrt_pd(_mm256_add_pd(r2, _mm256_mul_pd(hz, hz)));
+
+	__m256d hxy_dot = _mm256_add_pd(_mm256_mul_pd(hx, wi0), _mm256_mul_pd(hy, wi1));
+	cos_theta_half = _mm256_div_pd(hz, len);
+	cos_theta_diff = _mm256_div_pd(
+		_mm256_add_pd(hxy_dot, _mm256_mul_pd(hz, wi2)), len);
+
+	__m256d tilted = _mm256_cmp_pd(r2, zero, _CMP_GT_OQ);
+	__m256d diff_x = _mm256_blendv_pd(
+		_mm256_mul_pd(hz, wi0),
+		_mm256_sub_pd(_mm256_mul_pd(hz, hxy_dot), _mm256_mul_pd(r2, wi2)),
+		tilted);
+	__m256d diff_y = _mm256_blendv_pd(
+		_mm256_mul_pd(len, wi1),
+		_mm256_mul_pd(len, _mm256_sub_pd(_mm256_mul_pd(hx, wi1), _mm256_mul_pd(hy, wi0))),
+		tilted);
+	sin_2phi = _mm256_blendv_pd(
+		zero,
+		_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(two, hx), hy), r2),
+		tilted);
+
+	__m256d flip = _mm256_and_pd(_mm256_cmp_pd(diff_y, zero, _CMP_LT_OQ), sign);
+	diff_x = _mm256_xor_pd(diff_x, flip);
+	diff_y = _mm256_xor_pd(diff_y, flip);
+	__m256d extent = _mm256_add_pd(_mm256_andnot_pd(sign, diff_x), diff_y);
+	phi_diff = _mm256_blendv_pd(
+		one,
+		_mm256_div_pd(diff_x, extent),
+		_mm256_cmp_pd(extent, zero, _CMP_GT_OQ));
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void dir_indices_avx2(const T* const wi[3], const T* const wo[3], int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	const BRDFIndexEdges& edges = brdf_index_edges();
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d cos_theta_half, cos_theta_diff, phi_diff, sin_2phi;
+		half_diff_avx2(load_avx2(wi[0] + i), load_avx2(wi[1] + i), load_avx2(wi[2] + i),
+			load_avx2(wo[0] + i), load_avx2(wo[1] + i), load_avx2(wo[2] + i),
+			cos_theta_half, cos_theta_diff, phi_diff, sin_2phi);
+
+		_mm_storeu_si128((__m128i*)(theta_half_ind + i),
+			edge_search_avx2(edges.theta_half, BRDF_THETA_EDGES, cos_theta_half));
+		_mm_storeu_si128((__m128i*)(theta_diff_ind + i),
+			edge_search_avx2(edges.theta_diff, BRDF_THETA_EDGES, cos_theta_diff));
+		_mm_storeu_si128((__m128i*)(phi_diff_ind + i),
+			edge_search_avx2(edges.phi_diff, BRDF_PHI_EDGES, phi_diff));
+		_mm256_storeu_pd(sin_2phi_half + i, sin_2phi);
+	}
+	dir_indices_scalar(wi, wo, i, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+}
+
+// The index functions on four angles each, with the same divisions in the
+// same order, so that ties on bin edges go the same way. Truncating NaN or
+// out-of-range values gives INT_MIN in both, which clamps to 0.
+__attribute__((target("avx2")))
+static void angle_indices_avx2(const double* theta_half, const double* theta_diff, const double* phi_diff,
+	int n, int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	const __m128i first = _mm_setzero_si128();
+	const __m128i last_theta_half = _mm_set1_epi32(BRDF_SAMPLING_RES_THETA_H - 1);
+	const __m128i last_theta_diff = _mm_set1_epi32(BRDF_SAMPLING_RES_THETA_D - 1);
+	const __m128i last_phi_diff = _mm_set1_epi32(BRDF_SAMPLING_RES_PHI_D / 2 - 1);
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d th = _mm256_loadu_pd(theta_half + i);
+		__m256d deg = _mm256_mul_pd(_mm256_div_pd(th, _mm256_set1_pd(PI/2.0)),
+			_mm256_set1_pd(BRDF_SAMPLING_RES_THETA_H));
+		__m256d temp = _mm256_sqrt_pd(_mm256_mul_pd(deg, _mm256_set1_pd(BRDF_SAMPLING_RES_THETA_H)));
+		temp = _mm256_blendv_pd(temp, zero, _mm256_cmp_pd(th, zero, _CMP_LE_OQ));
+		__m128i k = _mm256_cvttpd_epi32(temp);
+		_mm_storeu_si128((__m128i*)(theta_half_ind + i), _mm_min_epi32(_mm_max_epi32(k, first), last_theta_half));
+
+		__m256d td = _mm256_loadu_pd(theta_diff + i);
+		k = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_div_pd(td, _mm256_set1_pd(PI * 0.5)),
+			_mm256_set1_pd(BRDF_SAMPLING_RES_THETA_D)));
+		_mm_storeu_si128((__m128i*)(theta_diff_ind + i), _mm_min_epi32(_mm_max_epi32(k, first), last_theta_diff));
+
+		__m256d pd = _mm256_loadu_pd(phi_diff + i);
+		pd = _mm256_blendv_pd(pd, _mm256_add_pd(pd, _mm256_set1_pd(PI)), _mm256_cmp_pd(pd, zero, _CMP_LT_OQ));
+		k = _mm256_cvttpd_epi32(_mm256_div_pd(
+			_mm256_mul_pd(_mm256_div_pd(pd, _mm256_set1_pd(PI)), _mm256_set1_pd(BRDF_SAMPLING_RES_PHI_D)),
+			_mm256_set1_pd(2)));
+		_mm_storeu_si128((__m128i*)(phi_diff_ind + i), _mm_min_epi32(_mm_max_epi32(k, first), last_phi_diff));
+	}
+	angle_indices_scalar(theta_half, theta_diff, phi_diff, i, n, theta_half_ind, theta_diff_ind, phi_diff_ind);
+}
+
+// brdf_lerp() on four values, gathering the table entries.
+__attribute__((target("avx2")))
+static inline __m256d lerp_avx2(const float* table, __m256d x)
+{
+	__m256d f = _mm256_mul_pd(x, _mm256_set1_pd(BRDF_LERP_ENTRIES));
+	__m128i k = _mm256_cvttpd_epi32(f);
+	k = _mm_min_epi32(_mm_max_epi32(k, _mm_setzero_si128()), _mm_set1_epi32(BRDF_LERP_ENTRIES - 1));
+	__m128 t0 = _mm_i32gather_ps(table, k, 4);
+	__m128 t1 = _mm_i32gather_ps(table + 1, k, 4);
+	return _mm256_add_pd(_mm256_cvtps_pd(t0),
+		_mm256_mul_pd(_mm256_cvtps_pd(_mm_sub_ps(t1, t0)), _mm256_sub_pd(f, _mm256_cvtepi32_pd(k))));
+}
+
+__attribute__((target("avx2")))
+static void dir_coords_avx2(const double* const wi[3], const double* const wo[3], int n,
+	double* theta_half_pos, double* theta_diff_pos, double* phi_diff_pos, double* sin_2phi_half)
+{
+	const BRDFLerpTables& tables = brdf_lerp_tables();
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d half = _mm256_set1_pd(0.5);
+	const __m256d one = _mm256_set1_pd(1.0);
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d cos_theta_half, cos_theta_diff, phi_diff, sin_2phi;
+		half_diff_avx2(load_avx2(wi[0] + i), load_avx2(wi[1] + i), load_avx2(wi[2] + i),
+			load_avx2(wo[0] + i), load_avx2(wo[1] + i), load_avx2(wo[2] + i),
+			cos_theta_half, cos_theta_diff, phi_diff, sin_2phi);
+
+		// max() takes its second operand for NaN, as the scalar test does.
+		__m256d sin_half_theta_half = _mm256_sqrt_pd(
+			_mm256_max_pd(_mm256_mul_pd(half, _mm256_sub_pd(one, cos_theta_half)), zero));
+		__m256d sin_half_theta_diff = _mm256_sqrt_pd(
+			_mm256_max_pd(_mm256_mul_pd(half, _mm256_sub_pd(one, cos_theta_diff)), zero));
+		_mm256_storeu_pd(theta_half_pos + i, lerp_avx2(tables.theta_half, _mm256_sqrt_pd(sin_half_theta_half)));
+		_mm256_storeu_pd(theta_diff_pos + i, lerp_avx2(tables.theta_diff, sin_half_theta_diff));
+		_mm256_storeu_pd(phi_diff_pos + i, lerp_avx2(tables.phi_diff, _mm256_mul_pd(half, _mm256_add_pd(phi_diff, one))));
+		_mm256_storeu_pd(sin_2phi_half + i, sin_2phi);
+	}
+	dir_coords_scalar(wi, wo, i, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+}
+
+// theta_cell() on four positions; the bins come back as 32-bit integers.
+__attribute__((target("avx2")))
+static inline __m128i theta_cell_avx2(__m256d pos, int size, __m256d& weight)
+{
+	const __m256d one = _mm256_set1_pd(1.0);
+	__m128i first = _mm_sub_epi32(_mm256_cvttpd_epi32(_mm256_add_pd(pos, one)), _mm_set1_epi32(1));
+	__m128i below = _mm_cmplt_epi32(first, _mm_setzero_si128());
+	__m128i above = _mm_cmpgt_epi32(first, _mm_set1_epi32(size - 2));
+	weight = _mm256_sub_pd(pos, _mm256_cvtepi32_pd(first));
+	weight = _mm256_blendv_pd(weight, _mm256_setzero_pd(), _mm256_castsi256_pd(_mm256_cvtepi32_epi64(below)));
+	weight = _mm256_blendv_pd(weight, one, _mm256_castsi256_pd(_mm256_cvtepi32_epi64(above)));
+	first = _mm_blendv_epi8(first, _mm_setzero_si128(), below);
+	return _mm_blendv_epi8(first, _mm_set1_epi32(size - 2), above);
+}
+
+// The phi_diff bin of four positions, wrapped to the table, and the weight
+// of the next one.
+__attribute__((target("avx2")))
+static inline __m128i phi_cell_avx2(__m256d pos, __m256d& weight)
+{
+	__m128i first = _mm_sub_epi32(_mm256_cvttpd_epi32(_mm256_add_pd(pos, _mm256_set1_pd(1.0))), _mm_set1_epi32(1));
+	weight = _mm256_sub_pd(pos, _mm256_cvtepi32_pd(first));
+	__m128i below = _mm_cmplt_epi32(first, _mm_setzero_si128());
+	return _mm_add_epi32(first, _mm_and_si128(below, _mm_set1_epi32(BRDF_SAMPLING_RES_PHI_D / 2)));
+}
+
+// Eight float weights from two halves of four doubles.
+__attribute__((target("avx2")))
+static inline __m256 narrow_avx2(__m256d low, __m256d high)
+{
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(low)), _mm256_cvtpd_ps(high), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i join_avx2(__m128i low, __m128i high)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+// The float blend of brdf_fetch_interpolated() on eight positions of an
+// RGB-interleaved layout, gathering the 24 entries. The sums run in the
+// same order as the scalar ones, so the results match bit for bit; lanes
+// with a missing entry are redone by the scalar function.
+__attribute__((target("avx2")))
+static void fetch_interpolated_avx2(const BRDF& brdf, const double* theta_half_pos, const double* theta_diff_pos,
+	const double* phi_diff_pos, int n, double* rgb_out)
+{
+	const BRDFAxisOffsets& axes = brdf_axis_offsets(brdf.layout);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256i three = _mm256_set1_epi32(3);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256d wth_low, wth_high, wtd_low, wtd_high, wpd_low, wpd_high;
+		__m256i th = join_avx2(
+			theta_cell_avx2(_mm256_loadu_pd(theta_half_pos + i), BRDF_SAMPLING_RES_THETA_H, wth_low),
+			theta_cell_avx2(_mm256_loadu_pd(theta_half_pos + i + 4), BRDF_SAMPLING_RES_THETA_H, wth_high));
+		__m256i td = join_avx2(
+			theta_cell_avx2(_mm256_loadu_pd(theta_diff_pos + i), BRDF_SAMPLING_RES_THETA_D, wtd_low),
+			theta_cell_avx2(_mm256_loadu_pd(theta_diff_pos + i + 4), BRDF_SAMPLING_RES_THETA_D, wtd_high));
+		__m256i pd = join_avx2(
+			phi_cell_avx2(_mm256_loadu_pd(phi_diff_pos + i), wpd_low),
+			phi_cell_avx2(_mm256_loadu_pd(phi_diff_pos + i + 4), wpd_high));
+
+		__m256i offset_th[2] = {
+			_mm256_i32gather_epi32(axes.theta_half, th, 4),
+			_mm256_i32gather_epi32(axes.theta_half + 1, th, 4) };
+		__m256i offset_td[2] = {
+			_mm256_i32gather_epi32(axes.theta_diff, td, 4),
+			_mm256_i32gather_epi32(axes.theta_diff + 1, td, 4) };
+		__m256i offset_pd0 = _mm256_i32gather_epi32(axes.phi_diff, pd, 4);
+		__m256i offset_pd1 = _mm256_i32gather_epi32(axes.phi_diff + 1, pd, 4);
+
+		__m256 wpd1 = narrow_avx2(wpd_low, wpd_high);
+		__m256 wpd0 = _mm256_sub_ps(one, wpd1);
+		__m256 wth = narrow_avx2(wth_low, wth_high);
+		__m256 wtd = narrow_avx2(wtd_low, wtd_high);
+		__m256 weights_th[2] = { _mm256_sub_ps(one, wth), wth };
+		__m256 weights_td[2] = { _mm256_sub_ps(one, wtd), wtd };
+
+		__m256 sum[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+		__m256 lowest = _mm256_setzero_ps();
+		for (int a = 0; a < 2; a++)
+		{
+			for (int b = 0; b < 2; b++)
+			{
+				__m256 weight = _mm256_mul_ps(weights_th[a], weights_td[b]);
+				__m256i base = _mm256_add_epi32(offset_th[a], offset_td[b]);
+				__m256i ind0 = _mm256_mullo_epi32(_mm256_add_epi32(base, offset_pd0), three);
+				__m256i ind1 = _mm256_mullo_epi32(_mm256_add_epi32(base, offset_pd1), three);
+				for (int c = 0; c < 3; c++)
+				{
+					__m256 e0 = _mm256_i32gather_ps(brdf.rgb + c, ind0, 4);
+					__m256 e1 = _mm256_i32gather_ps(brdf.rgb + c, ind1, 4);
+					sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(weight,
+						_mm256_add_ps(_mm256_mul_ps(wpd0, e0), _mm256_mul_ps(wpd1, e1))));
+					// std::min(a, b) is _mm256_min_ps(b, a), NaNs included.
+					lowest = _mm256_min_ps(_mm256_min_ps(e1, e0), lowest);
+				}
+			}
+		}
+
+		double rgb[3][8];
+		for (int c = 0; c < 3; c++)
+		{
+			_mm256_storeu_pd(rgb[c], _mm256_cvtps_pd(_mm256_castps256_ps128(sum[c])));
+			_mm256_storeu_pd(rgb[c] + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(sum[c], 1)));
+		}
+		int missing = _mm256_movemask_ps(_mm256_cmp_ps(lowest, _mm256_setzero_ps(), _CMP_NGE_UQ));
+		double* out = rgb_out + 3 * i;
+		for (int k = 0; k < 8; k++)
+		{
+			if (missing & (1 << k))
+			{
+				brdf_fetch_interpolated(brdf, theta_half_pos[i + k], theta_diff_pos[i + k], phi_diff_pos[i + k],
+					out[3*k], out[3*k + 1], out[3*k + 2]);
+				continue;
+			}
+			out[3*k] = rgb[0][k];
+			out[3*k + 1] = rgb[1][k];
+			out[3*k + 2] = rgb[2][k];
+		}
+	}
+	for (; i < n; i++)
+	{
+		brdf_fetch_interpolated(brdf, theta_half_pos[i], theta_diff_pos[i], phi_diff_pos[i],
+			rgb_out[3*i], rgb_out[3*i + 1], rgb_out[3*i + 2]);
+	}
+}
+
+// GCC flags the deliberately undefined pass-through operand of the AVX-512
+// intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static inline __m512d load_avx512(const float* p)
+{
+	return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d load_avx512(const double* p)
+{
+	return _mm512_loadu_pd(p);
+}
+
+// brdf_edge_search() on eight values, gathering the edges.
+__attribute__((target("avx512f")))
+static inline __m256i edge_search_avx512(const double* edges, int size, __m512d value)
+{
+	__m512i k = _mm512_setzero_si512();
+	for (int step = size / 2; step > 0; step /= 2)
+	{
+		__m512i candidate = _mm512_add_epi64(k, _mm512_set1_epi64(step));
+		__m512d edge = _mm512_i64gather_pd(candidate, edges, 8);
+		__mmask8 ge = _mm512_cmp_pd_mask(edge, value, _CMP_GE_OQ);
+		k = _mm512_mask_mov_epi64(k, ge, candidate);
+	}
+	return _mm512_cvtepi64_epi32(k);
+}
+
+// brdf_dir_half_diff() on eight pairs.
+__attribute__((target("avx512f")))
+static inline void half_diff_avx512(__m512d wi0, __m512d wi1, __m512d wi2, __m512d wo0, __m512d wo1, __m512d wo2,
+	__m512d& cos_theta_half, __m512d& cos_theta_diff, __m512d& phi_diff, __m512d& sin_2phi)
+{
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d one = _mm512_set1_pd(1.0);
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512i sign = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+
+	__m512d hx = _mm512_add_pd(wi0, wo0);
+	__m512d hy = _mm512_add_pd(wi1, wo1);
+	__m512d hz = _mm512_add_pd(wi2, wo2);
+
+	__m512d r2 = _mm512_add_pd(_mm512_mul_pd(hx, hx), _mm512_mul_pd(hy, hy));
+	__m512d len = _mm512_sqrt_pd(_mm512_add_pd(r2, _mm512_mul_pd(hz, hz)));
+
+	__m512d hxy_dot = _mm512_add_pd(_mm512_mul_pd(hx, wi0), _mm512_mul_pd(hy, wi1));
+	cos_theta_half = _mm512_div_pd(hz, len);
+	cos_theta_diff = _mm512_div_pd(
+		_mm512_add_pd(hxy_dot, _mm512_mul_pd(hz, wi2)), len);
+
+	__mmask8 tilted = _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+	__m512d diff_x = _mm512_mask_blend_pd(tilted,
+		_mm512_mul_pd(hz, wi0),
+		_mm512_sub_pd(_mm512_mul_pd(hz, hxy_dot), _mm512_mul_pd(r2, wi2)));
+	__m512d diff_y = _mm512_mask_blend_pd(tilted,
+		_mm512_mul_pd(len, wi1),
+		_mm512_mul_pd(len, _mm512_sub_pd(_mm512_mul_pd(hx, wi1), _mm512_mul_pd(hy, wi0))));
+	sin_2phi = _mm512_mask_blend_pd(tilted,
+		zero,
+		_mm512_div_pd(_mm512_mul_pd(_mm512_mul_pd(two, hx), hy), r2));
+
+	__mmask8 flip = _mm512_cmp_pd_mask(diff_y, zero, _CMP_LT_OQ);
+	diff_x = _mm512_castsi512_pd(_mm512_mask_xor_epi64(
+		_mm512_castpd_si512(diff_x), flip, _mm512_castpd_si512(diff_x), sign));
+	diff_y = _mm512_castsi512_pd(_mm512_mask_xor_epi64(
+		_mm512_castpd_si512(diff_y), flip, _mm512_castpd_si512(diff_y), sign));
+	__m512d extent = _mm512_add_pd(_mm512_abs_pd(diff_x), diff_y);
+	phi_diff = _mm512_mask_blend_pd(
+		_mm512_cmp_pd_mask(extent, zero, _CMP_GT_OQ),
+		one,
+		_mm512_div_pd(diff_x, extent));
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+static void dir_indices_avx512(const T* const wi[3], const T* const wo[3], int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	const BRDFIndexEdges& edges = brdf_index_edges();
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m512d cos_theta_half, cos_theta_diff, phi_diff, sin_2phi;
+		half_diff_avx512(load_avx512(wi[0] + i), load_avx512(wi[1] + i), load_avx512(wi[2] + i),
+			load_avx512(wo[0] + i), load_avx512(wo[1] + i), load_avx512(wo[2] + i),
+			cos_theta_half, cos_theta_diff, phi_diff, sin_2phi);
+
+		_mm256_storeu_si256((__m256i*)(theta_half_ind + i),
+			edge_search_avx512(edges.theta_half, BRDF_THETA_EDGES, cos_theta_half));
+		_mm256_storeu_si256((__m256i*)(theta_diff_ind + i),
+			edge_search_avx512(edges.theta_diff, BRDF_THETA_EDGES, cos_theta_diff));
+		_mm256_storeu_si256((__m256i*)(phi_diff_ind + i),
+			edge_search_avx512(edges.phi_diff, BRDF_PHI_EDGES, phi_diff));
+		_mm512_storeu_pd(sin_2phi_half + i, sin_2phi);
+	}
+	dir_indices_scalar(wi, wo, i, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+}
+
+__attribute__((target("avx512f")))
+static void angle_indices_avx512(const double* theta_half, const double* theta_diff, const double* phi_diff,
+	int n, int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind)
+{
+	const __m512d zero = _mm512_setzero_pd();
+	const __m256i first = _mm256_setzero_si256();
+	const __m256i last_theta_half = _mm256_set1_epi32(BRDF_SAMPLING_RES_THETA_H - 1);
+	const __m256i last_theta_diff = _mm256_set1_epi32(BRDF_SAMPLING_RES_THETA_D - 1);
+	const __m256i last_phi_diff = _mm256_set1_epi32(BRDF_SAMPLING_RES_PHI_D / 2 - 1);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m512d th = _mm512_loadu_pd(theta_half + i);
+		__m512d deg = _mm512_mul_pd(_mm512_div_pd(th, _mm512_set1_pd(PI/2.0)),
+			_mm512_set1_pd(BRDF_SAMPLING_RES_THETA_H));
+		__m512d temp = _mm512_sqrt_pd(_mm512_mul_pd(deg, _mm512_set1_pd(BRDF_SAMPLING_RES_THETA_H)));
+		temp = _mm512_mask_mov_pd(temp, _mm512_cmp_pd_mask(th, zero, _CMP_LE_OQ), zero);
+		__m256i k = _mm512_cvttpd_epi32(temp);
+		_mm256_storeu_si256((__m256i*)(theta_half_ind + i),
+			_mm256_min_epi32(_mm256_max_epi32(k, first), last_theta_half));
+
+		__m512d td = _mm512_loadu_pd(theta_diff + i);
+		k = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_div_pd(td, _mm512_set1_pd(PI * 0.5)),
+			_mm512_set1_pd(BRDF_SAMPLING_RES_THETA_D)));
+		_mm256_storeu_si256((__m256i*)(theta_diff_ind + i),
+			_mm256_min_epi32(_mm256_max_epi32(k, first), last_theta_diff));
+
+		__m512d pd = _mm512_loadu_pd(phi_diff + i);
+		pd = _mm512_mask_add_pd(pd, _mm512_cmp_pd_mask(pd, zero, _CMP_LT_OQ), pd, _mm512_set1_pd(PI));
+		k = _mm512_cvttpd_epi32(_mm512_div_pd(
+			_mm512_mul_pd(_mm512_div_pd(pd, _mm512_set1_pd(PI)), _mm512_set1_pd(BRDF_SAMPLING_RES_PHI_D)),
+			_mm512_set1_pd(2)));
+		_mm256_storeu_si256((__m256i*)(phi_diff_ind + i),
+			_mm256_min_epi32(_mm256_max_epi32(k, first), last_phi_diff));
+	}
+	angle_indices_scalar(theta_half, theta_diff, phi_diff, i, n, theta_half_ind, theta_diff_ind, phi_diff_ind);
+}
+
+// brdf_lerp() on eight values, gathering the table entries.
+__attribute__((target("avx512f")))
+static inline __m512d lerp_avx512(const float* table, __m512d x)
+{
+	__m512d f = _mm512_mul_pd(x, _mm512_set1_pd(BRDF_LERP_ENTRIES));
+	__m256i k = _mm512_cvttpd_epi32(f);
+	k = _mm256_min_epi32(_mm256_max_epi32(k, _mm256_setzero_si256()), _mm256_set1_epi32(BRDF_LERP_ENTRIES - 1));
+	__m256 t0 = _mm256_i32gather_ps(table, k, 4);
+	__m256 t1 = _mm256_i32gather_ps(table + 1, k, 4);
+	return _mm512_add_pd(_mm512_cvtps_pd(t0),
+		_mm512_mul_pd(_mm512_cvtps_pd(_mm256_sub_ps(t1, t0)), _mm512_sub_pd(f, _mm512_cvtepi32_pd(k))));
+}
+
+__attribute__((target("avx512f")))
+static void dir_coords_avx512(const double* const wi[3], const double* const wo[3], int n,
+	double* theta_half_pos, double* theta_diff_pos, double* phi_diff_pos, double* sin_2phi_half)
+{
+	const BRDFLerpTables& tables = brdf_lerp_tables();
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d half = _mm512_set1_pd(0.5);
+	const __m512d one = _mm512_set1_pd(1.0);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m512d cos_theta_half, cos_theta_diff, phi_diff, sin_2phi;
+		half_diff_avx512(load_avx512(wi[0] + i), load_avx512(wi[1] + i), load_avx512(wi[2] + i),
+			load_avx512(wo[0] + i), load_avx512(wo[1] + i), load_avx512(wo[2] + i),
+			cos_theta_half, cos_theta_diff, phi_diff, sin_2phi);
+
+		__m512d sin_half_theta_half = _mm512_sqrt_pd(
+			_mm512_max_pd(_mm512_mul_pd(half, _mm512_sub_pd(one, cos_theta_half)), zero));
+		__m512d sin_half_theta_diff = _mm512_sqrt_pd(
+			_mm512_max_pd(_mm512_mul_pd(half, _mm512_sub_pd(one, cos_theta_diff)), zero));
+		_mm512_storeu_pd(theta_half_pos + i, lerp_avx512(tables.theta_half, _mm512_sqrt_pd(sin_half_theta_half)));
+		_mm512_storeu_pd(theta_diff_pos + i, lerp_avx512(tables.theta_diff, sin_half_theta_diff));
+		_mm512_storeu_pd(phi_diff_pos + i, lerp_avx512(tables.phi_diff, _mm512_mul_pd(half, _mm512_add_pd(phi_diff, one))));
+		_mm512_storeu_pd(sin_2phi_half + i, sin_2phi);
+	}
+	dir_coords_scalar(wi, wo, i, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+template <typename T>
+static void dir_indices(const T* const wi[3], const T* const wo[3], int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	// Make sure the edges exist before any kernel gathers from them.
+	brdf_index_edges();
+	switch (active_kernel)
+	{
+#ifdef BRDF_BATCH_X86
+	case KERNEL_AVX512:
+		dir_indices_avx512(wi, wo, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+		return;
+	case KERNEL_AVX2:
+		dir_indices_avx2(wi, wo, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+		return;
+#endif
+	default:
+		dir_indices_scalar(wi, wo, 0, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+		return;
+	}
+}
+
+static void angle_indices(const double* theta_half, const double* theta_diff, const double* phi_diff, int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind)
+{
+	switch (active_kernel)
+	{
+#ifdef BRDF_BATCH_X86
+	case KERNEL_AVX512:
+		angle_indices_avx512(theta_half, theta_diff, phi_diff, n, theta_half_ind, theta_diff_ind, phi_diff_ind);
+		return;
+	case KERNEL_AVX2:
+		angle_indices_avx2(theta_half, theta_diff, phi_diff, n, theta_half_ind, theta_diff_ind, phi_diff_ind);
+		return;
+#endif
+	default:
+		angle_indices_scalar(theta_half, theta_diff, phi_diff, 0, n, theta_half_ind, theta_diff_ind, phi_diff_ind);
+		return;
+	}
+}
+
+static void dir_coords(const double* const wi[3], const double* const wo[3], int n,
+	double* theta_half_pos, double* theta_diff_pos, double* phi_diff_pos, double* sin_2phi_half)
+{
+	brdf_lerp_tables();
+	switch (active_kernel)
+	{
+#ifdef BRDF_BATCH_X86
+	case KERNEL_AVX512:
+		dir_coords_avx512(wi, wo, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+		return;
+	case KERNEL_AVX2:
+		dir_coords_avx2(wi, wo, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+		return;
+#endif
+	default:
+		dir_coords_scalar(wi, wo, 0, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+		return;
+	}
+}
+
+template <typename T>
+static void lookup_batch(const BRDF& brdf, const T* const wi[3], const T* const wo[3], int n, double* rgb_out)
+{
+	int theta_half_ind[BATCH_CHUNK];
+	int theta_diff_ind[BATCH_CHUNK];
+	int phi_diff_ind[BATCH_CHUNK];
+	double sin_2phi_half[BATCH_CHUNK];
+
+	for (int begin = 0; begin < n; begin += BATCH_CHUNK)
+	{
+		int count = n - begin < BATCH_CHUNK ? n - begin : BATCH_CHUNK;
+		const T* in[3] = { wi[0] + begin, wi[1] + begin, wi[2] + begin };
+		const T* out[3] = { wo[0] + begin, wo[1] + begin, wo[2] + begin };
+		dir_indices(in, out, count, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+
+		double* rgb = rgb_out + 3 * begin;
+		for (int i = 0; i < count; i++)
+		{
+			brdf_fetch(brdf, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i],
+				rgb[3*i], rgb[3*i + 1], rgb[3*i + 2]);
+		}
+	}
+}
+
+template <typename T>
+static void lookup_aniso_batch(const BRDF& brdf1, const BRDF& brdf2,
+	const T* const wi[3], const T* const wo[3], int n, double* rgb_out)
+{
+	int theta_half_ind[BATCH_CHUNK];
+	int theta_diff_ind[BATCH_CHUNK];
+	int phi_diff_ind[BATCH_CHUNK];
+	double sin_2phi_half[BATCH_CHUNK];
+
+	for (int begin = 0; begin < n; begin += BATCH_CHUNK)
+	{
+		int count = n - begin < BATCH_CHUNK ? n - begin : BATCH_CHUNK;
+		const T* in[3] = { wi[0] + begin, wi[1] + begin, wi[2] + begin };
+		const T* out[3] = { wo[0] + begin, wo[1] + begin, wo[2] + begin };
+		dir_indices(in, out, count, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+
+		double* rgb = rgb_out + 3 * begin;
+		for (int i = 0; i < count; i++)
+		{
+			double red1, green1, blue1;
+			double red2, green2, blue2;
+			brdf_fetch(brdf1, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], red1, green1, blue1);
+			brdf_fetch(brdf2, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], red2, green2, blue2);
+			if (red1 < 0.0 || green1 < 0.0 || blue1 < 0.0 ||
+				red2 < 0.0 || green2 < 0.0 || blue2 < 0.0)
+			{
+				rgb[3*i] = 0;
+				rgb[3*i + 1] = 0;
+				rgb[3*i + 2] = 0;
+				continue;
+			}
+			double mix = 0.5 * (sin_2phi_half[i] + 1.0);
+			rgb[3*i] = mix * red1 + (1 - mix) * red2;
+			rgb[3*i + 1] = mix * green1 + (1 - mix) * green2;
+			rgb[3*i + 2] = mix * blue1 + (1 - mix) * blue2;
+		}
+	}
+}
+
+void brdf_dir_indices_batch(const float* const wi[3], const float* const wo[3], int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	dir_indices(wi, wo, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+}
+
+void brdf_dir_indices_batch(const double* const wi[3], const double* const wo[3], int n,
+	int* theta_half_ind, int* theta_diff_ind, int* phi_diff_ind, double* sin_2phi_half)
+{
+	dir_indices(wi, wo, n, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+}
+
+void lookup_brdf_batch(const BRDF& brdf, const float* const wi[3], const float* const wo[3], int n, double* rgb_out)
+{
+	lookup_batch(brdf, wi, wo, n, rgb_out);
+}
+
+void lookup_brdf_batch(const BRDF& brdf, const double* const wi[3], const double* const wo[3], int n, double* rgb_out)
+{
+	lookup_batch(brdf, wi, wo, n, rgb_out);
+}
+
+void lookup_aniso_brdf_batch(const BRDF& brdf1, const BRDF& brdf2,
+	const float* const wi[3], const float* const wo[3], int n, double* rgb_out)
+{
+	lookup_aniso_batch(brdf1, brdf2, wi, wo, n, rgb_out);
+}
+
+void lookup_aniso_brdf_batch(const BRDF& brdf1, const BRDF& brdf2,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out)
+{
+	lookup_aniso_batch(brdf1, brdf2, wi, wo, n, rgb_out);
+}
+
+void lookup_brdf_val_batch(const BRDF& brdf, const double* theta_in, const double* fi_in,
+	const double* theta_out, const double* fi_out, int n, double* rgb_out)
+{
+	double theta_half[BATCH_CHUNK];
+	double theta_diff[BATCH_CHUNK];
+	double fi_diff[BATCH_CHUNK];
+	int theta_half_ind[BATCH_CHUNK];
+	int theta_diff_ind[BATCH_CHUNK];
+	int phi_diff_ind[BATCH_CHUNK];
+
+	for (int begin = 0; begin < n; begin += BATCH_CHUNK)
+	{
+		int count = n - begin < BATCH_CHUNK ? n - begin : BATCH_CHUNK;
+		// The angles go through the C library's trig functions as in
+		// lookup_brdf_val(); only the index functions are vectorised.
+		for (int i = 0; i < count; i++)
+		{
+			double fi_half;
+			std_coords_to_half_diff_coords(theta_in[begin + i], fi_in[begin + i], theta_out[begin + i],
+				fi_out[begin + i], theta_half[i], fi_half, theta_diff[i], fi_diff[i]);
+		}
+		angle_indices(theta_half, theta_diff, fi_diff, count, theta_half_ind, theta_diff_ind, phi_diff_ind);
+
+		double* rgb = rgb_out + 3 * begin;
+		for (int i = 0; i < count; i++)
+		{
+			brdf_fetch(brdf, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i],
+				rgb[3*i], rgb[3*i + 1], rgb[3*i + 2]);
+		}
+	}
+}
+
+void brdf_dir_coords_batch(const double* const wi[3], const double* const wo[3], int n,
+	double* theta_half_pos, double* theta_diff_pos, double* phi_diff_pos, double* sin_2phi_half)
+{
+	dir_coords(wi, wo, n, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+}
+
+// The AVX2 gathers serve the AVX-512 kernel too: the fetch is bound by
+// the 24 gathers per position, not by the width of the arithmetic.
+void brdf_fetch_interpolated_batch(const BRDF& brdf, const double* theta_half_pos, const double* theta_diff_pos,
+	const double* phi_diff_pos, int n, double* rgb_out)
+{
+#ifdef BRDF_BATCH_X86
+	if (active_kernel >= KERNEL_AVX2 && brdf.layout != BRDF_LAYOUT_PLANAR)
+	{
+		fetch_interpolated_avx2(brdf, theta_half_pos, theta_diff_pos, phi_diff_pos, n, rgb_out);
+		return;
+	}
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		brdf_fetch_interpolated(brdf, theta_half_pos[i], theta_diff_pos[i], phi_diff_pos[i],
+			rgb_out[3*i], rgb_out[3*i + 1], rgb_out[3*i + 2]);
+	}
+}
+
+void lookup_aniso_brdf_batch_interpolated(const BRDF& brdf1, const BRDF& brdf2,
+	const double* const wi[3], const double* const wo[3], int n, double* rgb_out)
+{
+	double theta_half_pos[BATCH_CHUNK];
+	double theta_diff_pos[BATCH_CHUNK];
+	double phi_diff_pos[BATCH_CHUNK];
+	double sin_2phi_half[BATCH_CHUNK];
+	double rgb2[3 * BATCH_CHUNK];
+
+	for (int begin = 0; begin < n; begin += BATCH_CHUNK)
+	{
+		int count = n - begin < BATCH_CHUNK ? n - begin : BATCH_CHUNK;
+		const double* in[3] = { wi[0] + begin, wi[1] + begin, wi[2] + begin };
+		const double* out[3] = { wo[0] + begin, wo[1] + begin, wo[2] + begin };
+		dir_coords(in, out, count, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+
+		double* rgb = rgb_out + 3 * begin;
+		brdf_fetch_interpolated_batch(brdf1, theta_half_pos, theta_diff_pos, phi_diff_pos, count, rgb);
+		brdf_fetch_interpolated_batch(brdf2, theta_half_pos, theta_diff_pos, phi_diff_pos, count, rgb2);
+		for (int i = 0; i < count; i++)
+		{
+			// A failed fetch stores -1; successful ones are never negative.
+			if (rgb[3*i] < 0.0 || rgb2[3*i] < 0.0)
+			{
+				rgb[3*i] = rgb[3*i + 1] = rgb[3*i + 2] = 0.0;
+				continue;
+			}
+			double mix = 0.5 * (sin_2phi_half[i] + 1.0);
+			rgb[3*i] = mix * rgb[3*i] + (1 - mix) * rgb2[3*i];
+			rgb[3*i + 1] = mix * rgb[3*i + 1] + (1 - mix) * rgb2[3*i + 1];
+			rgb[3*i + 2] = mix * rgb[3*i + 2] + (1 - mix) * rgb2[3*i + 2];
+		}
+	}
+}
+
+const char* brdf_batch_kernel()
+{
+	switch (active_kernel)
+	{
+	case KERNEL_AVX512: return "avx512";
+	case KERNEL_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+// Force a kernel, e.g. to compare them. Fails if the CPU lacks it.
+bool select_brdf_batch_kernel(const char* name)
+{
+	BatchKernel kernel;
+	if (strcmp(name, "avx512") == 0)
+		kernel = KERNEL_AVX512;
+	else if (strcmp(name, "avx2") == 0)
+		kernel = KERNEL_AVX2;
+	else if (strcmp(name, "scalar") == 0)
+		kernel = KERNEL_SCALAR;
+	else
+		return false;
+	if (kernel > supported_kernel)
+		return false;
+	active_kernel = kernel;
+	return true;
+}
@@ -0,0 +1,293 @@
+#include "brdfblend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+// Samples whose table positions are found per pass.
+#define BLEND_CHUNK 256
+
+void BRDFBlend::allocate(int pixels)
+{
+	layers = 0;
+	this->pixels = pixels;
+	weights.clear();
+	active.assign(pixels, 0);
+}
+
+bool BRDFBlend::add_layer(const BRDF* brdf, BlendAzimuth azimuth, const std::vector<float>& layer_weights)
+{
+	if (layers >= BLEND_MAX_LAYERS || (int)layer_weights.size() != pixels)
+		return false;
+
+	this->brdf[layers] = brdf;
+	this->azimuth[layers] = azimuth;
+	weights.insert(weights.end(), layer_weights.begin(), layer_weights.end());
+	for (int p = 0; p < pixels; p++)
+	{
+		if (layer_weights[p] != 0.0f)
+			active[p] |= 1u << layers;
+	}
+	layers++;
+	return true;
+}
+
+void lookup_blend_brdf_batch(const BRDFBlend& blend, const int* pixel, const double* const wi[3], const double* const wo[3],
+	int n, bool interpolate, double* rgb_out)
+{
+	int theta_half_ind[BLEND_CHUNK];
+	int theta_diff_ind[BLEND_CHUNK];
+	int phi_diff_ind[BLEND_CHUNK];
+	double theta_half_pos[BLEND_CHUNK];
+	double theta_diff_pos[BLEND_CHUNK];
+	double phi_diff_pos[BLEND_CHUNK];
+	double sin_2phi_half[BLEND_CHUNK];
+	bool missing[BLEND_CHUNK];
+	// The samples a layer covers, packed for the batched interpolated fetch.
+	int layer_sample[BLEND_CHUNK];
+	double layer_theta_half[BLEND_CHUNK];
+	double layer_theta_diff[BLEND_CHUNK];
+	double layer_phi_diff[BLEND_CHUNK];
+	double layer_rgb[3 * BLEND_CHUNK];
+
+	for (int begin = 0; begin < n; begin += BLEND_CHUNK)
+	{
+		int count = std::min(n - begin, BLEND_CHUNK);
+		const double* in[3] = { wi[0] + begin, wi[1] + begin, wi[2] + begin };
+		const double* out[3] = { wo[0] + begin, wo[1] + begin, wo[2] + begin };
+		if (interpolate)
+		{
+			brdf_dir_coords_batch(in, out, count, theta_half_pos, theta_diff_pos, phi_diff_pos, sin_2phi_half);
+		}
+		else
+		{
+			brdf_dir_indices_batch(in, out, count, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+		}
+
+		double* rgb = rgb_out + 3 * begin;
+		for (int i = 0; i < 3 * count; i++)
+		{
+			rgb[i] = 0.0;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			missing[i] = false;
+		}
+
+		// One layer at a time, so each pass reads a single table.
+		const int* pixels = pixel + begin;
+		for (int l = 0; l < blend.layers; l++)
+		{
+			const BRDF& brdf = *blend.brdf[l];
+			const float* weight = &blend.weights[(size_t)l * blend.pixels];
+			unsigned int bit = 1u << l;
+			int covered = 0;
+			for (int i = 0; i < count; i++)
+			{
+				if (!(blend.active[pixels[i]] & bit) || missing[i])
+					continue;
+				layer_sample[covered] = i;
+				if (interpolate)
+				{
+					layer_theta_half[covered] = theta_half_pos[i];
+					layer_theta_diff[covered] = theta_diff_pos[i];
+					layer_phi_diff[covered] = phi_diff_pos[i];
+				}
+				covered++;
+			}
+			if (interpolate)
+			{
+				brdf_fetch_interpolated_batch(brdf, layer_theta_half, layer_theta_diff, layer_phi_diff, covered,
+					layer_rgb);
+			}
+
+			for (int k = 0; k < covered; k++)
+			{
+				int i = layer_sample[k];
+				double red, green, blue;
+				if (interpolate)
+				{
+					// A failed fetch stores -1 in all three.
+					red = layer_rgb[3*k];
+					green = layer_rgb[3*k + 1];
+					blue = layer_rgb[3*k + 2];
+					missing[i] = red < 0.0;
+				}
+				else
+				{
+					brdf_fetch(brdf, theta_half_ind[i], theta_diff_ind[i], phi_diff_ind[i], red, green, blue);
+					missing[i] = red < 0.0 || green < 0.0 || blue < 0.0;
+				}
+				if (missing[i])
+					continue;
+
+				double w = weight[pixels[i]];
+				if (blend.azimuth[l] != BLEND_AZIMUTH_NONE)
+				{
+					double mix = 0.5 * (sin_2phi_half[i] + 1.0);
+					w *= blend.azimuth[l] == BLEND_AZIMUTH_SIN ? mix : 1 - mix;
+				}
+				rgb[3*i] += w * red;
+				rgb[3*i + 1] += w * green;
+				rgb[3*i + 2] += w * blue;
+			}
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			if (missing[i])
+			{
+				rgb[3*i] = 0.0;
+				rgb[3*i + 1] = 0.0;
+				rgb[3*i + 2] = 0.0;
+			}
+		}
+	}
+}
+
+// Skip whitespace and '#' comments in a PGM header, then read a number.
+static bool read_pgm_number(FILE* file, int& value)
+{
+	int c = fgetc(file);
+	while (c == '#' || (c != EOF && isspace(c)))
+	{
+		if (c == '#')
+		{
+			while (c != EOF && c != '\n')
+				c = fgetc(file);
+		}
+		c = fgetc(file);
+	}
+	if (c == EOF || !isdigit(c))
+		return false;
+	value = 0;
+	while (c != EOF && isdigit(c))
+	{
+		value = value * 10 + (c - '0');
+		c = fgetc(file);
+	}
+	// The single whitespace character after the last number ends the header.
+	return c != EOF && isspace(c);
+}
+
+// A binary (P5) PGM as values in [0, 1], top row first.
+static bool read_pgm(const char* filename, int& width, int& height, std::vector<float>& values)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return false;
+
+	int maxval = 0;
+	bool ok = fgetc(file) == 'P' && fgetc(file) == '5' &&
+		read_pgm_number(file, width) && read_pgm_number(file, height) &&
+		read_pgm_number(file, maxval) &&
+		width > 0 && height > 0 && maxval > 0 && maxval < 65536;
+	if (ok)
+	{
+		// Two bytes per value, most significant first, past 255.
+		int bytes = maxval > 255 ? 2 : 1;
+		std::vector<unsigned char> data((size_t)width * height * bytes);
+		ok = fread(&data[0], 1, data.size(), file) == data.size();
+		values.resize((size_t)width * height);
+		for (size_t i = 0; ok && i < values.size(); i++)
+		{
+			int value = bytes == 2 ? data[2*i] << 8 | data[2*i + 1] : data[i];
+			values[i] = std::min(1.0f, (float)value / maxval);
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+// Equirectangular coordinates in [0, 1) of a sample's normal, laid out
+// like an environment map: u from phi = -pi at the left, v from the top.
+static void sphere_uv(const GBuffer& gbuffer, int s, double& u, double& v)
+{
+	double theta = acos(std::max(-1.0, std::min(gbuffer.ny[s], 1.0)));
+	double phi = atan2(gbuffer.nx[s], gbuffer.nz[s]);
+	u = std::min((phi + PI) / (2.0 * PI), 1.0 - 1e-9);
+	v = std::min(theta / PI, 1.0 - 1e-9);
+}
+
+// Weights at each hit sample's pixel from `weight(sample)`, then spread to
+// the pixels the sphere only clips.
+template <class Weight>
+static void pixel_weights(const GBuffer& gbuffer, const Weight& weight, std::vector<float>& weights)
+{
+	int size = gbuffer.size;
+	std::vector<char> set(size * size, 0);
+	weights.assign(size * size, 0.0f);
+	for (int s = 0; s < gbuffer.count; s++)
+	{
+		weights[gbuffer.pixel[s]] = weight(s);
+		set[gbuffer.pixel[s]] = 1;
+	}
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			for (int k = 0; k < 9 && !set[y * size + x]; k++)
+			{
+				int nx = x + k % 3 - 1, ny = y + k / 3 - 1;
+				if (nx >= 0 && ny >= 0 && nx < size && ny < size && set[ny * size + nx] == 1)
+				{
+					weights[y * size + x] = weights[ny * size + nx];
+					set[y * size + x] = 2;
+				}
+			}
+		}
+	}
+}
+
+bool blend_weights(const char* spec, const GBuffer& gbuffer, std::vector<float>& weights)
+{
+	char* end;
+	double constant = strtod(spec, &end);
+	if (end != spec && *end == '\0')
+	{
+		weights.assign(gbuffer.size * gbuffer.size, (float)constant);
+		return true;
+	}
+
+	int cells = 0;
+	if (sscanf(spec, "checker:%d", &cells) == 1 || sscanf(spec, "stripes:%d", &cells) == 1)
+	{
+		if (cells < 1)
+			return false;
+		bool checker = spec[0] == 'c';
+		// Half as many rows as columns keeps checker cells square.
+		int rows = std::max(1, cells / 2);
+		pixel_weights(gbuffer, [&](int s)
+		{
+			double u, v;
+			sphere_uv(gbuffer, s, u, v);
+			int cell = (int)(u * cells) + (checker ? (int)(v * rows) : 0);
+			return cell % 2 == 0 ? 1.0f : 0.0f;
+		}, weights);
+		return true;
+	}
+
+	if (strcmp(spec, "ramp") == 0)
+	{
+		pixel_weights(gbuffer, [&](int s)
+		{
+			double u, v;
+			sphere_uv(gbuffer, s, u, v);
+			return (float)v;
+		}, weights);
+		return true;
+	}
+
+	int width, height;
+	std::vector<float> texture;
+	if (!read_pgm(spec, width, height, texture))
+		return false;
+	pixel_weights(gbuffer, [&](int s)
+	{
+		double u, v;
+		sphere_uv(gbuffer, s, u, v);
+		return texture[(size_t)(v * height) * width + (int)(u * width)];
+	}, weights);
+	return true;
+}
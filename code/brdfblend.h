@@ -0,0 +1,58 @@
+#ifndef __BRDFBLEND_H__
+#define __BRDFBLEND_H__
+
+#include "brdf.h"
+#include "gbuffer.h"
+#include <vector>
+
+#define BLEND_MAX_LAYERS 32
+
+// How a layer's weight varies with the lookup, on top of its weight for
+// the sample.
+enum BlendAzimuth {
+	BLEND_AZIMUTH_NONE,
+	// 0.5 * (1 + sin(2 * phi_half)) and one minus it: the two halves of the
+	// anisotropic mix of lookup_aniso_brdf_dir().
+	BLEND_AZIMUTH_SIN,
+	BLEND_AZIMUTH_COMPLEMENT
+};
+
+// Materials shaded as a weighted sum, with a weight per layer and pixel
+// that every sample of the pixel shares. The table position of a lookup is
+// found once and shared by every layer, and layers whose weight for the
+// pixel is zero are not fetched, so a lookup costs one fetch per layer in
+// use there however many are loaded. Like lookup_aniso_brdf_batch(), a
+// lookup is zero if any layer in use has no entry there.
+struct BRDFBlend {
+	int layers;
+	int pixels;
+	const BRDF* brdf[BLEND_MAX_LAYERS];
+	BlendAzimuth azimuth[BLEND_MAX_LAYERS];
+	// [layer][pixel]
+	std::vector<float> weights;
+	// Per pixel, bit l set where layer l's weight is nonzero.
+	std::vector<unsigned int> active;
+
+	// Drop any layers and size for `pixels` pixels.
+	void allocate(int pixels);
+	// Append a layer with one weight per pixel. Fails once there are
+	// BLEND_MAX_LAYERS.
+	bool add_layer(const BRDF*, BlendAzimuth, const std::vector<float>& weights);
+};
+
+// Blend lookups for n samples, in the pixels given, with directions as
+// separate x, y and z arrays. With `interpolate` each layer is read with
+// brdf_fetch_interpolated(), otherwise at the nearest entry. rgb_out
+// receives 3 * n values.
+void lookup_blend_brdf_batch(const BRDFBlend&, const int* pixel, const double* const wi[3], const double* const wo[3],
+	int n, bool interpolate, double* rgb_out);
+
+// Per-pixel weights for the G-buffer's image from a description: a number,
+// used everywhere; a pattern over the sphere, "checker:n" or "stripes:n"
+// for n cells around it, or "ramp" for 0 at the top to 1 at the bottom; or
+// the name of a binary PGM mapped over the sphere like an environment map.
+// Pixels the sphere only clips take a hit neighbour's weight. Fails on
+// anything else.
+bool blend_weights(const char*, const GBuffer&, std::vector<float>& weights);
+
+#endif
@@ -0,0 +1,205 @@
+#include "brdfcache.h"
+#include <string.h>
+
+BRDFCache::BRDFCache(size_t budget, BRDFLayout layout)
+	: budget(budget), used(0), layout(layout), stopping(false),
+	hit_count(0), miss_count(0), eviction_count(0)
+{
+	loader = std::thread(&BRDFCache::loader_loop, this);
+}
+
+BRDFCache::~BRDFCache()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	work.notify_all();
+	loader.join();
+
+	std::map<std::string, Entry*>::iterator it;
+	for (it = entries.begin(); it != entries.end(); ++it)
+	{
+		free_brdf(it->second->brdf);
+		delete it->second;
+	}
+}
+
+BRDFCache::Entry* BRDFCache::create(const std::string& path)
+{
+	Entry* entry = new Entry();
+	entry->path = path;
+	entry->state = QUEUED;
+	entry->failed = false;
+	memset(&entry->brdf, 0, sizeof(entry->brdf));
+	entry->bytes = 0;
+	entry->users = 0;
+	entry->in_lru = false;
+	entries[path] = entry;
+	return entry;
+}
+
+// Read an entry whose state the caller has set to LOADING. The lock is
+// dropped while the file is read.
+void BRDFCache::load(Entry* entry, std::unique_lock<std::mutex>& guard)
+{
+	guard.unlock();
+	BRDF brdf;
+	memset(&brdf, 0, sizeof(brdf));
+	bool ok = read_brdf(entry->path.c_str(), brdf, layout);
+	guard.lock();
+
+	entry->brdf = brdf;
+	entry->failed = !ok;
+	entry->bytes = ok ? brdf_memory_size(brdf) : 0;
+	entry->state = READY;
+	used += entry->bytes;
+	miss_count++;
+	// A prefetched entry stays off `unused` until get() claims it and
+	// its last handle is dropped, so read-ahead is never evicted unread.
+	evict();
+	loaded.notify_all();
+}
+
+// Free least recently used materials without users until within budget.
+void BRDFCache::evict()
+{
+	while (used > budget && !unused.empty())
+	{
+		Entry* entry = unused.front();
+		unused.pop_front();
+		free_brdf(entry->brdf);
+		used -= entry->bytes;
+		entries.erase(entry->path);
+		delete entry;
+		eviction_count++;
+	}
+}
+
+void BRDFCache::release(Entry* entry)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (--entry->users == 0)
+	{
+		entry->lru = unused.insert(unused.end(), entry);
+		entry->in_lru = true;
+		evict();
+	}
+}
+
+void BRDFCache::loader_loop()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		work.wait(guard, [this] { return stopping || !queue.empty(); });
+		if (stopping)
+		{
+			return;
+		}
+		Entry* entry = queue.front();
+		queue.pop_front();
+		entry->state = LOADING;
+		load(entry, guard);
+	}
+}
+
+void BRDFCache::prefetch(const std::string& path)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (entries.count(path))
+	{
+		return;
+	}
+	queue.push_back(create(path));
+	work.notify_one();
+}
+
+BRDFCache::Handle BRDFCache::get(const std::string& path)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	Entry* entry;
+	std::map<std::string, Entry*>::iterator it = entries.find(path);
+	if (it == entries.end())
+	{
+		entry = create(path);
+	}
+	else
+	{
+		entry = it->second;
+	}
+
+	// Taking a use first keeps the entry from being evicted as soon as it
+	// has loaded.
+	entry->users++;
+	if (entry->in_lru)
+	{
+		unused.erase(entry->lru);
+		entry->in_lru = false;
+	}
+
+	if (entry->state == QUEUED)
+	{
+		// Not started yet, possibly behind other prefetches: load it here.
+		for (std::deque<Entry*>::iterator q = queue.begin(); q != queue.end(); ++q)
+		{
+			if (*q == entry)
+			{
+				queue.erase(q);
+				break;
+			}
+		}
+		entry->state = LOADING;
+		load(entry, guard);
+	}
+	else if (entry->state == LOADING)
+	{
+		loaded.wait(guard, [entry] { return entry->state == READY; });
+	}
+	else if (!entry->failed)
+	{
+		hit_count++;
+	}
+
+	// A failure is reported to the get() calls waiting for it, or to the
+	// first one after a prefetch, then forgotten so that a later get()
+	// reads the file again. The last of those calls frees the entry.
+	if (entry->failed)
+	{
+		std::map<std::string, Entry*>::iterator mapped = entries.find(path);
+		if (mapped != entries.end() && mapped->second == entry)
+		{
+			entries.erase(mapped);
+		}
+		if (--entry->users == 0)
+		{
+			delete entry;
+		}
+		return Handle();
+	}
+	return Handle(&entry->brdf, [this, entry](const BRDF*) { release(entry); });
+}
+
+size_t BRDFCache::bytes()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return used;
+}
+
+int BRDFCache::hits()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return hit_count;
+}
+
+int BRDFCache::misses()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return miss_count;
+}
+
+int BRDFCache::evictions()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return eviction_count;
+}
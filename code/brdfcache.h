@@ -0,0 +1,97 @@
+#ifndef __BRDFCACHE_H__
+#define __BRDFCACHE_H__
+
+#include "brdf.h"
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Loaded materials shared by path, within a memory budget.
+//
+// get() hands out reference-counted handles. A material stays loaded while
+// any handle to it is alive; once the last one is dropped it joins an LRU
+// list and is only freed when the cache needs room, so a material that is
+// asked for again soon is not read twice. Materials in use are never
+// evicted, so the budget can be exceeded while more than it allows are held
+// at once.
+//
+// prefetch() queues a load on the cache's own thread. A prefetched
+// material is held, like one in use, until get() has claimed it and let it
+// go, so that read-ahead never makes a file be read twice; materials
+// prefetched but never asked for stay until the cache is destroyed.
+// Handles must not outlive the cache.
+class BRDFCache {
+public:
+	typedef std::shared_ptr<const BRDF> Handle;
+
+private:
+	enum State {
+		QUEUED,
+		LOADING,
+		READY
+	};
+
+	struct Entry {
+		std::string path;
+		State state;
+		bool failed;
+		BRDF brdf;
+		size_t bytes;
+		int users;
+		// Position in `unused` while users == 0 and the entry is ready
+		// and has been claimed by get().
+		std::list<Entry*>::iterator lru;
+		bool in_lru;
+	};
+
+	size_t budget;
+	size_t used;
+	BRDFLayout layout;
+	std::map<std::string, Entry*> entries;
+	// Ready entries without users, least recently used first.
+	std::list<Entry*> unused;
+	// Prefetched entries waiting for the loader thread.
+	std::deque<Entry*> queue;
+	std::mutex lock;
+	std::condition_variable work;
+	std::condition_variable loaded;
+	std::thread loader;
+	bool stopping;
+
+	int hit_count;
+	int miss_count;
+	int eviction_count;
+
+	Entry* create(const std::string&);
+	void load(Entry*, std::unique_lock<std::mutex>&);
+	void release(Entry*);
+	void evict();
+	void loader_loop();
+
+	BRDFCache(const BRDFCache&);
+	BRDFCache& operator=(const BRDFCache&);
+
+public:
+	BRDFCache(size_t budget, BRDFLayout layout);
+	~BRDFCache();
+
+	void prefetch(const std::string& path);
+	// The material at `path`, loading it on the calling thread or waiting
+	// for the loader as needed. Returns an empty handle if it cannot be
+	// read; failures are not cached, so a later call reads it again.
+	Handle get(const std::string& path);
+
+	// Bytes held, used or not. Misses count files read, including failed
+	// reads; hits count get() calls answered by an entry already loaded.
+	size_t bytes();
+	int hits();
+	int misses();
+	int evictions();
+};
+
+#endif
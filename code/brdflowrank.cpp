@@ -0,0 +1,310 @@
+#include "brdflowrank.h"
+#include <stdio.h>
+#include <algorithm>
+
+#define SLICE_ROWS BRDF_SAMPLING_RES_THETA_D
+#define SLICE_COLUMNS (BRDF_SAMPLING_RES_PHI_D / 2)
+
+// Eigenvalues and eigenvectors of the symmetric n x n matrix `a` by cyclic
+// Jacobi rotations. `a` is destroyed; column k of `vectors` belongs to
+// values[k].
+static void symmetric_eigen(double* a, int n, double* values, double* vectors)
+{
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			vectors[i * n + j] = i == j ? 1.0 : 0.0;
+		}
+	}
+
+	for (int sweep = 0; sweep < 50; sweep++)
+	{
+		double off = 0.0, diagonal = 0.0;
+		for (int i = 0; i < n; i++)
+		{
+			diagonal += a[i * n + i] * a[i * n + i];
+			for (int j = i + 1; j < n; j++)
+			{
+				off += a[i * n + j] * a[i * n + j];
+			}
+		}
+		if (off <= 1e-24 * diagonal)
+			break;
+
+		for (int p = 0; p < n; p++)
+		{
+			for (int q = p + 1; q < n; q++)
+			{
+				double apq = a[p * n + q];
+				if (apq == 0.0)
+					continue;
+				double theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+				double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				double c = 1.0 / sqrt(t * t + 1.0);
+				double s = t * c;
+				for (int k = 0; k < n; k++)
+				{
+					double akp = a[k * n + p];
+					double akq = a[k * n + q];
+					a[k * n + p] = c * akp - s * akq;
+					a[k * n + q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < n; k++)
+				{
+					double apk = a[p * n + k];
+					double aqk = a[q * n + k];
+					a[p * n + k] = c * apk - s * aqk;
+					a[q * n + k] = s * apk + c * aqk;
+				}
+				for (int k = 0; k < n; k++)
+				{
+					double vkp = vectors[k * n + p];
+					double vkq = vectors[k * n + q];
+					vectors[k * n + p] = c * vkp - s * vkq;
+					vectors[k * n + q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		values[i] = a[i * n + i];
+	}
+}
+
+void LowRankBRDF::allocate(int rank)
+{
+	this->rank = rank;
+	u.assign((size_t)BRDF_SAMPLING_RES_THETA_H * SLICE_ROWS * 3 * rank, 0.0f);
+	v.assign((size_t)BRDF_SAMPLING_RES_THETA_H * SLICE_COLUMNS * 3 * rank, 0.0f);
+	valid.assign((BRDF_TABLE_SIZE + 7) / 8, 0);
+}
+
+void LowRankBRDF::build(const BRDF& brdf, int rank)
+{
+	allocate(rank);
+	build(brdf, 0, BRDF_SAMPLING_RES_THETA_H);
+}
+
+void LowRankBRDF::build(const BRDF& brdf, int begin, int end)
+{
+	std::vector<double> slice(3 * SLICE_ROWS * SLICE_COLUMNS);
+	std::vector<double> gram(SLICE_ROWS * SLICE_ROWS);
+	std::vector<double> vectors(SLICE_ROWS * SLICE_ROWS);
+	double values[SLICE_ROWS];
+	int order[SLICE_ROWS];
+
+	for (int h = begin; h < end; h++)
+	{
+		// Missing entries are fitted as black; the mask hides them again.
+		for (int i = 0; i < SLICE_ROWS; i++)
+		{
+			for (int j = 0; j < SLICE_COLUMNS; j++)
+			{
+				double rgb[3];
+				brdf_fetch(brdf, h, i, j, rgb[0], rgb[1], rgb[2]);
+				bool ok = rgb[0] >= 0.0 && rgb[1] >= 0.0 && rgb[2] >= 0.0;
+				if (ok)
+				{
+					// Each byte of the mask covers entries of one slice, as
+					// SLICE_ROWS * SLICE_COLUMNS is a multiple of 8, so
+					// threads fitting different bins never share a byte.
+					int ind = brdf_planar_index(h, i, j);
+					valid[ind >> 3] |= (unsigned char)(1 << (ind & 7));
+				}
+				for (int channel = 0; channel < 3; channel++)
+				{
+					slice[(channel * SLICE_ROWS + i) * SLICE_COLUMNS + j] =
+						log((ok ? rgb[channel] : 0.0) + LOW_RANK_BRDF_EPSILON);
+				}
+			}
+		}
+
+		for (int channel = 0; channel < 3; channel++)
+		{
+			// The leading eigenvectors of A A^T are the left singular
+			// vectors; A^T u then carries the singular value.
+			const double* a = &slice[channel * SLICE_ROWS * SLICE_COLUMNS];
+			for (int i = 0; i < SLICE_ROWS; i++)
+			{
+				for (int k = i; k < SLICE_ROWS; k++)
+				{
+					double sum = 0.0;
+					for (int j = 0; j < SLICE_COLUMNS; j++)
+					{
+						sum += a[i * SLICE_COLUMNS + j] * a[k * SLICE_COLUMNS + j];
+					}
+					gram[i * SLICE_ROWS + k] = sum;
+					gram[k * SLICE_ROWS + i] = sum;
+				}
+			}
+			symmetric_eigen(&gram[0], SLICE_ROWS, values, &vectors[0]);
+			for (int i = 0; i < SLICE_ROWS; i++)
+			{
+				order[i] = i;
+			}
+			std::sort(order, order + SLICE_ROWS, [&values](int x, int y) { return values[x] > values[y]; });
+
+			for (int r = 0; r < rank && r < SLICE_ROWS; r++)
+			{
+				int k = order[r];
+				for (int i = 0; i < SLICE_ROWS; i++)
+				{
+					u[(((size_t)h * SLICE_ROWS + i) * 3 + channel) * rank + r] = (float)vectors[i * SLICE_ROWS + k];
+				}
+				for (int j = 0; j < SLICE_COLUMNS; j++)
+				{
+					double sum = 0.0;
+					for (int i = 0; i < SLICE_ROWS; i++)
+					{
+						sum += a[i * SLICE_COLUMNS + j] * vectors[i * SLICE_ROWS + k];
+					}
+					v[(((size_t)h * SLICE_COLUMNS + j) * 3 + channel) * rank + r] = (float)sum;
+				}
+			}
+		}
+	}
+}
+
+int lookup_low_rank_brdf_val(const LowRankBRDF& brdf, double theta_in, double fi_in,
+	double theta_out, double fi_out,
+	double& red_val, double& green_val, double& blue_val)
+{
+	double theta_half, fi_half, theta_diff, fi_diff;
+	std_coords_to_half_diff_coords(theta_in, fi_in, theta_out, fi_out,
+		theta_half, fi_half, theta_diff, fi_diff);
+
+	low_rank_brdf_fetch(brdf, theta_half_index(theta_half), theta_diff_index(theta_diff),
+		phi_diff_index(fi_diff), red_val, green_val, blue_val);
+
+	if (red_val < 0.0 || green_val < 0.0 || blue_val < 0.0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+int lookup_low_rank_brdf_dir(const LowRankBRDF& brdf, const double* wi, const double* wo,
+	double& red_val, double& green_val, double& blue_val)
+{
+	int theta_half_ind, theta_diff_ind, phi_diff_ind;
+	double sin_2phi_half;
+	brdf_dir_indices(wi, wo, theta_half_ind, theta_diff_ind, phi_diff_ind, sin_2phi_half);
+
+	low_rank_brdf_fetch(brdf, theta_half_ind, theta_diff_ind, phi_diff_ind, red_val, green_val, blue_val);
+
+	if (red_val < 0.0 || green_val < 0.0 || blue_val < 0.0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+static bool valid_low_rank_header(const LowRankBRDFHeader& header)
+{
+	if (memcmp(header.magic, LOW_RANK_BRDF_MAGIC, sizeof(LOW_RANK_BRDF_MAGIC)) != 0 ||
+		header.version != LOW_RANK_BRDF_VERSION ||
+		header.dims[0] != BRDF_SAMPLING_RES_THETA_H ||
+		header.dims[1] != BRDF_SAMPLING_RES_THETA_D ||
+		header.dims[2] != BRDF_SAMPLING_RES_PHI_D / 2 ||
+		header.channels != 3 ||
+		header.rank < 1 || header.rank > SLICE_ROWS)
+	{
+		fprintf(stderr, "Invalid low-rank BRDF header\n");
+		return false;
+	}
+	return true;
+}
+
+// The file is a LowRankBRDFHeader followed by u, v and the mask.
+bool read_low_rank_brdf(const char* filename, LowRankBRDF& brdf)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	LowRankBRDFHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || !valid_low_rank_header(header))
+	{
+		fclose(f);
+		return false;
+	}
+
+	brdf.allocate(header.rank);
+	bool ok = fread(&brdf.u[0], sizeof(float), brdf.u.size(), f) == brdf.u.size() &&
+		fread(&brdf.v[0], sizeof(float), brdf.v.size(), f) == brdf.v.size() &&
+		fread(&brdf.valid[0], 1, brdf.valid.size(), f) == brdf.valid.size() &&
+		fgetc(f) == EOF;
+	fclose(f);
+	if (!ok)
+	{
+		fprintf(stderr, "Low-rank BRDF size doesn't match\n");
+	}
+	return ok;
+}
+
+bool parse_low_rank_brdf(const unsigned char* bytes, size_t size, LowRankBRDF& brdf)
+{
+	LowRankBRDFHeader header;
+	if (size < sizeof(header))
+	{
+		fprintf(stderr, "Invalid low-rank BRDF header\n");
+		return false;
+	}
+	memcpy(&header, bytes, sizeof(header));
+	if (!valid_low_rank_header(header))
+		return false;
+
+	brdf.allocate(header.rank);
+	size_t u_size = brdf.u.size() * sizeof(float);
+	size_t v_size = brdf.v.size() * sizeof(float);
+	if (size != sizeof(header) + u_size + v_size + brdf.valid.size())
+	{
+		fprintf(stderr, "Low-rank BRDF size doesn't match\n");
+		return false;
+	}
+	bytes += sizeof(header);
+	memcpy(&brdf.u[0], bytes, u_size);
+	memcpy(&brdf.v[0], bytes + u_size, v_size);
+	memcpy(&brdf.valid[0], bytes + u_size + v_size, brdf.valid.size());
+	return true;
+}
+
+bool write_low_rank_brdf(const char* filename, const LowRankBRDF& brdf)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	LowRankBRDFHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LOW_RANK_BRDF_MAGIC, sizeof(LOW_RANK_BRDF_MAGIC));
+	header.version = LOW_RANK_BRDF_VERSION;
+	header.dims[0] = BRDF_SAMPLING_RES_THETA_H;
+	header.dims[1] = BRDF_SAMPLING_RES_THETA_D;
+	header.dims[2] = BRDF_SAMPLING_RES_PHI_D / 2;
+	header.channels = 3;
+	header.rank = brdf.rank;
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(&brdf.u[0], sizeof(float), brdf.u.size(), f) == brdf.u.size() &&
+		fwrite(&brdf.v[0], sizeof(float), brdf.v.size(), f) == brdf.v.size() &&
+		fwrite(&brdf.valid[0], 1, brdf.valid.size(), f) == brdf.valid.size();
+	if (fclose(f) != 0)
+		ok = false;
+	return ok;
+}
+
+size_t low_rank_brdf_memory_size(const LowRankBRDF& brdf)
+{
+	return (brdf.u.size() + brdf.v.size()) * sizeof(float) + brdf.valid.size();
+}
+
+void brdf_fetch_low_rank(const BRDF& brdf, int theta_half_ind, int theta_diff_ind, int phi_diff_ind,
+	double& red_val, double& green_val, double& blue_val)
+{
+	low_rank_brdf_fetch(*brdf.low_rank, theta_half_ind, theta_diff_ind, phi_diff_ind,
+		red_val, green_val, blue_val);
+}
@@ -0,0 +1,82 @@
+#ifndef __BRDFLOWRANK_H__
+#define __BRDFLOWRANK_H__
+
+#include "brdf.h"
+#include <vector>
+
+// Added to table values before taking logs, so that black entries stay
+// finite and dim ones are not fitted with more care than bright ones.
+#define LOW_RANK_BRDF_EPSILON 1e-3
+
+#define LOW_RANK_BRDF_MAGIC "MERLLR1"
+#define LOW_RANK_BRDF_VERSION 1
+
+struct LowRankBRDFHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int dims[3];
+	unsigned int channels;
+	unsigned int rank;
+};
+
+// A BRDF table compressed per theta_half bin and channel: the theta_diff x
+// phi_diff slice of log(value + LOW_RANK_BRDF_EPSILON) is replaced by its
+// best rank `rank` approximation, sum_r u_r v_r^T. An entry costs one dot
+// product of length `rank` and an exp to reconstruct. Entries the source
+// marks as missing (negative) are kept in a bitmask and come back as -1,
+// as in the MERL files.
+struct LowRankBRDF {
+	int rank;
+	// [theta_half][theta_diff][channel][rank], singular values folded in.
+	std::vector<float> u;
+	// [theta_half][phi_diff][channel][rank]
+	std::vector<float> v;
+	// One bit per entry in brdf_planar_index() order, set where valid.
+	std::vector<unsigned char> valid;
+
+	void build(const BRDF&, int rank);
+	// Size the factors for `rank`, then fit theta_half bins [begin, end).
+	// Bins are independent, so they can be fitted on different threads.
+	void allocate(int rank);
+	void build(const BRDF&, int begin, int end);
+};
+
+// Scaled red, green and blue values of a table entry, as brdf_fetch().
+inline void low_rank_brdf_fetch(const LowRankBRDF& brdf, int theta_half_ind, int theta_diff_ind, int phi_diff_ind,
+	double& red_val, double& green_val, double& blue_val)
+{
+	int ind = brdf_planar_index(theta_half_ind, theta_diff_ind, phi_diff_ind);
+	if (!(brdf.valid[ind >> 3] & (1 << (ind & 7))))
+	{
+		red_val = green_val = blue_val = -1.0;
+		return;
+	}
+
+	int rank = brdf.rank;
+	const float* u = &brdf.u[((size_t)theta_half_ind * BRDF_SAMPLING_RES_THETA_D + theta_diff_ind) * 3 * rank];
+	const float* v = &brdf.v[((size_t)theta_half_ind * (BRDF_SAMPLING_RES_PHI_D / 2) + phi_diff_ind) * 3 * rank];
+	float sum[3] = { 0.0f, 0.0f, 0.0f };
+	for (int channel = 0; channel < 3; channel++)
+	{
+		for (int r = 0; r < rank; r++)
+		{
+			sum[channel] += u[channel * rank + r] * v[channel * rank + r];
+		}
+	}
+	red_val = fmax(0.0, exp((double)sum[0]) - LOW_RANK_BRDF_EPSILON);
+	green_val = fmax(0.0, exp((double)sum[1]) - LOW_RANK_BRDF_EPSILON);
+	blue_val = fmax(0.0, exp((double)sum[2]) - LOW_RANK_BRDF_EPSILON);
+}
+
+int lookup_low_rank_brdf_val(const LowRankBRDF&, double, double, double, double,
+	double&, double&, double&);
+int lookup_low_rank_brdf_dir(const LowRankBRDF&, const double*, const double*,
+	double&, double&, double&);
+
+bool read_low_rank_brdf(const char*, LowRankBRDF&);
+// The same from the contents of a file, as read_brdf() maps them.
+bool parse_low_rank_brdf(const unsigned char*, size_t, LowRankBRDF&);
+bool write_low_rank_brdf(const char*, const LowRankBRDF&);
+size_t low_rank_brdf_memory_size(const LowRankBRDF&);
+
+#endif
@@ -0,0 +1,208 @@
+#include "brdfsampler.h"
+#include <math.h>
+#include <algorithm>
+
+#define PHI_HALF_STEP (2.0 * PI / BRDF_SAMPLER_PHI_HALF)
+
+static double luminance(double red, double green, double blue)
+{
+	return 0.2126 * red + 0.7152 * green + 0.0722 * blue;
+}
+
+static int view_bin(const double* wo)
+{
+	double theta_out = acos(std::min(1.0, wo[2]));
+	int bin = (int)(theta_out / (0.5 * PI) * BRDF_SAMPLER_THETA_OUT);
+	return std::min(bin, BRDF_SAMPLER_THETA_OUT - 1);
+}
+
+// Index of the cell of a CDF with `size` cells that contains u, skipping
+// cells of zero probability. A u that rounds to 1 as a float lands past
+// the last cell, so that case steps back to the last nonempty one.
+static int cdf_search(const float* cdf, int size, double u)
+{
+	int cell = (int)(std::upper_bound(cdf, cdf + size + 1, (float)u) - cdf) - 1;
+	cell = std::max(0, std::min(cell, size - 1));
+	while (cell > 0 && cdf[cell + 1] <= cdf[cell])
+	{
+		cell--;
+	}
+	return cell;
+}
+
+// Turn `weights` into a CDF in place (size + 1 entries, from 0 to 1) and
+// return the total. All-zero weights give a uniform CDF.
+static double build_cdf(double* weights, int size, float* cdf)
+{
+	double total = 0.0;
+	for (int i = 0; i < size; i++)
+	{
+		total += weights[i];
+	}
+	double sum = 0.0;
+	cdf[0] = 0.0f;
+	for (int i = 0; i < size; i++)
+	{
+		sum += total > 0.0 ? weights[i] : 1.0;
+		cdf[i + 1] = (float)(sum / (total > 0.0 ? total : size));
+	}
+	cdf[size] = 1.0f;
+	return total;
+}
+
+void BRDFSampler::build(const BRDF& brdf)
+{
+	for (int i = 0; i <= BRDF_SAMPLER_THETA_HALF; i++)
+	{
+		double t = (double)i / BRDF_SAMPLER_THETA_HALF;
+		cos_theta_half[i] = cos(t * t * 0.5 * PI);
+	}
+	cos_theta_half[BRDF_SAMPLER_THETA_HALF] = 0.0;
+
+	marginal.resize(BRDF_SAMPLER_THETA_OUT * (BRDF_SAMPLER_THETA_HALF + 1));
+	conditional.resize(BRDF_SAMPLER_THETA_OUT * BRDF_SAMPLER_THETA_HALF * (BRDF_SAMPLER_PHI_HALF + 1));
+
+	const int cells = BRDF_SAMPLER_THETA_HALF * BRDF_SAMPLER_PHI_HALF;
+	std::vector<double> brdf_weight(cells);
+	std::vector<double> cosine_weight(cells);
+	double row_weight[BRDF_SAMPLER_THETA_HALF];
+
+	for (int k = 0; k < BRDF_SAMPLER_THETA_OUT; k++)
+	{
+		double theta_out = (k + 0.5) / BRDF_SAMPLER_THETA_OUT * 0.5 * PI;
+		double wo[3] = { sin(theta_out), 0.0, cos(theta_out) };
+
+		// Integrate over each cell with its centre value. cos(theta_in)
+		// d(w_in) = cos(theta_in) 4 (wo.h) d(w_half), and d(w_half) is the
+		// cell's cos(theta_half) range times its phi_half range.
+		double brdf_total = 0.0;
+		double cosine_total = 0.0;
+		for (int i = 0; i < BRDF_SAMPLER_THETA_HALF; i++)
+		{
+			double cos_theta = 0.5 * (cos_theta_half[i] + cos_theta_half[i + 1]);
+			double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+			double area = (cos_theta_half[i] - cos_theta_half[i + 1]) * PHI_HALF_STEP;
+			for (int j = 0; j < BRDF_SAMPLER_PHI_HALF; j++)
+			{
+				double phi = (j + 0.5) * PHI_HALF_STEP;
+				double half[3] = { sin_theta * cos(phi), sin_theta * sin(phi), cos_theta };
+				double wo_dot_h = wo[0] * half[0] + wo[1] * half[1] + wo[2] * half[2];
+				double wi[3];
+				for (int a = 0; a < 3; a++)
+				{
+					wi[a] = 2.0 * wo_dot_h * half[a] - wo[a];
+				}
+
+				int cell = i * BRDF_SAMPLER_PHI_HALF + j;
+				brdf_weight[cell] = 0.0;
+				cosine_weight[cell] = 0.0;
+				if (wo_dot_h <= 0.0 || wi[2] <= 0.0)
+				{
+					continue;
+				}
+				cosine_weight[cell] = wi[2] * 4.0 * wo_dot_h * area;
+				double red, green, blue;
+				if (lookup_brdf_dir(brdf, wi, wo, red, green, blue))
+				{
+					brdf_weight[cell] = luminance(red, green, blue) * cosine_weight[cell];
+				}
+				brdf_total += brdf_weight[cell];
+				cosine_total += cosine_weight[cell];
+			}
+		}
+
+		// Mix in a cosine-weighted floor with the same total as the BRDF.
+		double floor = brdf_total > 0.0 ? BRDF_SAMPLER_FLOOR * brdf_total / cosine_total : 1.0;
+		for (int cell = 0; cell < cells; cell++)
+		{
+			brdf_weight[cell] += floor * cosine_weight[cell];
+		}
+
+		for (int i = 0; i < BRDF_SAMPLER_THETA_HALF; i++)
+		{
+			float* cdf = &conditional[(k * BRDF_SAMPLER_THETA_HALF + i) * (BRDF_SAMPLER_PHI_HALF + 1)];
+			row_weight[i] = build_cdf(&brdf_weight[i * BRDF_SAMPLER_PHI_HALF], BRDF_SAMPLER_PHI_HALF, cdf);
+		}
+		build_cdf(row_weight, BRDF_SAMPLER_THETA_HALF, &marginal[k * (BRDF_SAMPLER_THETA_HALF + 1)]);
+	}
+}
+
+double BRDFSampler::sample(const double* wo, double u1, double u2, double* wi) const
+{
+	if (wo[2] <= 0.0)
+	{
+		return 0.0;
+	}
+	int k = view_bin(wo);
+
+	// Pick a theta_half bin, then reuse what is left of u1 within the bin.
+	const float* cdf = &marginal[k * (BRDF_SAMPLER_THETA_HALF + 1)];
+	int i = cdf_search(cdf, BRDF_SAMPLER_THETA_HALF, u1);
+	double p_theta = cdf[i + 1] - cdf[i];
+	if (p_theta <= 0.0)
+	{
+		return 0.0;
+	}
+	u1 = std::min(std::max((u1 - cdf[i]) / p_theta, 0.0), 1.0);
+
+	cdf = &conditional[(k * BRDF_SAMPLER_THETA_HALF + i) * (BRDF_SAMPLER_PHI_HALF + 1)];
+	int j = cdf_search(cdf, BRDF_SAMPLER_PHI_HALF, u2);
+	double p_phi = cdf[j + 1] - cdf[j];
+	if (p_phi <= 0.0)
+	{
+		return 0.0;
+	}
+	u2 = std::min(std::max((u2 - cdf[j]) / p_phi, 0.0), 1.0);
+
+	// Uniform in solid angle within the cell.
+	double cos_theta = cos_theta_half[i] + u1 * (cos_theta_half[i + 1] - cos_theta_half[i]);
+	double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+	double phi = atan2(wo[1], wo[0]) + (j + u2) * PHI_HALF_STEP;
+	double half[3] = { sin_theta * cos(phi), sin_theta * sin(phi), cos_theta };
+
+	double wo_dot_h = wo[0] * half[0] + wo[1] * half[1] + wo[2] * half[2];
+	if (wo_dot_h <= 0.0)
+	{
+		return 0.0;
+	}
+	for (int a = 0; a < 3; a++)
+	{
+		wi[a] = 2.0 * wo_dot_h * half[a] - wo[a];
+	}
+	if (wi[2] <= 0.0)
+	{
+		return 0.0;
+	}
+
+	double area = (cos_theta_half[i] - cos_theta_half[i + 1]) * PHI_HALF_STEP;
+	return p_theta * p_phi / area / (4.0 * wo_dot_h);
+}
+
+double BRDFSampler::pdf(const double* wo, const double* wi) const
+{
+	if (wo[2] <= 0.0 || wi[2] <= 0.0)
+	{
+		return 0.0;
+	}
+	double half[3] = { wo[0] + wi[0], wo[1] + wi[1], wo[2] + wi[2] };
+	normalize(half);
+	double wo_dot_h = wo[0] * half[0] + wo[1] * half[1] + wo[2] * half[2];
+	if (wo_dot_h <= 0.0)
+	{
+		return 0.0;
+	}
+
+	int k = view_bin(wo);
+	int i = theta_half_index(acos(std::min(1.0, half[2])));
+	double phi = atan2(half[1], half[0]) - atan2(wo[1], wo[0]);
+	phi = fmod(phi + 4.0 * PI, 2.0 * PI);
+	int j = std::min((int)(phi / PHI_HALF_STEP), BRDF_SAMPLER_PHI_HALF - 1);
+
+	const float* cdf = &marginal[k * (BRDF_SAMPLER_THETA_HALF + 1)];
+	double p_theta = cdf[i + 1] - cdf[i];
+	cdf = &conditional[(k * BRDF_SAMPLER_THETA_HALF + i) * (BRDF_SAMPLER_PHI_HALF + 1)];
+	double p_phi = cdf[j + 1] - cdf[j];
+
+	double area = (cos_theta_half[i] - cos_theta_half[i + 1]) * PHI_HALF_STEP;
+	return p_theta * p_phi / area / (4.0 * wo_dot_h);
+}
@@ -0,0 +1,43 @@
+#ifndef __BRDFSAMPLER_H__
+#define __BRDFSAMPLER_H__
+
+#include "brdf.h"
+#include <vector>
+
+// Resolution of the sampling tables. The theta_half bins are the MERL
+// table's own (finer towards the specular peak).
+#define BRDF_SAMPLER_THETA_OUT 32
+#define BRDF_SAMPLER_THETA_HALF BRDF_SAMPLING_RES_THETA_H
+#define BRDF_SAMPLER_PHI_HALF 64
+
+// Fraction of a cosine-weighted distribution mixed into every table, so
+// that no direction the tables undersample gets a zero or tiny pdf.
+#define BRDF_SAMPLER_FLOOR 0.01
+
+// Importance sampling for an isotropic measured BRDF.
+//
+// The view direction is binned by elevation. For each bin there is a
+// marginal-conditional CDF over the half vector (theta_half, then phi_half
+// relative to the view azimuth) proportional to the BRDF luminance times
+// cos(theta_in), so sample() picks a half vector with two binary searches
+// and reflects the view direction about it.
+//
+// Directions are in tangent space with z along the normal.
+struct BRDFSampler {
+	// theta_half CDF of each view bin, BRDF_SAMPLER_THETA_HALF + 1 entries.
+	std::vector<float> marginal;
+	// phi_half CDF of each (view bin, theta_half) pair,
+	// BRDF_SAMPLER_PHI_HALF + 1 entries.
+	std::vector<float> conditional;
+	// theta_half bin edges, as cosines.
+	double cos_theta_half[BRDF_SAMPLER_THETA_HALF + 1];
+
+	void build(const BRDF& brdf);
+
+	// Returns the pdf of wi with respect to solid angle, or 0 if no usable
+	// direction was drawn (wi is then undefined).
+	double sample(const double* wo, double u1, double u2, double* wi) const;
+	double pdf(const double* wo, const double* wi) const;
+};
+
+#endif
@@ -25,466 +25,983 @@
 #include "image.h"
 #include "vector3.h"
 #include "matrix3.h"
+#include "brdf.h"
+#include "threadpool.h"
+#include "boundedqueue.h"
+#include "brdfcache.h"
+#include "brdfblend.h"
+#include "gbuffer.h"
+#include "lights.h"
+#include "envmap.h"
+#include "profile.h"
+#include "render.h"
 #include <ctime>
 #include <cmath>
 #include <string>
-
-#define BRDF_SAMPLING_RES_THETA_H       90
-#define BRDF_SAMPLING_RES_THETA_D       90
-#define BRDF_SAMPLING_RES_PHI_D         360
-
-#define RED_SCALE (1.0/1500.0)
-#define GREEN_SCALE (1.15/1500.0)
-#define BLUE_SCALE (1.66/1500.0)
-#define PI	3.1415926535897932384626433832795
-#define THIRD (1.0/3.0)
-
-// cross product of two vectors
-void cross_product (double* v1, double* v2, double* out)
+#include <cstring>
+#include <vector>
+#include <map>
+#include <ctype.h>
+#include <algorithm>
+#include <atomic>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <dirent.h>
+#endif
+
+// Below this many tasks per thread a frame cannot keep the pool busy, so
+// whole frames are rendered in parallel instead.
+#define MIN_TASKS_PER_THREAD 4
+
+// A rendered frame waiting to be written.
+struct Frame {
+	int number;
+	Image* image;
+};
+
+// Adaptive supersampling (--supersample). A frame is first shaded with one
+// sample per pixel. Pixels on the silhouette, and pixels whose luminance
+// differs from a neighbour's by more than the threshold, then get
+// supersample^2 samples in all. The silhouette's extra samples depend only
+// on the camera, so they are traced once. Those for contrast are picked per
+// frame, so they are interpolated from the G-buffer instead of traced, and
+// get the environment term of the pixel's first sample, which varies
+// slowly.
+struct Supersampling {
+	// In output units, out of 255.
+	double threshold;
+	std::vector<char> edge;
+	std::vector<int> edge_pixels;
+	GBuffer edges;
+	EnvironmentTransfer edge_transfer;
+	// The G-buffer sample of each pixel, or -1 where it misses.
+	std::vector<int> sample;
+	// Pixels supersampled over all frames, for the summary.
+	std::atomic<long long> refined;
+};
+
+static void setup_supersampling(Supersampling& ss, const Scene& scene, const GBuffer& gbuffer)
 {
-	out[0] = v1[1]*v2[2] - v1[2]*v2[1];
-	out[1] = v1[2]*v2[0] - v1[0]*v2[2];
-	out[2] = v1[0]*v2[1] - v1[1]*v2[0];
+	gbuffer_edges(gbuffer, ss.edge);
+	for (int p = 0; p < gbuffer.size * gbuffer.size; p++)
+	{
+		if (ss.edge[p])
+			ss.edge_pixels.push_back(p);
+	}
+	ss.edges.build_subsamples(scene.camera, scene.sphere, scene.radius, gbuffer.size, ss.edge_pixels, scene.supersample);
+	ss.sample.assign(gbuffer.size * gbuffer.size, -1);
+	for (int s = 0; s < gbuffer.count; s++)
+	{
+		ss.sample[gbuffer.pixel[s]] = s;
+	}
+	ss.refined = 0;
 }
 
-// normalize vector
-void normalize(double* v)
+// Luminance of each pixel as it will be written, with channels clamped to
+// 255.
+static void output_luminance(Image& image, std::vector<float>& luminance)
 {
-	// normalize
-	double len = sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
-	v[0] = v[0] / len;
-	v[1] = v[1] / len;
-	v[2] = v[2] / len;
+	int width = image.width();
+	int height = image.height();
+	luminance.resize(width * height);
+	for (int y = 0; y < height; y++)
+	{
+		const float* red = image.hdr_row(Image::RED, y);
+		const float* green = image.hdr_row(Image::GREEN, y);
+		const float* blue = image.hdr_row(Image::BLUE, y);
+		for (int x = 0; x < width; x++)
+		{
+			luminance[y * width + x] = 0.299f * std::min(red[x], 255.0f) +
+				0.587f * std::min(green[x], 255.0f) + 0.114f * std::min(blue[x], 255.0f);
+		}
+	}
 }
 
-// rotate vector along one axis
-void rotate_vector(double* vector, double* axis, double angle, double* out)
+// Shade the extra samples of a G-buffer from build_subsamples() into
+// `image`, on the pool if there is one. Task ranges are moved to pixel
+// boundaries so that no two tasks add to the same pixel.
+static void shade_subsamples(ThreadPool* pool, Scene& scene, GBuffer& gbuffer, Image& image)
 {
-	double temp;
-	double cross[3];
-	double cos_ang = cos(angle);
-	double sin_ang = sin(angle);
-
-	out[0] = vector[0] * cos_ang;
-	out[1] = vector[1] * cos_ang;
-	out[2] = vector[2] * cos_ang;
-
-	temp = axis[0]*vector[0]+axis[1]*vector[1]+axis[2]*vector[2];
-	temp = temp*(1.0-cos_ang);
-
-	out[0] += axis[0] * temp;
-	out[1] += axis[1] * temp;
-	out[2] += axis[2] * temp;
-
-	cross_product (axis,vector,cross);
-
-	out[0] += cross[0] * sin_ang;
-	out[1] += cross[1] * sin_ang;
-	out[2] += cross[2] * sin_ang;
+	if (!pool)
+	{
+		shade_samples(scene, gbuffer, image, 0, gbuffer.count, true);
+		return;
+	}
+	auto boundary = [&gbuffer](int i)
+	{
+		while (i > 0 && i < gbuffer.count && gbuffer.pixel[i] == gbuffer.pixel[i - 1])
+		{
+			i++;
+		}
+		return std::min(i, gbuffer.count);
+	};
+	int num_tasks = (gbuffer.count + SAMPLES_PER_TASK - 1) / SAMPLES_PER_TASK;
+	pool->parallel_for(num_tasks, [&](int task)
+	{
+		int begin = boundary(task * SAMPLES_PER_TASK);
+		int end = boundary((task + 1) * SAMPLES_PER_TASK);
+		if (begin < end)
+		{
+			shade_samples(scene, gbuffer, image, begin, end, true);
+		}
+	});
 }
 
-
-// convert standard coordinates to half vector/difference vector coordinates
-void std_coords_to_half_diff_coords(double theta_in, double fi_in, double theta_out, double fi_out,
-								double& theta_half,double& fi_half,double& theta_diff,double& fi_diff )
+// Pick the pixels of a frame to refine and make room in them for the samples
+// to come.
+static void pick_refined_pixels(Supersampling& ss, const Scene& scene, const GBuffer& gbuffer, Image& image,
+	std::vector<int>& contrast)
 {
+	PROFILE_SCOPE(PROFILE_REFINE);
+	int size = gbuffer.size;
+	int samples = scene.supersample * scene.supersample;
+	double share = 1.0 / samples;
+
+	// Pick the pixels to refine before any is changed. Neighbours that miss
+	// make a pixel an edge, so only hit neighbours need comparing.
+	std::vector<float> luminance;
+	output_luminance(image, luminance);
+	for (int s = 0; s < gbuffer.count; s++)
+	{
+		int p = gbuffer.pixel[s];
+		if (ss.edge[p])
+			continue;
+		const float* l = &luminance[p];
+		float largest = std::max(std::max(fabsf(l[-1] - l[0]), fabsf(l[1] - l[0])),
+			std::max(fabsf(l[-size] - l[0]), fabsf(l[size] - l[0])));
+		if (largest > ss.threshold)
+		{
+			contrast.push_back(p);
+		}
+	}
+	ss.refined += (long long)(contrast.size() + ss.edge_pixels.size());
 
-	// compute in vector
-	double in_vec_z = cos(theta_in);
-	double proj_in_vec = sin(theta_in);
-	double in_vec_x = proj_in_vec*cos(fi_in);
-	double in_vec_y = proj_in_vec*sin(fi_in);
-	double in[3]= {in_vec_x,in_vec_y,in_vec_z};
-	normalize(in);
-
-
-	// compute out vector
-	double out_vec_z = cos(theta_out);
-	double proj_out_vec = sin(theta_out);
-	double out_vec_x = proj_out_vec*cos(fi_out);
-	double out_vec_y = proj_out_vec*sin(fi_out);
-	double out[3]= {out_vec_x,out_vec_y,out_vec_z};
-	normalize(out);
-
-
-	// compute halfway vector
-	double half_x = (in_vec_x + out_vec_x)/2.0f;
-	double half_y = (in_vec_y + out_vec_y)/2.0f;
-	double half_z = (in_vec_z + out_vec_z)/2.0f;
-	double half[3] = {half_x,half_y,half_z};
-	normalize(half);
-
-	// compute  theta_half, fi_half
-	theta_half = acos(half[2]);
-	fi_half = atan2(half[1], half[0]);
-
-
-	double bi_normal[3] = {0.0, 1.0, 0.0};
-	double normal[3] = { 0.0, 0.0, 1.0 };
-	double temp[3];
-	double diff[3];
-
-	// compute diff vector
-	rotate_vector(in, normal , -fi_half, temp);
-	rotate_vector(temp, bi_normal, -theta_half, diff);
-
-	// compute  theta_diff, fi_diff
-	theta_diff = acos(diff[2]);
-	fi_diff = atan2(diff[1], diff[0]);
-
+	// The first sample becomes one of many. Contrast pixels keep its
+	// environment term for the samples to come.
+	for (size_t i = 0; i < ss.edge_pixels.size(); i++)
+	{
+		int x = ss.edge_pixels[i] % size, y = ss.edge_pixels[i] / size;
+		image.set_hdr(x, y, image.hdr_row(Image::RED, y)[x] * share,
+			image.hdr_row(Image::GREEN, y)[x] * share, image.hdr_row(Image::BLUE, y)[x] * share);
+	}
+	for (size_t i = 0; i < contrast.size(); i++)
+	{
+		int x = contrast[i] % size, y = contrast[i] / size;
+		double r = 0, g = 0, b = 0;
+		if (scene.environment)
+		{
+			scene.environment_transfer->shade(ss.sample[contrast[i]], scene.environment_sh, r, g, b);
+		}
+		double rest = (samples - 1) * share;
+		image.set_hdr(x, y, image.hdr_row(Image::RED, y)[x] * share + r * rest,
+			image.hdr_row(Image::GREEN, y)[x] * share + g * rest,
+			image.hdr_row(Image::BLUE, y)[x] * share + b * rest);
+	}
 }
 
-
-// Lookup theta_half index
-// This is a non-linear mapping!
-// In:  [0 .. pi/2]
-// Out: [0 .. 89]
-inline int theta_half_index(double theta_half)
+// Supersample a frame that has been shaded one sample per pixel.
+static void refine_frame(ThreadPool* pool, Supersampling& ss, Scene& scene, GBuffer& gbuffer, Image& image)
 {
-	if (theta_half <= 0.0)
-		return 0;
-	double theta_half_deg = ((theta_half / (PI/2.0))*BRDF_SAMPLING_RES_THETA_H);
-	double temp = theta_half_deg*BRDF_SAMPLING_RES_THETA_H;
-	temp = sqrt(temp);
-	int ret_val = (int)temp;
-	if (ret_val < 0) ret_val = 0;
-	if (ret_val >= BRDF_SAMPLING_RES_THETA_H)
-		ret_val = BRDF_SAMPLING_RES_THETA_H-1;
-	return ret_val;
-}
+	std::vector<int> contrast;
+	pick_refined_pixels(ss, scene, gbuffer, image, contrast);
 
+	const EnvironmentTransfer* transfer = scene.environment_transfer;
+	scene.environment_transfer = &ss.edge_transfer;
+	shade_subsamples(pool, scene, ss.edges, image);
 
-// Lookup theta_diff index
-// In:  [0 .. pi/2]
-// Out: [0 .. 89]
-inline int theta_diff_index(double theta_diff)
-{
-	int tmp = int(theta_diff / (PI * 0.5) * BRDF_SAMPLING_RES_THETA_D);
-	if (tmp < 0)
-		return 0;
-	else if (tmp < BRDF_SAMPLING_RES_THETA_D - 1)
-		return tmp;
-	else
-		return BRDF_SAMPLING_RES_THETA_D - 1;
+	GBuffer extra;
+	{
+		PROFILE_SCOPE(PROFILE_REFINE);
+		extra.interpolate_subsamples(gbuffer, ss.sample, contrast, scene.supersample);
+	}
+	scene.environment_transfer = NULL;
+	shade_subsamples(pool, scene, extra, image);
+	scene.environment_transfer = transfer;
 }
 
-
-// Lookup phi_diff index
-inline int phi_diff_index(double phi_diff)
+static bool has_suffix(const std::string& name, const char* suffix)
 {
-	// Because of reciprocity, the BRDF is unchanged under
-	// phi_diff -> phi_diff + PI
-	if (phi_diff < 0.0)
-		phi_diff += PI;
-
-	// In: phi_diff in [0 .. pi]
-	// Out: tmp in [0 .. 179]
-	int tmp = int(phi_diff / PI * BRDF_SAMPLING_RES_PHI_D / 2);
-	if (tmp < 0)	
-		return 0;
-	else if (tmp < BRDF_SAMPLING_RES_PHI_D / 2 - 1)
-		return tmp;
-	else
-		return BRDF_SAMPLING_RES_PHI_D / 2 - 1;
+	size_t length = strlen(suffix);
+	return name.size() >= length && name.compare(name.size() - length, length, suffix) == 0;
 }
 
-
-// Given a pair of incoming/outgoing angles, look up the BRDF.
-int lookup_brdf_val(double* brdf, double theta_in, double fi_in,
-			  double theta_out, double fi_out, 
-			  double& red_val,double& green_val,double& blue_val)
+// Materials for the gallery: the .binary, .fbrdf and .lr files of a directory in
+// name order, or the paths listed one per line in a file.
+static bool list_materials(const char* source, std::vector<std::string>& paths)
 {
-	// Convert to halfangle / difference angle coordinates
-	double theta_half, fi_half, theta_diff, fi_diff;
-	
-	std_coords_to_half_diff_coords(theta_in, fi_in, theta_out, fi_out,
-		       theta_half, fi_half, theta_diff, fi_diff);
-
-
-	// Find index.
-	// Note that phi_half is ignored, since isotropic BRDFs are assumed
-	int ind = phi_diff_index(fi_diff) +
-		  theta_diff_index(theta_diff) * BRDF_SAMPLING_RES_PHI_D / 2 +
-		  theta_half_index(theta_half) * BRDF_SAMPLING_RES_PHI_D / 2 *
-					         BRDF_SAMPLING_RES_THETA_D;
-
-	red_val = brdf[ind] * RED_SCALE;
-	green_val = brdf[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D/2] * GREEN_SCALE;
-	blue_val = brdf[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D] * BLUE_SCALE;
-
-	
-	if (red_val < 0.0 || green_val < 0.0 || blue_val < 0.0)
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(source);
+	if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY))
 	{
-		//fprintf(stderr, "Below horizon.\n");
-		return 0;
+		WIN32_FIND_DATAA entry;
+		HANDLE find = FindFirstFileA((std::string(source) + "\\*").c_str(), &entry);
+		if (find != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				std::string name = entry.cFileName;
+				if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+					(has_suffix(name, ".binary") || has_suffix(name, ".fbrdf") || has_suffix(name, ".lr")))
+				{
+					paths.push_back(std::string(source) + "/" + name);
+				}
+			} while (FindNextFileA(find, &entry));
+			FindClose(find);
+		}
+		std::sort(paths.begin(), paths.end());
+		return true;
 	}
-	return 1;
-}
-// Given a pair of incoming/outgoing angles, look up the BRDF.
-int lookup_aniso_brdf_val(double* brdf1, double* brdf2, double theta_in, double fi_in,
-			  double theta_out, double fi_out, 
-			  double& red_val,double& green_val,double& blue_val)
-{
-	// Convert to halfangle / difference angle coordinates
-	double theta_half, fi_half, theta_diff, fi_diff;
-	
-	std_coords_to_half_diff_coords(theta_in, fi_in, theta_out, fi_out,
-		       theta_half, fi_half, theta_diff, fi_diff);
-
-
-	// Find index.
-	// Note that phi_half is ignored, since isotropic BRDFs are assumed
-	int ind = phi_diff_index(fi_diff) +
-		  theta_diff_index(theta_diff) * BRDF_SAMPLING_RES_PHI_D / 2 +
-		  theta_half_index(theta_half) * BRDF_SAMPLING_RES_PHI_D / 2 *
-					         BRDF_SAMPLING_RES_THETA_D;
-	double mix = 0.5 * (sin(2 * fi_half) + 1.0);
-	double red1 = 0;
-	double red2 = 0;
-	double green1 = 0;
-	double green2 = 0;
-	double blue1 = 0;
-	double blue2 = 0;
-
-	red1 = brdf1[ind] * RED_SCALE;
-	green1 = brdf1[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D/2] * GREEN_SCALE;
-	blue1 = brdf1[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D] * BLUE_SCALE;
-
-	if (red1 < 0.0 || green1 < 0.0 || blue1 < 0.0)
+#else
+	DIR* dir = opendir(source);
+	if (dir)
 	{
-		//fprintf(stderr, "Below horizon.\n");
-		return 0;
+		while (dirent* entry = readdir(dir))
+		{
+			std::string name = entry->d_name;
+			if (has_suffix(name, ".binary") || has_suffix(name, ".fbrdf") || has_suffix(name, ".lr"))
+			{
+				paths.push_back(std::string(source) + "/" + name);
+			}
+		}
+		closedir(dir);
+		std::sort(paths.begin(), paths.end());
+		return true;
 	}
+#endif
 
-	red2 = brdf2[ind] * RED_SCALE;
-	green2 = brdf2[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D/2] * GREEN_SCALE;
-	blue2 = brdf2[ind + BRDF_SAMPLING_RES_THETA_H*BRDF_SAMPLING_RES_THETA_D*BRDF_SAMPLING_RES_PHI_D] * BLUE_SCALE;
-
-	if (red2 < 0.0 || green2 < 0.0 || blue2 < 0.0)
+	FILE* file = fopen(source, "r");
+	if (!file)
 	{
-		//fprintf(stderr, "Below horizon.\n");
-		return 0;
-	}
-
-	red_val = mix * red1 + (1 - mix) * red2;
-	green_val = mix * green1 + (1 - mix) * green2;
-	blue_val = mix * blue1 + (1 - mix) * blue2;
-	
-	return 1;
-}
-
-
-
-// Read BRDF data
-bool read_brdf(const char *filename, double* &brdf)
-{
-	FILE *f = fopen(filename, "rb");
-	if (!f)
 		return false;
-
-	int dims[3];
-	fread(dims, sizeof(int), 3, f);
-	int n = dims[0] * dims[1] * dims[2];
-	if (n != BRDF_SAMPLING_RES_THETA_H *
-		 BRDF_SAMPLING_RES_THETA_D *
-		 BRDF_SAMPLING_RES_PHI_D / 2) 
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
 	{
-		fprintf(stderr, "Dimensions don't match\n");
-		fclose(f);
-		return false;
+		size_t length = strlen(line);
+		while (length > 0 && isspace((unsigned char)line[length - 1]))
+		{
+			line[--length] = '\0';
+		}
+		if (length > 0 && line[0] != '#')
+		{
+			paths.push_back(line);
+		}
 	}
-
-	brdf = (double*) malloc (sizeof(double)*3*n);
-	fread(brdf, sizeof(double), 3*n, f);
-
-	fclose(f);
+	fclose(file);
 	return true;
 }
 
-int ray_sphere_intersection(Vector3 center, double radius, Vector3 origin, Vector3 direction, Vector3& intersection, double& distance)
+// Render every material in `paths` as one tile of a contact sheet, lit like
+// the first frame of the animation. Materials come from `cache`, with the
+// next `preload` prefetched while the current one is shaded so reading
+// overlaps with shading; a path listed twice is only read again if it was
+// evicted in between. Returns the number of materials that failed to load;
+// their tiles are left black. An output of "-" writes the sheet to stdout
+// as a .bmp, with progress on stderr.
+static int render_gallery(Scene& scene, GBuffer& gbuffer, ThreadPool& pool,
+	const std::vector<Light>& lights, const std::vector<std::string>& paths,
+	int columns, int preload, BRDFCache& cache, const char* outfilename)
 {
-	Vector3 difference = center - origin;
-	// The distance along the ray, from the origin, to a line perpendicular to `difference` that goes through the center of the sphere.
-	double d2pl = difference.dot_product(direction);
-
-	// If this is negative the intersection is behind the origin and is of no interest.
-	if (d2pl < 0)
+	bool stream = strcmp(outfilename, "-") == 0;
+	FILE* progress = stream ? stderr : stdout;
+#ifdef _WIN32
+	if (stream)
 	{
-		return 0;
+		_setmode(_fileno(stdout), _O_BINARY);
 	}
+#endif
 
-	// This is the squared length along the perpendicular line to the intersetion with the ray.
-	double length = difference.dot_product(difference) - d2pl * d2pl;
-
-	double radius_square = radius * radius;
-
-	// If this is a greater distance than the radius squared it does not intersect with the sphere.
-	if (length > radius_square)
+	int count = (int)paths.size();
+	if (columns < 1)
 	{
-		return 0;
+		columns = (int)ceil(sqrt((double)count));
 	}
+	int rows = (count + columns - 1) / columns;
+	int size = gbuffer.size;
+	Image atlas(columns * size, rows * size);
+	Image tile(size);
+
+	animate_lights(scene, lights, 0, 1);
+	BRDFBlend blend;
+	blend.allocate(gbuffer.size * gbuffer.size);
+	blend.add_layer(NULL, BLEND_AZIMUTH_NONE, std::vector<float>(gbuffer.size * gbuffer.size, 1.0f));
+	scene.blend = &blend;
+	BRDFTransfer transfer;
+	EnvironmentTransfer environment_transfer;
+	scene.environment_transfer = &environment_transfer;
+
+	int failed = 0;
+	for (int i = 0; i < count; i++)
+	{
+		for (int next = i + 1; next <= i + preload && next < count; next++)
+		{
+			cache.prefetch(paths[next]);
+		}
 
-	// This is the offset from `d2pl` along the ray where the insection(s) occur
-	// Found the same way as `length` using pythagorean theorem
-	double offset = sqrt(radius_square - length);
+		const char* path = paths[i].c_str();
+		fprintf(progress, "Rendering material %03i/%03i: %s\n", i + 1, count, path);
+		fflush(progress);
+		BRDFCache::Handle brdf = cache.get(paths[i]);
+		if (!brdf)
+		{
+			fprintf(stderr, "Error reading %s\n", path);
+			failed++;
+			continue;
+		}
 
-	// I am only interested in the closer of the two intersections.
-	distance = d2pl - offset;
+		blend.brdf[0] = brdf.get();
+		if (scene.environment)
+		{
+			transfer.allocate();
+			pool.parallel_for(TRANSFER_THETA_OUT, [&](int bin)
+			{
+				transfer.build(*brdf, bin, bin + 1);
+			});
+			environment_transfer.allocate(gbuffer);
+			int num_tasks = (gbuffer.count + SAMPLES_PER_TASK - 1) / SAMPLES_PER_TASK;
+			pool.parallel_for(num_tasks, [&](int task)
+			{
+				int begin = task * SAMPLES_PER_TASK;
+				environment_transfer.build(gbuffer, transfer, transfer, begin,
+					std::min(begin + SAMPLES_PER_TASK, gbuffer.count));
+			});
+		}
+		render_frame(pool, scene, gbuffer, tile);
 
-	intersection = origin + (direction * distance);
-	return 1;
+		int x0 = (i % columns) * size;
+		int y0 = (i / columns) * size;
+		for (int y = 0; y < size; y++)
+		{
+			for (int channel = Image::RED; channel <= Image::BLUE; channel++)
+			{
+				memcpy(atlas.hdr_row((Image::Channel)channel, y0 + y) + x0,
+					tile.hdr_row((Image::Channel)channel, y), size * sizeof(float));
+			}
+		}
+	}
+	scene.blend = NULL;
+	fprintf(progress, "Material cache: %i hits, %i misses, %i evictions, %.1f MB held\n",
+		cache.hits(), cache.misses(), cache.evictions(), cache.bytes() / (1024.0 * 1024.0));
+
+	atlas.resolve();
+	bool saved;
+	if (stream)
+	{
+		saved = atlas.write_bmp(fileno(stdout));
+	}
+	else
+	{
+		std::string filename = std::string(outfilename) + ".bmp";
+		saved = atlas.save(filename.c_str());
+	}
+	if (!saved)
+	{
+		fprintf(stderr, "Error writing the contact sheet\n");
+		exit(1);
+	}
+	fprintf(progress, "Done.\n");
+	return failed;
 }
 
-int normal_tangent(Vector3 normal, Vector3& tangent, Vector3& bitangent)
+#ifdef EBRDF_PROFILE
+// Print the stage timings and write the trace, if one was asked for.
+static void report_profile(FILE* file, const char* tracefilename)
 {
-	double angle = atan2(normal.x, normal.z) - PI / 2;
-	tangent = Vector3(
-			sin(angle),
-			0,
-			cos(angle)
-		);
-	bitangent = normal.cross_product(tangent);
-	//fprintf(stdout, "Normal(%f, %f, %f)\tTangent(%f, %f, %f)\tBiTangent(%f, %f, %f)\n", normal.x, normal.y, normal.z, tangent.x, tangent.y, tangent.z, bitangent.x, bitangent.y, bitangent.z);
-	return 0;
+	profile_report(file);
+	if (tracefilename && !profile_write_trace(tracefilename))
+	{
+		fprintf(stderr, "Error writing %s\n", tracefilename);
+		exit(1);
+	}
 }
-
-#define NUM_LIGHTS 1
+#endif
 
 int main(int argc, char *argv[])
 {
 	int img_size;
-	int anim_time;
-	int fps;
-	char *infilename1;
-	char *infilename2;
+	int anim_time = 0;
+	int fps = 0;
+	int threads = 0;
+	int frames_in_flight = 4;
+	int light_samples = 0;
+	char *lightsfilename = NULL;
+	char *environmentfilename = NULL;
+	double environment_scale = 1.0;
+	char *gallerysource = NULL;
+	int gallery_columns = 0;
+	int gallery_preload = 2;
+	int cache_budget = 256;
+	BRDFLayout layout = BRDF_LAYOUT_INTERLEAVED;
+	bool layout_given = false;
+	bool interpolate = false;
+	bool preview = false;
+	int supersample = 1;
+	double supersample_threshold = 8.0;
+	std::vector<std::pair<char*, char*> > layer_args;
+	char *tracefilename = NULL;
+	char *infilename1 = NULL;
+	char *infilename2 = NULL;
 	char *outfilename;
 	try
 	{
-		if (argc < 7)
+		std::vector<char*> args;
+		for (int i = 1; i < argc; i++)
+		{
+			if (strcmp(argv[i], "--threads") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				threads = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--frames-in-flight") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				frames_in_flight = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--lights") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				lightsfilename = argv[i];
+			}
+			else if (strcmp(argv[i], "--light-samples") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				light_samples = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--environment") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				environmentfilename = argv[i];
+			}
+			else if (strcmp(argv[i], "--environment-scale") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				environment_scale = atof(argv[i]);
+			}
+			else if (strcmp(argv[i], "--gallery") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				gallerysource = argv[i];
+			}
+			else if (strcmp(argv[i], "--columns") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				gallery_columns = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--preload") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				gallery_preload = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--cache-budget") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				cache_budget = atoi(argv[i]);
+			}
+			else if (strcmp(argv[i], "--layout") == 0)
+			{
+				if (++i >= argc || !parse_brdf_layout(argv[i], layout))
+				{
+					throw std::exception();
+				}
+				layout_given = true;
+			}
+			else if (strcmp(argv[i], "--interpolate") == 0)
+			{
+				interpolate = true;
+			}
+			else if (strcmp(argv[i], "--preview") == 0)
+			{
+				preview = true;
+			}
+			else if (strcmp(argv[i], "--supersample") == 0)
+			{
+				if (++i >= argc || (supersample = atoi(argv[i])) < 1 || supersample > 8)
+				{
+					throw std::exception();
+				}
+			}
+			else if (strcmp(argv[i], "--supersample-threshold") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				supersample_threshold = atof(argv[i]);
+			}
+			else if (strcmp(argv[i], "--layer") == 0)
+			{
+				if (i + 2 >= argc)
+				{
+					throw std::exception();
+				}
+				layer_args.push_back(std::make_pair(argv[i + 1], argv[i + 2]));
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--profile-trace") == 0)
+			{
+				if (++i >= argc)
+				{
+					throw std::exception();
+				}
+				tracefilename = argv[i];
+			}
+			else
+			{
+				args.push_back(argv[i]);
+			}
+		}
+		if (gallerysource)
+		{
+			// The gallery shades one table at a time.
+			if (args.size() < 2 || preview || !layer_args.empty() || supersample > 1)
+			{
+				throw std::exception();
+			}
+			img_size = atoi(args[0]);
+			outfilename = args[1];
+		}
+		else
 		{
-			throw std::exception();
+			// Layers are tables, and the environment transfer only knows
+			// the anisotropic pair.
+			if (args.size() < 6 || (!layer_args.empty() && (preview || environmentfilename ||
+				layer_args.size() + 2 > BLEND_MAX_LAYERS)))
+			{
+				throw std::exception();
+			}
+			img_size = atoi(args[0]);
+			anim_time = atoi(args[1]);
+			fps = atoi(args[2]);
+			infilename1 = args[3];
+			infilename2 = args[4];
+			outfilename = args[5];
 		}
-		img_size = atoi(argv[1]);
-		anim_time = atoi(argv[2]);
-		fps = atoi(argv[3]);
-		infilename1 = argv[4];
-		infilename2 = argv[5];
-		outfilename = argv[6];
 	}
 	catch (std::exception const& e)
 	{
-		fprintf(stdout, "USAGE: size, time, fps, brdf, output\n"
+		fprintf(stdout, "USAGE: [--threads n] [--frames-in-flight n] [--layout name] [--interpolate] [--preview] [--layer brdf weights]... [--supersample n] [--supersample-threshold t] [--lights file] [--light-samples n] [--environment file] [--environment-scale s] [--profile-trace file] size, time, fps, brdf, output\n"
 			"\tsize:\tThe width and height of the output images.\n"
 			"\ttime:\tThe duration of the animation.\n"
 			"\tfps:\tFrames per second of the animation.\n"
 			"\tbrdf:\tFilename of the brdf to use.\n"
 			"\tbrdf:\tFilename of the brdf to use.\n"
-			"\toutput:\tBase filename for the output (excluding extension).\n");
+			"\toutput:\tBase filename for the output (excluding extension), or - to\n"
+			"\t\twrite raw bgr24 frames to stdout.\n"
+			"\t--threads:\tNumber of render threads (default: all cores).\n"
+			"\t--frames-in-flight:\tRendered frames that may wait to be written (default: 4).\n"
+			"\t--layout:\tBRDF table layout: planar, interleaved or tiled (default: interleaved,\n"
+			"\t\tor tiled with --interpolate). Low-rank brdfs from brdf_compress stay\n"
+			"\t\tcompressed with planar and are expanded by the others.\n"
+			"\t--interpolate:\tBlend neighbouring table entries instead of taking the nearest.\n"
+			"\t--preview:\tThe brdfs are .fit files written by BRDFFit; shade their analytic\n"
+			"\t\tlobes instead of the tables.\n"
+			"\t--layer:\tBlend in another brdf, weighted per pixel by a number, \"checker:n\",\n"
+			"\t\t\"stripes:n\", \"ramp\" or a .pgm mapped over the sphere. The two brdfs\n"
+			"\t\tabove fill what weight the layers leave. Not with --preview or --environment.\n"
+			"\t--supersample:\tSupersample the silhouette, and pixels that differ from a neighbour,\n"
+			"\t\twith n x n samples (default: 1, off).\n"
+			"\t--supersample-threshold:\tLuminance difference, out of 255, that supersamples\n"
+			"\t\ta pixel (default: 8).\n"
+			"\t--lights:\tLight list, one \"x y z red green blue\" per line (default: one white light).\n"
+			"\t--light-samples:\tLights sampled per pixel from a light tree, or 0 to evaluate\n"
+			"\t\tevery light (default: 0).\n"
+			"\t--environment:\tEquirectangular Radiance .hdr to light the sphere with, in place\n"
+			"\t\tof the default light.\n"
+			"\t--environment-scale:\tMultiplier for the environment radiance (default: 1).\n"
+			"\t--profile-trace:\tWrite the stage timings as Chrome trace events to this file.\n"
+			"\t\tNeeds a build with EBRDF_PROFILE defined, which also prints a breakdown.\n"
+			"\n"
+			"       --gallery source [--columns n] [--preload n] [--cache-budget MB] [options] size, output\n"
+			"\tRender every material in a directory of .binary/.fbrdf/.lr files, or listed one\n"
+			"\tper line in a file, as tiles of one contact sheet written to output.bmp, or\n"
+			"\tto stdout as a .bmp if output is \"-\".\n"
+			"\t--columns:\tTiles per row (default: square).\n"
+			"\t--preload:\tMaterials read ahead of the renderer (default: 2).\n"
+			"\t--cache-budget:\tMegabytes of materials kept loaded once unused (default: 256).\n");
 		exit(1);
 	}
-	double* brdf1;
-	double* brdf2;
-
-	// read brdf
-	if (!read_brdf(infilename1, brdf1))
+#ifndef EBRDF_PROFILE
+	if (tracefilename)
 	{
-		fprintf(stderr, "Error reading %s\n", infilename1);
+		fprintf(stderr, "--profile-trace needs a build with EBRDF_PROFILE defined\n");
 		exit(1);
 	}
-	if (!read_brdf(infilename2, brdf2))
+#endif
+	// Interpolated lookups touch eight neighbouring entries, which the
+	// tiled layout keeps close together.
+	if (interpolate && !layout_given)
 	{
-		fprintf(stderr, "Error reading %s\n", infilename2);
-		exit(1);
+		layout = BRDF_LAYOUT_TILED;
 	}
 
-	Vector3 camera = Vector3(0,0,-2.5);
-	Vector3 lightPositions[] = {
-		Vector3(5, 5, -5),
-		Vector3(-5, -5, 5)
-	};
-	Vector3 lightColors[] = {
-		Vector3(25, 25, 25) * 255,
-		Vector3(10, 10, 15) * 255
-	};
-	Vector3 sphere = Vector3(0);
-	double radius = 1;
+	// Light colors are given in the same units as the default light and
+	// scaled to the 8-bit output range.
+	std::vector<Light> lights;
+	if (lightsfilename)
+	{
+		if (!read_lights(lightsfilename, lights))
+		{
+			fprintf(stderr, "Error reading %s\n", lightsfilename);
+			exit(1);
+		}
+	}
+	else if (!environmentfilename)
+	{
+		Light light;
+		light.position = Vector3(0, 5, -2.5);
+		light.color = Vector3(25, 25, 25);
+		lights.push_back(light);
+	}
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		lights[i].color *= 255;
+	}
 
-	int num_images = anim_time * fps;
+	Scene scene;
+	scene.blend = NULL;
+	scene.interpolate = interpolate;
+	scene.preview1 = NULL;
+	scene.preview2 = NULL;
+	scene.camera = Vector3(0,0,-2.5);
+	scene.light_samples = light_samples;
+	scene.environment = NULL;
+	scene.environment_transfer = NULL;
+	scene.environment_scale = environment_scale * 255;
+	scene.supersample = supersample;
+	scene.sphere = Vector3(0);
+	scene.radius = 1;
+	scene.img_size = img_size;
+
+	ThreadPool pool(threads);
+
+	// The camera and sphere never move, so the view-dependent geometry is
+	// computed once for the whole animation.
+	GBuffer gbuffer;
+	Supersampling ss;
+	ss.threshold = supersample_threshold;
+	{
+		PROFILE_SCOPE(PROFILE_GBUFFER);
+		gbuffer.build(scene.camera, scene.sphere, scene.radius, img_size);
+		if (supersample > 1)
+		{
+			setup_supersampling(ss, scene, gbuffer);
+		}
+	}
+	int num_tasks = (gbuffer.count + SAMPLES_PER_TASK - 1) / SAMPLES_PER_TASK;
 
-	for (int image_number = 0; image_number < num_images; image_number++) {
-		fprintf(stdout, "\rProcessing image %03i/%03i...", (image_number + 1), num_images);
-		fflush(stdout);
-		double percent = (double)image_number / num_images;
-		double angle = percent * 2 * PI;
-		
-		lightPositions[0] = Vector3(sin(angle), cos(angle), -0.5) * 5;
+	Environment environment;
+	if (environmentfilename)
+	{
+		PROFILE_SCOPE(PROFILE_SETUP);
+		if (!read_environment(environmentfilename, environment))
+		{
+			fprintf(stderr, "Error reading %s\n", environmentfilename);
+			exit(1);
+		}
+		scene.environment = &environment;
+	}
 
-		//lightColors[0] = Vector3(25, 25, 25) * percent * 255.0;
-		//lightColors[1] = Vector3(10, 10, 15) * percent * 255.0;
+	if (gallerysource)
+	{
+		std::vector<std::string> paths;
+		if (!list_materials(gallerysource, paths) || paths.empty())
+		{
+			fprintf(stderr, "No materials found in %s\n", gallerysource);
+			exit(1);
+		}
+		BRDFCache cache((size_t)std::max(cache_budget, 0) << 20, layout);
+		int failed = render_gallery(scene, gbuffer, pool, lights, paths,
+			gallery_columns, gallery_preload, cache, outfilename);
+#ifdef EBRDF_PROFILE
+		report_profile(stdout, tracefilename);
+#endif
+		return failed > 0 ? 1 : 0;
+	}
 
-		Image image = Image(img_size);
+	BRDF brdf1;
+	BRDF brdf2;
+	AnalyticBRDF preview1;
+	AnalyticBRDF preview2;
+	if (preview)
+	{
+		if (!read_analytic_brdf(infilename1, preview1))
+		{
+			fprintf(stderr, "Error reading %s\n", infilename1);
+			exit(1);
+		}
+		if (!read_analytic_brdf(infilename2, preview2))
+		{
+			fprintf(stderr, "Error reading %s\n", infilename2);
+			exit(1);
+		}
+		scene.preview1 = &preview1;
+		scene.preview2 = &preview2;
+	}
+	else
+	{
+		PROFILE_SCOPE(PROFILE_SETUP);
+		// read brdf
+		if (!read_brdf(infilename1, brdf1, layout))
+		{
+			fprintf(stderr, "Error reading %s\n", infilename1);
+			exit(1);
+		}
+		if (!read_brdf(infilename2, brdf2, layout))
+		{
+			fprintf(stderr, "Error reading %s\n", infilename2);
+			exit(1);
+		}
+	}
 
-		for (int x = 0; x < img_size; x++)
+	// The anisotropic pair, mixed by half-vector azimuth, takes whatever
+	// weight the extra layers leave; layers that ask for more than all of
+	// it are scaled down to share it.
+	BRDFBlend blend;
+	std::vector<BRDF> layer_brdfs(layer_args.size());
+	if (!preview)
+	{
+		PROFILE_SCOPE(PROFILE_SETUP);
+		std::vector<std::vector<float> > layer_weights(layer_args.size());
+		int pixels = gbuffer.size * gbuffer.size;
+		std::vector<float> base_weights(pixels, 1.0f);
+		for (size_t l = 0; l < layer_args.size(); l++)
 		{
-			for (int y = 0; y < img_size; y++)
+			if (!read_brdf(layer_args[l].first, layer_brdfs[l], layout))
+			{
+				fprintf(stderr, "Error reading %s\n", layer_args[l].first);
+				exit(1);
+			}
+			if (!blend_weights(layer_args[l].second, gbuffer, layer_weights[l]))
 			{
-				double xDir = (2*((double)x / (double)img_size) - 1) * (radius * 1.25);
-				double yDir = (-2*((double)y / (double)img_size) + 1) * (radius * 1.25);
-				Vector3 viewDir = Vector3(xDir, yDir, 0) - camera;
-				viewDir.normalize();
-				Vector3 intersection = Vector3(0);
-				double distance = 0;
-				if (ray_sphere_intersection(sphere, radius, camera, viewDir, intersection, distance))
+				fprintf(stderr, "Error reading weights %s\n", layer_args[l].second);
+				exit(1);
+			}
+		}
+		for (int p = 0; p < pixels; p++)
+		{
+			double total = 0.0;
+			for (size_t l = 0; l < layer_weights.size(); l++)
+			{
+				layer_weights[l][p] = std::max(layer_weights[l][p], 0.0f);
+				total += layer_weights[l][p];
+			}
+			if (total > 1.0)
+			{
+				for (size_t l = 0; l < layer_weights.size(); l++)
 				{
-					Vector3 surface = (intersection - sphere) / radius;
-					double red = 0;
-					double green = 0;
-					double blue = 0;
-					Vector3 normal = surface.normal();
-					Vector3 toView = -viewDir;
-					for (int light_index = 0; light_index < NUM_LIGHTS; light_index++) {
-						Vector3 toLight = (lightPositions[light_index] - intersection).normal();
-
-						// Only process points that face the light
-						if (!normal.dot_product(toLight) <= 0)
-						{
-							double theta_out = normal.angle_between(toView);
-							double theta_in = normal.angle_between(toLight);
-
-							Vector3 tangent;
-							Vector3 bitangent;
-							normal_tangent(normal, tangent, bitangent);
-
-							Matrix3 worldToTangent = Matrix3(tangent, normal, bitangent).inverse();
-
-							Vector3 out = worldToTangent * toView;
-							Vector3 in = worldToTangent * toLight;
-
-							double phi_out = atan2(out.z, out.x);
-
-							double phi_in = atan2(in.z, in.x);
-
-							lookup_aniso_brdf_val(brdf1, brdf2,
-								theta_in, phi_in,
-								theta_out, phi_out,
-								red, green, blue);
-
-							red *= lightColors[light_index].x;
-							green *= lightColors[light_index].y;
-							blue *= lightColors[light_index].z;
-						}
-					}
-
-					image.set(x, y, Pixel(red, green, blue));
+					layer_weights[l][p] = (float)(layer_weights[l][p] / total);
 				}
+				total = 1.0;
 			}
+			base_weights[p] = (float)(1.0 - total);
+		}
+
+		blend.allocate(pixels);
+		blend.add_layer(&brdf1, BLEND_AZIMUTH_SIN, base_weights);
+		blend.add_layer(&brdf2, BLEND_AZIMUTH_COMPLEMENT, base_weights);
+		for (size_t l = 0; l < layer_args.size(); l++)
+		{
+			blend.add_layer(&layer_brdfs[l], BLEND_AZIMUTH_NONE, layer_weights[l]);
 		}
+		scene.blend = &blend;
+	}
+
+	// Environment lighting is precomputed as spherical harmonic transfer
+	// vectors, so each frame costs a dot product per sample.
+	EnvironmentTransfer environment_transfer;
+	if (scene.environment)
+	{
+		PROFILE_SCOPE(PROFILE_SETUP);
+		BRDFTransfer transfer1;
+		BRDFTransfer transfer2;
+		if (preview)
+		{
+			transfer1.build(preview1);
+			transfer2.build(preview2);
+		}
+		else
+		{
+			transfer1.build(brdf1);
+			transfer2.build(brdf2);
+		}
+		environment_transfer.build(gbuffer, transfer1, transfer2);
+		scene.environment_transfer = &environment_transfer;
+		if (supersample > 1)
+		{
+			ss.edge_transfer.build(ss.edges, transfer1, transfer2);
+		}
+	}
 
-		char* filename = new char[50];
-		sprintf(filename, "%s%04i.bmp", outfilename, image_number);
-		image.save(filename);
-		delete filename;
+	int num_images = anim_time * fps;
+
+	// An output of "-" streams raw BGR frames to stdout (for ffmpeg's
+	// rawvideo input), so progress goes to stderr instead.
+	bool stream = strcmp(outfilename, "-") == 0;
+	FILE* progress = stream ? stderr : stdout;
+#ifdef _WIN32
+	if (stream)
+	{
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+
+	// Rendered frames are handed to a writer thread so that saving overlaps
+	// with rendering. The queue bounds the number of finished frames held in
+	// memory; a full queue stalls the renderers until the writer catches up.
+	// A raw stream is written in sequence, so there a frame is only handed
+	// over once it is within frames_in_flight of the next one to write, or
+	// frames finished ahead of a slow one would collect in the writer.
+	BoundedQueue<Frame> finished(frames_in_flight);
+	SequenceWindow window(frames_in_flight);
+	std::thread writer([&]
+	{
+		Frame frame;
+		int written = 0;
+		// Frames can finish out of order. Files are written as they arrive,
+		// but a raw stream has to wait for the next frame in sequence.
+		std::map<int, Image*> pending;
+		while (finished.pop(frame))
+		{
+			{
+				PROFILE_FRAME(frame.number);
+				PROFILE_SCOPE(PROFILE_RESOLVE);
+				frame.image->resolve();
+			}
+			pending[frame.number] = frame.image;
+			std::map<int, Image*>::iterator next = pending.begin();
+			while (next != pending.end() && (!stream || next->first == written))
+			{
+				bool saved;
+				PROFILE_FRAME(next->first);
+				if (stream)
+				{
+					saved = next->second->write_raw(fileno(stdout));
+				}
+				else
+				{
+					char filename[1024];
+					snprintf(filename, sizeof(filename), "%s%04i.bmp", outfilename, next->first);
+					saved = next->second->save(filename);
+				}
+				if (!saved)
+				{
+					fprintf(stderr, "Error writing image %04i\n", next->first);
+					exit(1);
+				}
+				delete next->second;
+				next = pending.erase(next);
+				if (stream)
+				{
+					window.advance();
+				}
+				fprintf(progress, "\rProcessing image %03i/%03i...", ++written, num_images);
+				fflush(progress);
+			}
+		}
+	});
+
+	if (num_tasks < pool.size() * MIN_TASKS_PER_THREAD)
+	{
+		// Small frames: each thread renders whole frames, taking them in
+		// order so that the next frame to write is never the one held back
+		// by the stream's window.
+		std::atomic<int> next_image(0);
+		pool.parallel_for(pool.size(), [&](int)
+		{
+			for (int image_number = next_image++; image_number < num_images; image_number = next_image++)
+			{
+				Scene frame_scene = scene;
+				animate_lights(frame_scene, lights, image_number, num_images);
+
+				Image* image = new Image(img_size);
+				shade_samples(frame_scene, gbuffer, *image, 0, gbuffer.count);
+				if (supersample > 1)
+				{
+					refine_frame(NULL, ss, frame_scene, gbuffer, *image);
+				}
+
+				if (stream)
+				{
+					window.wait(image_number);
+				}
+				Frame frame = { image_number, image };
+				finished.push(frame);
+			}
+		});
+	}
+	else
+	{
+		// Large frames: render one frame at a time, split into sample ranges.
+		for (int image_number = 0; image_number < num_images; image_number++)
+		{
+			animate_lights(scene, lights, image_number, num_images);
+
+			Image* image = new Image(img_size);
+			render_frame(pool, scene, gbuffer, *image);
+			if (supersample > 1)
+			{
+				refine_frame(&pool, ss, scene, gbuffer, *image);
+			}
+
+			Frame frame = { image_number, image };
+			finished.push(frame);
+		}
+	}
+
+	finished.close();
+	writer.join();
+	if (!preview)
+	{
+		free_brdf(brdf1);
+		free_brdf(brdf2);
+		for (size_t l = 0; l < layer_brdfs.size(); l++)
+		{
+			free_brdf(layer_brdfs[l]);
+		}
+	}
+	fprintf(progress, " Done.\n");
+	if (supersample > 1 && num_images > 0)
+	{
+		fprintf(progress, "Supersampled %.1f%% of the sphere's pixels per frame\n",
+			100.0 * ss.refined / ((double)num_images * gbuffer.count));
 	}
-	fprintf(stdout, " Done.\n");
+#ifdef EBRDF_PROFILE
+	report_profile(progress, tracefilename);
+#endif
 	return 0;
 }
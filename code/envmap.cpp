@@ -0,0 +1,313 @@
+#include "envmap.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+// Resolution of the quadrature over wi used to project a BRDF.
+#define TRANSFER_THETA_IN 64
+#define TRANSFER_PHI_IN 128
+
+// Read one RGBE scanline, flat or new-style run-length encoded.
+static bool read_rgbe_scanline(FILE* file, int width, unsigned char* scanline)
+{
+	unsigned char start[4];
+	if (fread(start, 1, 4, file) != 4)
+		return false;
+
+	bool encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 &&
+		((start[2] << 8) | start[3]) == width;
+	if (!encoded)
+	{
+		memcpy(scanline, start, 4);
+		return fread(scanline + 4, 4, width - 1, file) == (size_t)(width - 1);
+	}
+
+	// Each channel is encoded separately as runs and literals.
+	for (int channel = 0; channel < 4; channel++)
+	{
+		int x = 0;
+		while (x < width)
+		{
+			int count = fgetc(file);
+			if (count == EOF)
+				return false;
+			if (count > 128)
+			{
+				count -= 128;
+				int value = fgetc(file);
+				if (value == EOF || x + count > width)
+					return false;
+				for (int i = 0; i < count; i++)
+				{
+					scanline[4 * (x++) + channel] = (unsigned char)value;
+				}
+			}
+			else
+			{
+				if (count == 0 || x + count > width)
+					return false;
+				for (int i = 0; i < count; i++)
+				{
+					int value = fgetc(file);
+					if (value == EOF)
+						return false;
+					scanline[4 * (x++) + channel] = (unsigned char)value;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+bool read_environment(const char* filename, Environment& environment)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return false;
+
+	// Header lines up to a blank line, then the resolution.
+	char line[1024];
+	bool ok = fgets(line, sizeof(line), file) && strncmp(line, "#?", 2) == 0;
+	while (ok)
+	{
+		if (!fgets(line, sizeof(line), file))
+		{
+			ok = false;
+		}
+		else if (line[0] == '\n' || line[0] == '\r')
+		{
+			break;
+		}
+		else if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+		{
+			ok = false;
+		}
+	}
+	int width = 0, height = 0;
+	if (!ok || !fgets(line, sizeof(line), file) ||
+		sscanf(line, "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0)
+	{
+		fclose(file);
+		return false;
+	}
+
+	// Project each texel, weighted by its solid angle.
+	memset(environment.sh, 0, sizeof(environment.sh));
+	std::vector<unsigned char> scanline(4 * width);
+	std::vector<double> sin_phi(width), cos_phi(width);
+	for (int x = 0; x < width; x++)
+	{
+		double phi = 2.0 * PI * (x + 0.5) / width - PI;
+		sin_phi[x] = sin(phi);
+		cos_phi[x] = cos(phi);
+	}
+	for (int y = 0; y < height && ok; y++)
+	{
+		if (!read_rgbe_scanline(file, width, &scanline[0]))
+		{
+			ok = false;
+			break;
+		}
+		double theta = PI * (y + 0.5) / height;
+		double weight = sin(theta) * (PI / height) * (2.0 * PI / width);
+		for (int x = 0; x < width; x++)
+		{
+			const unsigned char* rgbe = &scanline[4 * x];
+			if (rgbe[3] == 0)
+				continue;
+			double scale = ldexp(1.0, rgbe[3] - (128 + 8)) * weight;
+			double dir[3] = { sin(theta) * sin_phi[x], cos(theta), sin(theta) * cos_phi[x] };
+			double basis[SH_COEFFS];
+			sh_eval(dir, basis);
+			for (int channel = 0; channel < 3; channel++)
+			{
+				double radiance = (rgbe[channel] + 0.5) * scale;
+				for (int i = 0; i < SH_COEFFS; i++)
+				{
+					environment.sh[channel * SH_COEFFS + i] += radiance * basis[i];
+				}
+			}
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+// Quadrature directions over wi and their basis values, shared by every
+// material and view bin.
+struct TransferQuadrature {
+	std::vector<double> wi;
+	std::vector<double> weight;
+	std::vector<double> basis;
+
+	TransferQuadrature()
+	{
+		const int directions = TRANSFER_THETA_IN * TRANSFER_PHI_IN;
+		wi.resize(3 * directions);
+		weight.resize(directions);
+		basis.resize(directions * SH_COEFFS);
+		for (int i = 0; i < TRANSFER_THETA_IN; i++)
+		{
+			double theta = (i + 0.5) / TRANSFER_THETA_IN * 0.5 * PI;
+			for (int j = 0; j < TRANSFER_PHI_IN; j++)
+			{
+				double phi = (j + 0.5) / TRANSFER_PHI_IN * 2.0 * PI;
+				int d = i * TRANSFER_PHI_IN + j;
+				wi[3*d] = sin(theta) * cos(phi);
+				wi[3*d + 1] = sin(theta) * sin(phi);
+				wi[3*d + 2] = cos(theta);
+				// cos(theta_in) times the solid angle of the cell
+				weight[d] = cos(theta) * sin(theta) * (0.5 * PI / TRANSFER_THETA_IN) * (2.0 * PI / TRANSFER_PHI_IN);
+				sh_eval(&wi[3*d], &basis[d * SH_COEFFS]);
+			}
+		}
+	}
+};
+
+static const TransferQuadrature& transfer_quadrature()
+{
+	static const TransferQuadrature quadrature;
+	return quadrature;
+}
+
+void BRDFTransfer::allocate()
+{
+	const int size = TRANSFER_THETA_OUT * 3 * SH_COEFFS;
+	plain.assign(size, 0.0);
+	cos_2phi_half.assign(size, 0.0);
+	sin_2phi_half.assign(size, 0.0);
+}
+
+// Project view bins [begin, end) of `lookup`, called as
+// lookup(wi, wo, rgb) and returning false where the BRDF is undefined.
+template <class Lookup>
+static void project_bins(BRDFTransfer& transfer, const Lookup& lookup, int begin, int end)
+{
+	const TransferQuadrature& quadrature = transfer_quadrature();
+	const int directions = TRANSFER_THETA_IN * TRANSFER_PHI_IN;
+	const double* wi = &quadrature.wi[0];
+	const double* weight = &quadrature.weight[0];
+	const double* basis = &quadrature.basis[0];
+
+	for (int k = begin; k < end; k++)
+	{
+		double theta_out = (k + 0.5) / TRANSFER_THETA_OUT * 0.5 * PI;
+		double wo[3] = { sin(theta_out), 0.0, cos(theta_out) };
+		double* a = &transfer.plain[k * 3 * SH_COEFFS];
+		double* c = &transfer.cos_2phi_half[k * 3 * SH_COEFFS];
+		double* s = &transfer.sin_2phi_half[k * 3 * SH_COEFFS];
+
+		for (int d = 0; d < directions; d++)
+		{
+			double rgb[3];
+			if (!lookup(&wi[3*d], wo, rgb))
+				continue;
+
+			double hx = wi[3*d] + wo[0];
+			double hy = wi[3*d + 1] + wo[1];
+			double r2 = hx*hx + hy*hy;
+			double cos_2phi = r2 > 0.0 ? (hx*hx - hy*hy) / r2 : 0.0;
+			double sin_2phi = r2 > 0.0 ? 2.0 * hx * hy / r2 : 0.0;
+
+			const double* y = &basis[d * SH_COEFFS];
+			for (int channel = 0; channel < 3; channel++)
+			{
+				double value = rgb[channel] * weight[d];
+				for (int i = 0; i < SH_COEFFS; i++)
+				{
+					a[channel * SH_COEFFS + i] += value * y[i];
+					c[channel * SH_COEFFS + i] += value * cos_2phi * y[i];
+					s[channel * SH_COEFFS + i] += value * sin_2phi * y[i];
+				}
+			}
+		}
+	}
+}
+
+void BRDFTransfer::build(const BRDF& brdf)
+{
+	allocate();
+	build(brdf, 0, TRANSFER_THETA_OUT);
+}
+
+void BRDFTransfer::build(const BRDF& brdf, int begin, int end)
+{
+	project_bins(*this, [&brdf](const double* wi, const double* wo, double* rgb)
+	{
+		return lookup_brdf_dir(brdf, wi, wo, rgb[0], rgb[1], rgb[2]) != 0;
+	}, begin, end);
+}
+
+void BRDFTransfer::build(const AnalyticBRDF& brdf)
+{
+	allocate();
+	project_bins(*this, [&brdf](const double* wi, const double* wo, double* rgb)
+	{
+		return eval_analytic_brdf_dir(brdf, wi, wo, rgb[0], rgb[1], rgb[2]) != 0;
+	}, 0, TRANSFER_THETA_OUT);
+}
+
+void EnvironmentTransfer::allocate(const GBuffer& gbuffer)
+{
+	coeffs.resize((size_t)gbuffer.count * 3 * SH_COEFFS);
+}
+
+void EnvironmentTransfer::build(const GBuffer& gbuffer, const BRDFTransfer& brdf1, const BRDFTransfer& brdf2)
+{
+	allocate(gbuffer);
+	build(gbuffer, brdf1, brdf2, 0, gbuffer.count);
+}
+
+void EnvironmentTransfer::build(const GBuffer& gbuffer, const BRDFTransfer& brdf1, const BRDFTransfer& brdf2, int begin, int end)
+{
+	for (int s = begin; s < end; s++)
+	{
+		double theta_out = acos(std::min(1.0, gbuffer.woz[s]));
+		double phi_out = atan2(gbuffer.woy[s], gbuffer.wox[s]);
+
+		// Interpolate between the two nearest view bins.
+		double bin = theta_out / (0.5 * PI) * TRANSFER_THETA_OUT - 0.5;
+		int k0 = std::max(0, std::min((int)floor(bin), TRANSFER_THETA_OUT - 1));
+		int k1 = std::min(k0 + 1, TRANSFER_THETA_OUT - 1);
+		double t = std::max(0.0, std::min(bin - k0, 1.0));
+
+		// With phi_half measured from wo, sin(2 phi_half) in the tangent
+		// frame is sin(2 phi') cos(2 phi_out) + cos(2 phi') sin(2 phi_out),
+		// so the mix 0.5 (f1 + f2) + 0.5 sin(2 phi_half) (f1 - f2) is a
+		// combination of the tabulated projections.
+		double cos_2phi_out = cos(2.0 * phi_out);
+		double sin_2phi_out = sin(2.0 * phi_out);
+		double local[3 * SH_COEFFS];
+		for (int i = 0; i < 3 * SH_COEFFS; i++)
+		{
+			int i0 = k0 * 3 * SH_COEFFS + i;
+			int i1 = k1 * 3 * SH_COEFFS + i;
+			double a = (1 - t) * (brdf1.plain[i0] + brdf2.plain[i0]) + t * (brdf1.plain[i1] + brdf2.plain[i1]);
+			double c = (1 - t) * (brdf1.cos_2phi_half[i0] - brdf2.cos_2phi_half[i0]) + t * (brdf1.cos_2phi_half[i1] - brdf2.cos_2phi_half[i1]);
+			double s2 = (1 - t) * (brdf1.sin_2phi_half[i0] - brdf2.sin_2phi_half[i0]) + t * (brdf1.sin_2phi_half[i1] - brdf2.sin_2phi_half[i1]);
+			local[i] = 0.5 * (a + cos_2phi_out * s2 + sin_2phi_out * c);
+		}
+
+		// The tables have wo along x; turn that frame to the sample's.
+		double cos_phi = cos(phi_out);
+		double sin_phi = sin(phi_out);
+		double tangent[3] = { gbuffer.tx[s], gbuffer.ty[s], gbuffer.tz[s] };
+		double bitangent[3] = { gbuffer.bx[s], gbuffer.by[s], gbuffer.bz[s] };
+		double x[3], y[3];
+		double z[3] = { gbuffer.nx[s], gbuffer.ny[s], gbuffer.nz[s] };
+		for (int a = 0; a < 3; a++)
+		{
+			x[a] = cos_phi * tangent[a] + sin_phi * bitangent[a];
+			y[a] = cos_phi * bitangent[a] - sin_phi * tangent[a];
+		}
+		double world[3 * SH_COEFFS];
+		sh_rotate(local, 3, x, y, z, world);
+
+		float* out = &coeffs[(size_t)s * 3 * SH_COEFFS];
+		for (int i = 0; i < 3 * SH_COEFFS; i++)
+		{
+			out[i] = (float)world[i];
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef __ENVMAP_H__
+#define __ENVMAP_H__
+
+#include "analyticbrdf.h"
+#include "brdf.h"
+#include "gbuffer.h"
+#include "sh.h"
+#include <vector>
+
+// An equirectangular HDR environment, reduced to its spherical harmonic
+// projection. Direction (0, 1, 0) is the top row and (0, 0, 1) the centre
+// column.
+struct Environment {
+	// Radiance per channel.
+	double sh[3 * SH_COEFFS];
+};
+
+// Read a Radiance RGBE (.hdr) file and project it.
+bool read_environment(const char*, Environment&);
+
+// View elevations tabulated by BRDFTransfer.
+#define TRANSFER_THETA_OUT 32
+
+// Spherical harmonic projections of one material's cosine-weighted BRDF,
+// f(wi, wo) cos(theta_in), as a function of wi, tabulated over the view
+// elevation with wo in the xz plane. The extra cos/sin(2 phi_half)
+// weighted tables let a pair of materials be mixed by half-vector azimuth,
+// as lookup_aniso_brdf_dir() does.
+struct BRDFTransfer {
+	// [view bin][channel][coefficient]
+	std::vector<double> plain;
+	std::vector<double> cos_2phi_half;
+	std::vector<double> sin_2phi_half;
+
+	void build(const BRDF&);
+	void build(const AnalyticBRDF&);
+	// Size the tables and zero them, then fill in view bins [begin, end).
+	// Bins are independent, so they can be built on different threads.
+	void allocate();
+	void build(const BRDF&, int begin, int end);
+};
+
+// Per G-buffer sample transfer vectors in world space for the anisotropic
+// mix of two materials. Shading a sample against an environment is then
+// one dot product per channel.
+struct EnvironmentTransfer {
+	// [sample][channel][coefficient]
+	std::vector<float> coeffs;
+
+	void build(const GBuffer&, const BRDFTransfer&, const BRDFTransfer&);
+	// Size coeffs for the G-buffer, then fill in samples [begin, end).
+	// Ranges are independent, so they can be built on different threads.
+	void allocate(const GBuffer&);
+	void build(const GBuffer&, const BRDFTransfer&, const BRDFTransfer&, int begin, int end);
+
+	void shade(int sample, const double* environment, double& red, double& green, double& blue) const
+	{
+		const float* t = &coeffs[sample * 3 * SH_COEFFS];
+		double rgb[3];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			double sum = 0.0;
+			for (int i = 0; i < SH_COEFFS; i++)
+			{
+				sum += t[channel * SH_COEFFS + i] * environment[channel * SH_COEFFS + i];
+			}
+			rgb[channel] = sum;
+		}
+		red = rgb[0];
+		green = rgb[1];
+		blue = rgb[2];
+	}
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "vector3.h"
+
+// An orthonormal basis with the normal as z. Its inverse is its transpose,
+// so moving a direction in or out of it is three dot products, or a sum
+// of three scaled axes, with no matrix inverse.
+template <typename T>
+struct FrameT {
+	// Tangent, bitangent (n x s) and normal.
+	Vector3T<T> s;
+	Vector3T<T> t;
+	Vector3T<T> n;
+
+	Vector3T<T> to_local(const Vector3T<T>& v) const
+	{
+		return Vector3T<T>(s.dot_product(v), t.dot_product(v), n.dot_product(v));
+	}
+
+	Vector3T<T> to_world(const Vector3T<T>& v) const
+	{
+		return s * v.x + t * v.y + n * v.z;
+	}
+
+	// Any frame around a unit normal, by the branchless construction of
+	// Duff et al., "Building an Orthonormal Basis, Revisited" (2017). The
+	// tangent's direction is arbitrary, so this only suits isotropic uses.
+	static FrameT from_normal(const Vector3T<T>& normal)
+	{
+		FrameT frame;
+		T sign = copysign((T)1, normal.z);
+		T a = -1 / (sign + normal.z);
+		T b = normal.x * normal.y * a;
+		frame.s = Vector3T<T>(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+		frame.t = Vector3T<T>(b, sign + normal.y * normal.y * a, -normal.y);
+		frame.n = normal;
+		return frame;
+	}
+
+	// The renderer's frame on the sphere: the tangent runs along the line
+	// of latitude about y, (-n.z, 0, n.x) normalised, which is what the
+	// anisotropic mix is oriented by. At the poles, where that vanishes,
+	// it is -x.
+	static FrameT latitude(const Vector3T<T>& normal)
+	{
+		FrameT frame;
+		T r2 = normal.x * normal.x + normal.z * normal.z;
+		T inv = r2 > 0 ? 1 / sqrt(r2) : 0;
+		frame.s = r2 > 0 ? Vector3T<T>(-normal.z * inv, 0, normal.x * inv) : Vector3T<T>(-1, 0, 0);
+		frame.t = normal.cross_product(frame.s);
+		frame.n = normal;
+		return frame;
+	}
+};
+
+typedef FrameT<double> Frame;
+typedef FrameT<float> Framef;
+
+#endif
@@ -0,0 +1,204 @@
+#include "gbuffer.h"
+#include "frame.h"
+#include "math.h"
+
+#define PI	3.1415926535897932384626433832795
+
+int ray_sphere_intersection(Vector3 center, double radius, Vector3 origin, Vector3 direction, Vector3& intersection, double& distance)
+{
+	Vector3 difference = center - origin;
+	// The distance along the ray, from the origin, to a line perpendicular to `difference` that goes through the center of the sphere.
+	double d2pl = difference.dot_product(direction);
+
+	// If this is negative the intersection is behind the origin and is of no interest.
+	if (d2pl < 0)
+	{
+		return 0;
+	}
+
+	// This is the squared length along the perpendicular line to the intersetion with the ray.
+	double length = difference.dot_product(difference) - d2pl * d2pl;
+
+	double radius_square = radius * radius;
+
+	// If this is a greater distance than the radius squared it does not intersect with the sphere.
+	if (length > radius_square)
+	{
+		return 0;
+	}
+
+	// This is the offset from `d2pl` along the ray where the insection(s) occur
+	// Found the same way as `length` using pythagorean theorem
+	double offset = sqrt(radius_square - length);
+
+	// I am only interested in the closer of the two intersections.
+	distance = d2pl - offset;
+
+	intersection = origin + (direction * distance);
+	return 1;
+}
+
+// Trace the ray through continuous pixel position (x, y) and store a
+// sample for `pixel` if it hits.
+static void add_sample(GBuffer& gbuffer, Vector3 camera, Vector3 sphere, double radius,
+	int pixel, double x, double y)
+{
+	int img_size = gbuffer.size;
+	double xDir = (2*(x / (double)img_size) - 1) * (radius * 1.25);
+	double yDir = (-2*(y / (double)img_size) + 1) * (radius * 1.25);
+	Vector3 viewDir = Vector3(xDir, yDir, 0) - camera;
+	viewDir.normalize();
+	Vector3 intersection = Vector3(0);
+	double distance = 0;
+	if (!ray_sphere_intersection(sphere, radius, camera, viewDir, intersection, distance))
+	{
+		return;
+	}
+
+	Vector3 surface = (intersection - sphere) / radius;
+	Vector3 normal = surface.normal();
+	Vector3 toView = -viewDir;
+
+	Frame frame = Frame::latitude(normal);
+	Vector3 out = frame.to_local(toView);
+
+	gbuffer.pixel.push_back(pixel);
+	gbuffer.px.push_back(intersection.x);
+	gbuffer.py.push_back(intersection.y);
+	gbuffer.pz.push_back(intersection.z);
+	gbuffer.nx.push_back(normal.x);
+	gbuffer.ny.push_back(normal.y);
+	gbuffer.nz.push_back(normal.z);
+	gbuffer.tx.push_back(frame.s.x);
+	gbuffer.ty.push_back(frame.s.y);
+	gbuffer.tz.push_back(frame.s.z);
+	gbuffer.bx.push_back(frame.t.x);
+	gbuffer.by.push_back(frame.t.y);
+	gbuffer.bz.push_back(frame.t.z);
+	gbuffer.wox.push_back(out.x);
+	gbuffer.woy.push_back(out.y);
+	gbuffer.woz.push_back(out.z);
+	gbuffer.count++;
+}
+
+void GBuffer::clear(int img_size)
+{
+	size = img_size;
+	count = 0;
+	std::vector<int>* ints[] = { &pixel };
+	std::vector<double>* doubles[] = { &px, &py, &pz, &nx, &ny, &nz, &tx, &ty, &tz, &bx, &by, &bz, &wox, &woy, &woz };
+	for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++)
+	{
+		ints[i]->clear();
+	}
+	for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++)
+	{
+		doubles[i]->clear();
+	}
+}
+
+void GBuffer::build(Vector3 camera, Vector3 sphere, double radius, int img_size)
+{
+	clear(img_size);
+	for (int y = 0; y < img_size; y++)
+	{
+		for (int x = 0; x < img_size; x++)
+		{
+			add_sample(*this, camera, sphere, radius, y * img_size + x, x, y);
+		}
+	}
+}
+
+void GBuffer::build_subsamples(Vector3 camera, Vector3 sphere, double radius, int img_size,
+	const std::vector<int>& pixels, int grid)
+{
+	clear(img_size);
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		int x = pixels[i] % img_size;
+		int y = pixels[i] / img_size;
+		for (int k = 1; k < grid * grid; k++)
+		{
+			add_sample(*this, camera, sphere, radius, pixels[i],
+				x + (double)(k % grid) / grid, y + (double)(k / grid) / grid);
+		}
+	}
+}
+
+static void normalize3(double& x, double& y, double& z)
+{
+	double length = sqrt(x*x + y*y + z*z);
+	x /= length;
+	y /= length;
+	z /= length;
+}
+
+void GBuffer::interpolate_subsamples(const GBuffer& base, const std::vector<int>& sample,
+	const std::vector<int>& pixels, int grid)
+{
+	clear(base.size);
+	int img_size = base.size;
+	const std::vector<double>* from[] = { &base.px, &base.py, &base.pz, &base.nx, &base.ny, &base.nz,
+		&base.tx, &base.ty, &base.tz, &base.bx, &base.by, &base.bz, &base.wox, &base.woy, &base.woz };
+	std::vector<double>* to[] = { &px, &py, &pz, &nx, &ny, &nz, &tx, &ty, &tz, &bx, &by, &bz, &wox, &woy, &woz };
+	const int attributes = sizeof(to) / sizeof(to[0]);
+	for (int a = 0; a < attributes; a++)
+	{
+		to[a]->reserve(pixels.size() * (grid * grid - 1));
+	}
+
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		int p = pixels[i];
+		int corner[4] = { sample[p], sample[p + 1], sample[p + img_size], sample[p + img_size + 1] };
+		for (int k = 1; k < grid * grid; k++)
+		{
+			double u = (double)(k % grid) / grid;
+			double v = (double)(k / grid) / grid;
+			double weight[4] = { (1 - u) * (1 - v), u * (1 - v), (1 - u) * v, u * v };
+			for (int a = 0; a < attributes; a++)
+			{
+				const double* values = &(*from[a])[0];
+				to[a]->push_back(weight[0] * values[corner[0]] + weight[1] * values[corner[1]] +
+					weight[2] * values[corner[2]] + weight[3] * values[corner[3]]);
+			}
+			normalize3(nx.back(), ny.back(), nz.back());
+			normalize3(tx.back(), ty.back(), tz.back());
+			normalize3(bx.back(), by.back(), bz.back());
+			normalize3(wox.back(), woy.back(), woz.back());
+			pixel.push_back(p);
+			count++;
+		}
+	}
+}
+
+// A pixel is on an edge if it or one of its eight neighbours is hit and
+// another is not.
+void gbuffer_edges(const GBuffer& gbuffer, std::vector<char>& edge)
+{
+	int size = gbuffer.size;
+	std::vector<char> hit(size * size, 0);
+	for (int s = 0; s < gbuffer.count; s++)
+	{
+		hit[gbuffer.pixel[s]] = 1;
+	}
+	edge.assign(size * size, 0);
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			bool any = false, all = true;
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int nx = x + dx, ny = y + dy;
+					bool h = nx >= 0 && ny >= 0 && nx < size && ny < size && hit[ny * size + nx];
+					any = any || h;
+					all = all && h;
+				}
+			}
+			edge[y * size + x] = any && !all;
+		}
+	}
+}
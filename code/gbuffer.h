@@ -0,0 +1,56 @@
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+
+#include "vector3.h"
+#include <vector>
+
+int ray_sphere_intersection(Vector3, double, Vector3, Vector3, Vector3&, double&);
+
+// View-dependent geometry of every pixel that hits the sphere. The camera
+// and sphere are fixed for the whole animation, so this is built once and
+// each frame only evaluates the light-dependent terms.
+//
+// Only hit pixels are stored, one array per attribute, in row-major pixel
+// order.
+struct GBuffer {
+	int size;
+	int count;
+
+	// Pixel index (y * size + x) of each sample.
+	std::vector<int> pixel;
+
+	// Intersection point.
+	std::vector<double> px, py, pz;
+
+	// Surface normal.
+	std::vector<double> nx, ny, nz;
+
+	// Tangent and bitangent of the sample's Frame::latitude(); with the
+	// normal they are the rows of the world-to-tangent rotation.
+	std::vector<double> tx, ty, tz;
+	std::vector<double> bx, by, bz;
+
+	// View direction in the tangent space used by the BRDF lookups, with z
+	// along the normal.
+	std::vector<double> wox, woy, woz;
+
+	void build(Vector3 camera, Vector3 sphere, double radius, int size);
+	// Extra samples for supersampling `pixels`, given in row-major order:
+	// a grid x grid pattern over each pixel, less the corner sample that
+	// build() takes. Samples that miss the sphere are left out.
+	void build_subsamples(Vector3 camera, Vector3 sphere, double radius, int size,
+		const std::vector<int>& pixels, int grid);
+	// The same for pixels whose right, lower and lower right neighbours are
+	// hit, interpolating the attributes of those four samples of `base`
+	// instead of tracing. `sample` gives the sample of each pixel. Much
+	// cheaper, and close wherever the surface is smooth across the pixels.
+	void interpolate_subsamples(const GBuffer& base, const std::vector<int>& sample,
+		const std::vector<int>& pixels, int grid);
+	void clear(int size);
+};
+
+// Flag the pixels of a G-buffer's image where the sphere's silhouette
+// passes: those whose 3x3 neighbourhood is partly hit.
+void gbuffer_edges(const GBuffer&, std::vector<char>& edge);
+
+#endif
@@ -1,6 +1,26 @@
 #include "image.h"
+#include "profile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Alignment of the allocation and of every row of the float planes.
+#define IMAGE_ALIGNMENT 64
+
 Pixel::Pixel()
 {
 	red = 0;
@@ -17,20 +37,24 @@ Pixel::Pixel(double r, double g, double b)
 
 void Image::init()
 {
-	pppPixels = new Pixel*[iWidth]();
-	for (int y = 0; y < iHeight; y++)
-	{
-		pppPixels[y] = new Pixel[iHeight]();
-	}
+	size_t floats_per_line = IMAGE_ALIGNMENT / sizeof(float);
+	iHdrStride = (iWidth + floats_per_line - 1) / floats_per_line * floats_per_line;
+	// 3 bytes per pixel, plus padding to align to four bytes
+	iOutputStride = iWidth * 3 + iWidth % 4;
+
+	size_t hdr_bytes = 3 * iHdrStride * iHeight * sizeof(float);
+	size_t output_bytes = iOutputStride * iHeight;
+	pMemory = new unsigned char[hdr_bytes + output_bytes + IMAGE_ALIGNMENT]();
+
+	uintptr_t address = (uintptr_t)pMemory;
+	address = (address + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+	pHdr = (float*)address;
+	pOutput = (unsigned char*)address + hdr_bytes;
 }
 
 Image::~Image()
 {
-	for(int x = 0; x < iWidth; x++)
-	{
-		delete[] pppPixels[x];
-	}
-	delete[] pppPixels;
+	delete[] pMemory;
 }
 
 Image::Image(int size)
@@ -47,84 +71,233 @@ Image::Image(int width, int height)
 	init();
 }
 
+int Image::width()
+{
+	return iWidth;
+}
+
+int Image::height()
+{
+	return iHeight;
+}
+
 Pixel Image::get(int width, int height)
 {
 	if(width < 0 || height < 0 || width >= iWidth || height >= iHeight)
 	{
 		throw std::out_of_range ("Index out of range.");
 	}
-	return pppPixels[width][height];
+	unsigned char* bgr = output_row(height) + width * 3;
+	Pixel p;
+	p.blue = bgr[0];
+	p.green = bgr[1];
+	p.red = bgr[2];
+	return p;
 }
 
+// Write straight to the output plane. The float planes are left alone, so
+// a later resolve() overwrites the value.
 void Image::set(int width, int height, Pixel value)
 {
 	if(width < 0 || height < 0 || width >= iWidth || height >= iHeight)
 	{
 		throw std::out_of_range ("Index out of range.");
 	}
-	pppPixels[width][height] = value;
+	unsigned char* bgr = output_row(height) + width * 3;
+	bgr[0] = value.blue;
+	bgr[1] = value.green;
+	bgr[2] = value.red;
+}
+
+// Row `y` of a float plane: width() contiguous values.
+float* Image::hdr_row(Channel channel, int y)
+{
+	if(y < 0 || y >= iHeight)
+	{
+		throw std::out_of_range ("Index out of range.");
+	}
+	return pHdr + (channel * iHeight + y) * iHdrStride;
+}
+
+// Row `y` of the output plane: width() packed BGR triples. Rows are stored
+// bottom-up, as in a BMP.
+unsigned char* Image::output_row(int y)
+{
+	if(y < 0 || y >= iHeight)
+	{
+		throw std::out_of_range ("Index out of range.");
+	}
+	return pOutput + (iHeight - 1 - y) * iOutputStride;
+}
+
+void Image::set_hdr(int x, int y, double red, double green, double blue)
+{
+	if(x < 0 || y < 0 || x >= iWidth || y >= iHeight)
+	{
+		throw std::out_of_range ("Index out of range.");
+	}
+	hdr_row(RED, y)[x] = (float)red;
+	hdr_row(GREEN, y)[x] = (float)green;
+	hdr_row(BLUE, y)[x] = (float)blue;
+}
+
+void Image::add_hdr(int x, int y, double red, double green, double blue)
+{
+	if(x < 0 || y < 0 || x >= iWidth || y >= iHeight)
+	{
+		throw std::out_of_range ("Index out of range.");
+	}
+	hdr_row(RED, y)[x] += (float)red;
+	hdr_row(GREEN, y)[x] += (float)green;
+	hdr_row(BLUE, y)[x] += (float)blue;
+}
+
+void Image::clear_hdr()
+{
+	memset(pHdr, 0, 3 * iHdrStride * iHeight * sizeof(float));
+}
+
+void Image::resolve()
+{
+	resolve(0, iHeight);
+}
+
+// Convert rows [y0, y1) of the float planes to the output plane, clamping
+// and rounding like Pixel.
+void Image::resolve(int y0, int y1)
+{
+	for (int y = y0; y < y1; y++)
+	{
+		const float* red = hdr_row(RED, y);
+		const float* green = hdr_row(GREEN, y);
+		const float* blue = hdr_row(BLUE, y);
+		unsigned char* bgr = output_row(y);
+		for (int x = 0; x < iWidth; x++)
+		{
+			Pixel p = Pixel(red[x], green[x], blue[x]);
+			bgr[3*x] = p.blue;
+			bgr[3*x + 1] = p.green;
+			bgr[3*x + 2] = p.red;
+		}
+	}
+}
+#ifdef _WIN32
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+
+// Write every buffer to `fd`, resuming after partial writes. On POSIX each
+// batch of buffers is a single writev().
+static bool write_buffers(int fd, struct iovec* buffers, int count)
+{
+	while (count > 0)
+	{
+#ifndef _WIN32
+		int batch = count < IOV_MAX ? count : IOV_MAX;
+		ssize_t written = writev(fd, buffers, batch);
+#else
+		int written = _write(fd, buffers->iov_base, (unsigned int)buffers->iov_len);
+#endif
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		// Skip the buffers that went out completely
+		size_t remaining = written;
+		while (count > 0 && remaining >= buffers->iov_len)
+		{
+			remaining -= buffers->iov_len;
+			buffers++;
+			count--;
+		}
+		if (count > 0)
+		{
+			buffers->iov_base = (char*)buffers->iov_base + remaining;
+			buffers->iov_len -= remaining;
+		}
+	}
+	return true;
 }
 
 // BMP
-void Image::save(const char* filename)
+bool Image::save(const char* filename)
+{
+	PROFILE_SCOPE(PROFILE_WRITE);
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool written = write_bmp(fd);
+	return close(fd) == 0 && written;
+}
+
+// Write the resolved output plane as a BMP file.
+bool Image::write_bmp(int fd)
 {
-	static char buffer0[] = {
+	int bitmapsize = iOutputStride * iHeight;
+	// 14 is size of BMP Header, 40 is size of DIB Header
+	int filesize = 14 + 40 + bitmapsize;
+	unsigned char header[54] = {
+		'B', 'M', // ID
+		0x00, 0x00, 0x00, 0x00, // Filesize
 		0x00, 0x00, // Unused
 		0x00, 0x00, // Unused
 		0x36, 0x00, 0x00, 0x00, // Offset to pixel array (54)
 		// DIB Header
 		0x28, 0x00, 0x00, 0x00, // Size of DIB Header
-	};
-	static char buffer1[] = {
+		0x00, 0x00, 0x00, 0x00, // Image width
+		0x00, 0x00, 0x00, 0x00, // Image height
 		0x01, 0x00, // Number of planes
 		0x18, 0x00, // Number of bits per pixel (24)
 		0x00, 0x00, 0x00, 0x00, // Compression method (none)
-	};
-	static char buffer2[] = {
+		0x00, 0x00, 0x00, 0x00, // Size of bitmap data including padding
 		0x13, 0x0B, 0x00, 0x00, // Horizontal resolution
 		0x13, 0x0B, 0x00, 0x00, // Vertical resolution
 		0x00, 0x00, 0x00, 0x00, // Colors in pallete
 		0x00, 0x00, 0x00, 0x00 // Important colors
 	};
-	FILE * file;
-	file = fopen(filename, "w");
-	if (file != NULL)
+	// The header is little-endian
+	unsigned int fields[4][2] = {
+		{ 2, (unsigned int)filesize },
+		{ 18, iWidth },
+		{ 22, iHeight },
+		{ 34, (unsigned int)bitmapsize }
+	};
+	for (int i = 0; i < 4; i++)
 	{
-		// 3 bytes per pixel, plus padding to align to four bytes
-		int padding = iWidth % 4;
-		int rowsize = iWidth * 3 + padding;
-		int bitmapsize = rowsize * iHeight;
-		// 14 is size of BMP Header, 40 is size of DIB Header
-		int filesize = 14 + 40 + bitmapsize;
-
-		// ID
-		fputs("BM", file);
-		// Filesize
-		fwrite(&filesize, sizeof(int), 1, file);
-
-		fwrite(buffer0, sizeof(char), sizeof(buffer0), file);
-		fwrite(&iWidth, sizeof(int), 1, file); // Image width
-		fwrite(&iHeight, sizeof(int), 1, file); // Image height
-		fwrite(buffer1, sizeof(char), sizeof(buffer1), file);
-		fwrite(&bitmapsize, sizeof(int), 1, file); // Size of bitmap data including padding
-		fwrite(buffer2, sizeof(char), sizeof(buffer2), file);
-		// Pixel data starts at bottom left and goes across each row working its way up
-		for(int y = iHeight - 1; y >= 0; y--)
+		for (int b = 0; b < 4; b++)
 		{
-			for(int x = 0; x < iWidth; x++)
-			{
-				Pixel p = pppPixels[x][y];
-				// The data is ordered backwards from normal
-				fputc(p.blue, file);
-				fputc(p.green, file);
-				fputc(p.red, file);
-			}
-			for(int i = 0; i < padding; i++)
-			{
-				// Pad the end of the row
-				fputc(0, file);
-			}
+			header[fields[i][0] + b] = (fields[i][1] >> (8 * b)) & 0xFF;
 		}
 	}
-	fclose(file);
+
+	// The output plane is already the BMP pixel array: bottom-up rows of
+	// padded BGR.
+	struct iovec buffers[2];
+	buffers[0].iov_base = header;
+	buffers[0].iov_len = sizeof(header);
+	buffers[1].iov_base = pOutput;
+	buffers[1].iov_len = bitmapsize;
+	PROFILE_COUNT(PROFILE_BYTES_WRITTEN, filesize);
+	return write_buffers(fd, buffers, 2);
+}
+
+// Write the resolved output plane as one raw video frame: top-down rows of
+// BGR (ffmpeg's bgr24) without padding.
+bool Image::write_raw(int fd)
+{
+	PROFILE_SCOPE(PROFILE_WRITE);
+	PROFILE_COUNT(PROFILE_BYTES_WRITTEN, (long long)iWidth * 3 * iHeight);
+	std::vector<struct iovec> buffers(iHeight);
+	for (int y = 0; y < iHeight; y++)
+	{
+		buffers[y].iov_base = output_row(y);
+		buffers[y].iov_len = iWidth * 3;
+	}
+	return write_buffers(fd, &buffers[0], iHeight);
 }
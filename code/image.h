@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <stddef.h>
 
 struct Pixel {
 	unsigned int red;
@@ -14,20 +15,58 @@ struct Pixel {
 	void cull(double, double);
 };
 
+// A framebuffer in one contiguous, cache-line aligned allocation.
+//
+// Rendering accumulates into three float planes (red, green and blue), each
+// stored row by row with rows padded to a whole number of cache lines, so
+// threads writing different rows never share a line. resolve() converts
+// them into the 8-bit output plane, which holds bottom-up rows of packed BGR
+// padded to four bytes; that is exactly a BMP pixel array, so write_bmp()
+// sends the header and the plane with a single writev().
 class Image {
+public:
+	enum Channel {
+		RED,
+		GREEN,
+		BLUE
+	};
+
 private:
 	unsigned int iWidth;
 	unsigned int iHeight;
-	Pixel ** pppPixels;
+	// Floats between the starts of consecutive rows of a float plane.
+	size_t iHdrStride;
+	// Bytes between the starts of consecutive rows of the output plane.
+	size_t iOutputStride;
+	unsigned char* pMemory;
+	float* pHdr;
+	unsigned char* pOutput;
 	void init();
 
+	Image(const Image&);
+	Image& operator=(const Image&);
+
 public:
 	~Image();
 	Image(int);
 	Image(int, int);
+	int width();
+	int height();
+
 	Pixel get(int, int);
 	void set(int, int, Pixel);
-	void save(const char*);
+
+	float* hdr_row(Channel, int);
+	unsigned char* output_row(int);
+	void set_hdr(int, int, double, double, double);
+	void add_hdr(int, int, double, double, double);
+	void clear_hdr();
+	void resolve();
+	void resolve(int, int);
+
+	bool save(const char*);
+	bool write_bmp(int);
+	bool write_raw(int);
 };
 
 #endif
@@ -0,0 +1,187 @@
+#include "lights.h"
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+static double luminance(Vector3 color)
+{
+	return 0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z;
+}
+
+bool read_lights(const char* filename, std::vector<Light>& lights)
+{
+	FILE* file = fopen(filename, "r");
+	if (!file)
+		return false;
+
+	char line[1024];
+	bool ok = true;
+	while (fgets(line, sizeof(line), file))
+	{
+		char* start = line;
+		while (*start == ' ' || *start == '\t')
+			start++;
+		if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0')
+			continue;
+
+		Light light;
+		if (sscanf(start, "%lf %lf %lf %lf %lf %lf",
+			&light.position.x, &light.position.y, &light.position.z,
+			&light.color.x, &light.color.y, &light.color.z) != 6)
+		{
+			ok = false;
+			break;
+		}
+		lights.push_back(light);
+	}
+	fclose(file);
+	return ok;
+}
+
+// Orders light indices along one axis.
+struct LightAxisOrder {
+	const std::vector<Light>* lights;
+	int axis;
+
+	bool operator()(int a, int b) const
+	{
+		const Vector3& pa = (*lights)[a].position;
+		const Vector3& pb = (*lights)[b].position;
+		return axis == 0 ? pa.x < pb.x : axis == 1 ? pa.y < pb.y : pa.z < pb.z;
+	}
+};
+
+void LightTree::build(const std::vector<Light>& lights)
+{
+	nodes.clear();
+	std::vector<int> order;
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		// Lights that emit nothing can never be picked.
+		if (luminance(lights[i].color) > 0.0)
+		{
+			order.push_back((int)i);
+		}
+	}
+	if (!order.empty())
+	{
+		nodes.reserve(2 * order.size() - 1);
+		build_node(lights, order, 0, (int)order.size());
+	}
+}
+
+// Build the subtree over order[begin, end), splitting at the median of the
+// longest axis of the bounds, and return its index.
+int LightTree::build_node(const std::vector<Light>& lights, std::vector<int>& order, int begin, int end)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(Node());
+
+	double lower[3], upper[3];
+	Node node;
+	node.power = 0.0;
+	for (int i = begin; i < end; i++)
+	{
+		const Vector3& p = lights[order[i]].position;
+		double position[3] = { p.x, p.y, p.z };
+		for (int a = 0; a < 3; a++)
+		{
+			lower[a] = i == begin ? position[a] : std::min(lower[a], position[a]);
+			upper[a] = i == begin ? position[a] : std::max(upper[a], position[a]);
+		}
+		node.power += luminance(lights[order[i]].color);
+	}
+	double extent[3];
+	double diagonal = 0.0;
+	for (int a = 0; a < 3; a++)
+	{
+		node.center[a] = 0.5 * (lower[a] + upper[a]);
+		extent[a] = upper[a] - lower[a];
+		diagonal += extent[a] * extent[a];
+	}
+	node.radius = 0.5 * sqrt(diagonal);
+
+	if (end - begin == 1)
+	{
+		node.left = -1;
+		node.right = -1;
+		node.light = order[begin];
+	}
+	else
+	{
+		LightAxisOrder compare;
+		compare.lights = &lights;
+		compare.axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : extent[1] >= extent[2] ? 1 : 2;
+		int middle = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, compare);
+
+		node.light = -1;
+		node.left = build_node(lights, order, begin, middle);
+		node.right = build_node(lights, order, middle, end);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+// Power of the node times the largest cosine between the normal and any
+// direction into its bounds. This never underestimates the cosine, so a
+// node that might light the point is never given zero probability.
+double LightTree::importance(const Node& node, const double* point, const double* normal) const
+{
+	double to_center[3] = { node.center[0] - point[0], node.center[1] - point[1], node.center[2] - point[2] };
+	double distance = sqrt(to_center[0] * to_center[0] + to_center[1] * to_center[1] + to_center[2] * to_center[2]);
+	double radius = node.radius;
+	if (distance <= radius)
+	{
+		return node.power;
+	}
+
+	double cos_theta = (normal[0] * to_center[0] + normal[1] * to_center[1] + normal[2] * to_center[2]) / distance;
+	double sin_bound = radius / distance;
+	double cos_bound = sqrt(1.0 - sin_bound * sin_bound);
+	if (cos_theta >= cos_bound)
+	{
+		return node.power;
+	}
+	// cos(theta - bound), where theta is the angle to the centre.
+	double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+	double cosine = cos_theta * cos_bound + sin_theta * sin_bound;
+	return cosine > 0.0 ? node.power * cosine : 0.0;
+}
+
+int LightTree::sample(Vector3 point, Vector3 normal, double u, double& pdf) const
+{
+	if (nodes.empty())
+	{
+		return -1;
+	}
+	double p[3] = { point.x, point.y, point.z };
+	double n[3] = { normal.x, normal.y, normal.z };
+	pdf = 1.0;
+	int index = 0;
+	while (nodes[index].light < 0)
+	{
+		const Node& node = nodes[index];
+		double left = importance(nodes[node.left], p, n);
+		double right = importance(nodes[node.right], p, n);
+		if (left + right <= 0.0)
+		{
+			return -1;
+		}
+		// Choose a child and rescale u to [0, 1) within the choice.
+		double p_left = left / (left + right);
+		if (u < p_left)
+		{
+			u = u / p_left;
+			pdf *= p_left;
+			index = node.left;
+		}
+		else
+		{
+			u = std::min((u - p_left) / (1.0 - p_left), 1.0);
+			pdf *= 1.0 - p_left;
+			index = node.right;
+		}
+	}
+	return nodes[index].light;
+}
@@ -0,0 +1,46 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include "vector3.h"
+#include <vector>
+
+struct Light {
+	Vector3 position;
+	Vector3 color;
+};
+
+// Read a light list: one light per line as "x y z red green blue", with
+// blank lines and lines starting with '#' ignored.
+bool read_lights(const char*, std::vector<Light>&);
+
+// Bounding volume hierarchy over point lights for stochastic light
+// selection. sample() walks from the root, choosing each child in
+// proportion to an upper bound on its contribution to the shading point,
+// so picking a light costs O(log n) however many lights there are.
+struct LightTree {
+	// Nodes are bounded by the sphere around their bounding box.
+	struct Node {
+		double center[3];
+		double radius;
+		double power;
+		// Children for inner nodes; light is -1 unless this is a leaf.
+		int left;
+		int right;
+		int light;
+	};
+
+	std::vector<Node> nodes;
+
+	void build(const std::vector<Light>&);
+
+	// Pick a light for a point with the given normal using u in [0, 1).
+	// Returns its index and sets pdf to the probability of picking it, or
+	// returns -1 if no light can reach the point.
+	int sample(Vector3 point, Vector3 normal, double u, double& pdf) const;
+
+private:
+	int build_node(const std::vector<Light>&, std::vector<int>&, int, int);
+	double importance(const Node&, const double*, const double*) const;
+};
+
+#endif
@@ -3,36 +3,150 @@
 
 #include "vector3.h"
 
-struct Matrix3 {
-	double a11;
-	double a12;
-	double a13;
-	double a21;
-	double a22;
-	double a23;
-	double a31;
-	double a32;
-	double a33;
-
-	Matrix3();
-	Matrix3(Vector3, Vector3, Vector3);
-	~Matrix3();
-
-	double determinate();
-	Matrix3 transpose();
-	Matrix3 inverse();
-
-	Matrix3 operator-();
-	Matrix3 operator+(const Matrix3&);
-	Matrix3 operator*(const Matrix3&);
-	Matrix3 operator*(double);
-	Matrix3 operator/(double);
-	Vector3 operator*(const Vector3&);
-
-	void operator+=(const Matrix3&);
-	void operator-=(const Matrix3&);
-	void operator*=(double);
-	void operator/=(double);
+// A 3x3 matrix on scalar type T, inline like Vector3T.
+template <typename T>
+struct Matrix3T {
+	T a11;
+	T a12;
+	T a13;
+	T a21;
+	T a22;
+	T a23;
+	T a31;
+	T a32;
+	T a33;
+
+	constexpr Matrix3T() : a11(0), a12(0), a13(0), a21(0), a22(0), a23(0), a31(0), a32(0), a33(0) {}
+
+	// The three vectors are the columns.
+	constexpr Matrix3T(const Vector3T<T>& v1, const Vector3T<T>& v2, const Vector3T<T>& v3)
+		: a11(v1.x), a12(v2.x), a13(v3.x),
+		a21(v1.y), a22(v2.y), a23(v3.y),
+		a31(v1.z), a32(v2.z), a33(v3.z) {}
+
+	constexpr Matrix3T(T b11, T b12, T b13, T b21, T b22, T b23, T b31, T b32, T b33)
+		: a11(b11), a12(b12), a13(b13),
+		a21(b21), a22(b22), a23(b23),
+		a31(b31), a32(b32), a33(b33) {}
+
+	constexpr T determinate() const
+	{
+		return
+			a11 * (a22*a33 - a23*a32) -
+			a12 * (a21*a33 - a23*a31) +
+			a13 * (a21*a32 - a22*a31);
+	}
+
+	constexpr Matrix3T transpose() const
+	{
+		return Matrix3T(
+			a11, a21, a31,
+			a12, a22, a32,
+			a13, a23, a33);
+	}
+
+	Matrix3T inverse() const
+	{
+		T det = determinate();
+		Matrix3T m = Matrix3T();
+		if (det == 0) return m;
+		Matrix3T t = transpose();
+
+		m.a11 = (t.a22*t.a33 - t.a23*t.a32);
+		m.a12 = -(t.a21*t.a33 - t.a23*t.a31);
+		m.a13 = (t.a21*t.a32 - t.a22*t.a31);
+
+		m.a21 = -(t.a12*t.a33 - t.a13*t.a32);
+		m.a22 = (t.a11*t.a33 - t.a13*t.a31);
+		m.a23 = -(t.a11*t.a32 - t.a12*t.a31);
+
+		m.a31 = (t.a12*t.a23 - t.a13*t.a22);
+		m.a32 = -(t.a11*t.a23 - t.a13*t.a21);
+		m.a33 = (t.a11*t.a22 - t.a12*t.a21);
+
+		m /= det;
+		return m;
+	}
+
+	constexpr Matrix3T operator-() const
+	{
+		return Matrix3T(
+			-a11, -a12, -a13,
+			-a21, -a22, -a23,
+			-a31, -a32, -a33);
+	}
+
+	constexpr Matrix3T operator+(const Matrix3T& o) const
+	{
+		return Matrix3T(
+			a11 + o.a11, a12 + o.a12, a13 + o.a13,
+			a21 + o.a21, a22 + o.a22, a23 + o.a23,
+			a31 + o.a31, a32 + o.a32, a33 + o.a33);
+	}
+
+	constexpr Matrix3T operator*(const Matrix3T& o) const
+	{
+		return Matrix3T(
+			a11 * o.a11 + a12 * o.a21 + a13 * o.a31,
+			a11 * o.a12 + a12 * o.a22 + a13 * o.a32,
+			a11 * o.a13 + a12 * o.a23 + a13 * o.a33,
+
+			a21 * o.a11 + a22 * o.a21 + a23 * o.a31,
+			a21 * o.a12 + a22 * o.a22 + a23 * o.a32,
+			a21 * o.a13 + a22 * o.a23 + a23 * o.a33,
+
+			a31 * o.a11 + a32 * o.a21 + a33 * o.a31,
+			a31 * o.a12 + a32 * o.a22 + a33 * o.a32,
+			a31 * o.a13 + a32 * o.a23 + a33 * o.a33);
+	}
+
+	constexpr Matrix3T operator*(T d) const
+	{
+		return Matrix3T(
+			d * a11, d * a12, d * a13,
+			d * a21, d * a22, d * a23,
+			d * a31, d * a32, d * a33);
+	}
+
+	constexpr Matrix3T operator/(T d) const
+	{
+		return Matrix3T(
+			a11 / d, a12 / d, a13 / d,
+			a21 / d, a22 / d, a23 / d,
+			a31 / d, a32 / d, a33 / d);
+	}
+
+	constexpr Vector3T<T> operator*(const Vector3T<T>& v) const
+	{
+		return Vector3T<T>(
+			a11 * v.x + a12 * v.y + a13 * v.z,
+			a21 * v.x + a22 * v.y + a23 * v.z,
+			a31 * v.x + a32 * v.y + a33 * v.z
+		);
+	}
+
+	void operator+=(const Matrix3T& o)
+	{
+		*this = *this + o;
+	}
+
+	void operator-=(const Matrix3T& o)
+	{
+		*this = *this + -o;
+	}
+
+	void operator*=(T d)
+	{
+		*this = *this * d;
+	}
+
+	void operator/=(T d)
+	{
+		*this = *this / d;
+	}
 };
 
+typedef Matrix3T<double> Matrix3;
+typedef Matrix3T<float> Matrix3f;
+
 #endif
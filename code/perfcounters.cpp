@@ -0,0 +1,109 @@
+#include "perfcounters.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int open_counter(unsigned int type, unsigned long long config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+	for (int i = 0; i < NUM_COUNTERS; i++)
+	{
+		fds[i] = -1;
+		values[i] = 0;
+	}
+#ifdef __linux__
+	fds[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[CACHE_REFERENCES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+	fds[CACHE_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fds[L1D_READ_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++)
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+#endif
+}
+
+bool PerfCounters::available()
+{
+	for (int i = 0; i < NUM_COUNTERS; i++)
+	{
+		if (fds[i] >= 0)
+			return true;
+	}
+	return false;
+}
+
+void PerfCounters::start()
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++)
+	{
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+void PerfCounters::stop()
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++)
+	{
+		values[i] = 0;
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		unsigned long long count = 0;
+		if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+			values[i] = count;
+	}
+#endif
+}
+
+unsigned long long PerfCounters::value(Counter counter)
+{
+	return values[counter];
+}
+
+const char* PerfCounters::name(Counter counter)
+{
+	switch (counter)
+	{
+	case CYCLES: return "cycles";
+	case INSTRUCTIONS: return "instructions";
+	case CACHE_REFERENCES: return "cache_references";
+	case CACHE_MISSES: return "cache_misses";
+	case L1D_READ_MISSES: return "l1d_read_misses";
+	default: return "";
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+// Hardware event counters for the calling thread, read through
+// perf_event_open. Where that is unavailable (other platforms, containers,
+// perf_event_paranoid) available() is false and every reading is zero.
+class PerfCounters {
+public:
+	enum Counter {
+		CYCLES,
+		INSTRUCTIONS,
+		CACHE_REFERENCES,
+		CACHE_MISSES,
+		L1D_READ_MISSES,
+		NUM_COUNTERS
+	};
+
+	PerfCounters();
+	~PerfCounters();
+	bool available();
+	void start();
+	void stop();
+	unsigned long long value(Counter);
+
+	static const char* name(Counter);
+
+private:
+	int fds[NUM_COUNTERS];
+	unsigned long long values[NUM_COUNTERS];
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include "profile.h"
+
+#ifdef EBRDF_PROFILE
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+static const char* stage_names[PROFILE_STAGES] = {
+	"setup", "gbuffer", "lights", "shade", "lookup", "environment", "refine", "resolve", "write"
+};
+
+static const char* counter_names[PROFILE_COUNTERS] = {
+	"samples", "lookups", "bytes"
+};
+
+// Stages that run inside another one.
+static bool is_detail(int stage)
+{
+	return stage == PROFILE_LOOKUP || stage == PROFILE_ENVIRONMENT;
+}
+
+struct ProfileTotals {
+	long long ns[PROFILE_STAGES];
+	long long calls[PROFILE_STAGES];
+	long long counts[PROFILE_COUNTERS];
+};
+
+struct ProfileEvent {
+	ProfileStage stage;
+	int frame;
+	long long begin;
+	long long end;
+};
+
+struct ProfileThread {
+	int id;
+	int frame;
+	// Indexed by frame + 1, so that setup comes first.
+	std::vector<ProfileTotals> frames;
+	std::vector<ProfileEvent> events;
+
+	ProfileTotals& totals()
+	{
+		size_t index = (size_t)(frame + 1);
+		if (index >= frames.size())
+		{
+			ProfileTotals zero = {};
+			frames.resize(index + 1, zero);
+		}
+		return frames[index];
+	}
+};
+
+// Threads' records outlive the threads, until the report.
+static std::mutex registry_lock;
+static std::vector<ProfileThread*> registry;
+static thread_local ProfileThread* current_thread = NULL;
+
+static ProfileThread& profile_thread()
+{
+	if (!current_thread)
+	{
+		current_thread = new ProfileThread();
+		current_thread->frame = -1;
+		std::lock_guard<std::mutex> guard(registry_lock);
+		current_thread->id = (int)registry.size();
+		registry.push_back(current_thread);
+	}
+	return *current_thread;
+}
+
+void profile_set_frame(int frame)
+{
+	profile_thread().frame = frame;
+}
+
+void profile_record(ProfileStage stage, long long begin, long long end)
+{
+	ProfileThread& thread = profile_thread();
+	ProfileTotals& totals = thread.totals();
+	totals.ns[stage] += end - begin;
+	totals.calls[stage]++;
+	if (!is_detail(stage))
+	{
+		ProfileEvent event = { stage, thread.frame, begin, end };
+		thread.events.push_back(event);
+	}
+}
+
+void profile_count(ProfileCounter counter, long long n)
+{
+	profile_thread().totals().counts[counter] += n;
+}
+
+static void add_totals(ProfileTotals& sum, const ProfileTotals& totals)
+{
+	for (int s = 0; s < PROFILE_STAGES; s++)
+	{
+		sum.ns[s] += totals.ns[s];
+		sum.calls[s] += totals.calls[s];
+	}
+	for (int c = 0; c < PROFILE_COUNTERS; c++)
+	{
+		sum.counts[c] += totals.counts[c];
+	}
+}
+
+static void print_row(FILE* file, const char* label, const ProfileTotals& totals)
+{
+	fprintf(file, "%-8s", label);
+	for (int s = 0; s < PROFILE_STAGES; s++)
+	{
+		fprintf(file, " %11.3f", totals.ns[s] * 1e-6);
+	}
+	for (int c = 0; c < PROFILE_COUNTERS; c++)
+	{
+		fprintf(file, " %11lld", totals.counts[c]);
+	}
+	fprintf(file, "\n");
+}
+
+void profile_report(FILE* file)
+{
+	std::lock_guard<std::mutex> guard(registry_lock);
+	std::vector<ProfileTotals> frames;
+	ProfileTotals zero = {};
+	long long first = 0, last = 0;
+	bool any = false;
+	for (size_t t = 0; t < registry.size(); t++)
+	{
+		const ProfileThread& thread = *registry[t];
+		if (frames.size() < thread.frames.size())
+			frames.resize(thread.frames.size(), zero);
+		for (size_t f = 0; f < thread.frames.size(); f++)
+		{
+			add_totals(frames[f], thread.frames[f]);
+		}
+		for (size_t e = 0; e < thread.events.size(); e++)
+		{
+			first = any ? std::min(first, thread.events[e].begin) : thread.events[e].begin;
+			last = any ? std::max(last, thread.events[e].end) : thread.events[e].end;
+			any = true;
+		}
+	}
+
+	fprintf(file, "\nTime per stage in ms, summed over threads; lookup and environment are part of shade.\n");
+	fprintf(file, "%-8s", "frame");
+	for (int s = 0; s < PROFILE_STAGES; s++)
+	{
+		fprintf(file, " %11s", stage_names[s]);
+	}
+	for (int c = 0; c < PROFILE_COUNTERS; c++)
+	{
+		fprintf(file, " %11s", counter_names[c]);
+	}
+	fprintf(file, "\n");
+
+	ProfileTotals run = zero;
+	for (size_t f = 0; f < frames.size(); f++)
+	{
+		char label[16] = "setup";
+		if (f > 0)
+			snprintf(label, sizeof(label), "%i", (int)f - 1);
+		print_row(file, label, frames[f]);
+		add_totals(run, frames[f]);
+	}
+	print_row(file, "total", run);
+
+	long long busy = 0;
+	for (int s = 0; s < PROFILE_STAGES; s++)
+	{
+		if (!is_detail(s))
+			busy += run.ns[s];
+	}
+	fprintf(file, "\n%-12s %11s %11s %11s %8s\n", "stage", "ms", "calls", "us/call", "share");
+	for (int s = 0; s < PROFILE_STAGES; s++)
+	{
+		if (run.calls[s] == 0)
+			continue;
+		fprintf(file, "%-12s %11.3f %11lld %11.3f %7.1f%%\n", stage_names[s], run.ns[s] * 1e-6, run.calls[s],
+			run.ns[s] * 1e-3 / run.calls[s], busy > 0 ? 100.0 * run.ns[s] / busy : 0.0);
+	}
+	fprintf(file, "%zu threads, %.3f ms from the first timed stage to the last\n", registry.size(),
+		(last - first) * 1e-6);
+}
+
+bool profile_write_trace(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
+
+	std::lock_guard<std::mutex> guard(registry_lock);
+	long long origin = 0;
+	bool any = false;
+	for (size_t t = 0; t < registry.size(); t++)
+	{
+		for (size_t e = 0; e < registry[t]->events.size(); e++)
+		{
+			origin = any ? std::min(origin, registry[t]->events[e].begin) : registry[t]->events[e].begin;
+			any = true;
+		}
+	}
+
+	// Complete ("X") events in microseconds from the first one.
+	fprintf(file, "{\"traceEvents\":[");
+	bool first = true;
+	for (size_t t = 0; t < registry.size(); t++)
+	{
+		const ProfileThread& thread = *registry[t];
+		for (size_t e = 0; e < thread.events.size(); e++)
+		{
+			const ProfileEvent& event = thread.events[e];
+			fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%i}}",
+				first ? "" : ",", stage_names[event.stage], thread.id,
+				(event.begin - origin) * 1e-3, (event.end - event.begin) * 1e-3, event.frame);
+			first = false;
+		}
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	return fclose(file) == 0;
+}
+
+#endif
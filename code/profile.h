@@ -0,0 +1,77 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <chrono>
+
+// Stages of the renderer that builds with EBRDF_PROFILE defined time. The
+// detail stages run inside shade and are accumulated but not traced, as
+// there is one per scanline.
+enum ProfileStage {
+	PROFILE_SETUP,
+	PROFILE_GBUFFER,
+	PROFILE_LIGHTS,
+	PROFILE_SHADE,
+	PROFILE_LOOKUP,
+	PROFILE_ENVIRONMENT,
+	PROFILE_REFINE,
+	PROFILE_RESOLVE,
+	PROFILE_WRITE,
+	PROFILE_STAGES
+};
+
+enum ProfileCounter {
+	PROFILE_SAMPLES,
+	PROFILE_LOOKUPS,
+	PROFILE_BYTES_WRITTEN,
+	PROFILE_COUNTERS
+};
+
+#ifdef EBRDF_PROFILE
+
+// Timings are added to totals kept per thread and per frame, so recording
+// takes no lock; the threads' totals are only combined for the report.
+// Each thread's frame is whatever PROFILE_FRAME() last set there, -1 for
+// the setup before the first frame.
+inline long long profile_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void profile_set_frame(int);
+void profile_record(ProfileStage, long long begin, long long end);
+void profile_count(ProfileCounter, long long);
+
+class ProfileScope {
+private:
+	ProfileStage stage;
+	long long begin;
+
+public:
+	ProfileScope(ProfileStage s) : stage(s), begin(profile_now()) {}
+	~ProfileScope() { profile_record(stage, begin, profile_now()); }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+#define PROFILE_FRAME(frame) profile_set_frame(frame)
+#define PROFILE_COUNT(counter, n) profile_count(counter, n)
+
+// Per-frame and whole-run breakdowns of the time recorded so far, summed
+// over threads. Call once the threads have finished.
+void profile_report(FILE*);
+// Everything but the detail stages as Chrome trace events, for
+// chrome://tracing or Perfetto.
+bool profile_write_trace(const char*);
+
+#else
+
+#define PROFILE_SCOPE(stage)
+#define PROFILE_FRAME(frame)
+#define PROFILE_COUNT(counter, n)
+
+#endif
+
+#endif
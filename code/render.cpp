@@ -0,0 +1,209 @@
+#include "render.h"
+#include "profile.h"
+#include <math.h>
+#include <algorithm>
+
+void animate_lights(Scene& scene, const std::vector<Light>& lights, int image_number, int num_images)
+{
+	PROFILE_FRAME(image_number);
+	PROFILE_SCOPE(PROFILE_LIGHTS);
+	double percent = (double)image_number / num_images;
+	double angle = percent * 2 * PI;
+	double sin_angle = sin(angle);
+	double cos_angle = cos(angle);
+
+	scene.lights = lights;
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		Vector3 p = lights[i].position;
+		scene.lights[i].position = Vector3(p.x * cos_angle + p.y * sin_angle,
+			p.y * cos_angle - p.x * sin_angle, p.z);
+	}
+	if (scene.light_samples > 0)
+	{
+		scene.light_tree.build(scene.lights);
+	}
+	if (scene.environment)
+	{
+		// The lights turn by -angle about z.
+		sh_rotate_z(scene.environment->sh, 3, -angle, scene.environment_sh);
+		for (int i = 0; i < 3 * SH_COEFFS; i++)
+		{
+			scene.environment_sh[i] *= scene.environment_scale;
+		}
+	}
+	scene.frame = image_number;
+}
+
+// Uniform number in [0, 1) that depends only on the frame, pixel and
+// sample, so that renders do not depend on the thread count.
+static double sample_random(int frame, int pixel, int sample)
+{
+	unsigned long long h = ((unsigned long long)frame << 40) ^ ((unsigned long long)pixel << 12) ^ (unsigned long long)sample;
+	// splitmix64 finaliser
+	h += 0x9E3779B97F4A7C15ULL;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void shade_samples(Scene& scene, GBuffer& gbuffer, Image& image, int begin, int end, bool accumulate)
+{
+	PROFILE_FRAME(scene.frame);
+	PROFILE_SCOPE(PROFILE_SHADE);
+	PROFILE_COUNT(PROFILE_SAMPLES, end - begin);
+	int size = gbuffer.size;
+	std::vector<double> wi_x(size), wi_y(size), wi_z(size);
+	std::vector<double> wo_x(size), wo_y(size), wo_z(size);
+	std::vector<double> rgb(3 * size);
+	std::vector<double> red(size), green(size), blue(size);
+	std::vector<int> lit(size);
+	std::vector<int> lit_pixel(size);
+	std::vector<int> light(size);
+	std::vector<double> weight(size);
+
+	int i = begin;
+	while (i < end)
+	{
+		// At most a row's worth at a time, as supersampled rows hold more.
+		int row = gbuffer.pixel[i] / size;
+		int count = 0;
+		while (i + count < end && count < size && gbuffer.pixel[i + count] / size == row)
+		{
+			count++;
+		}
+
+		for (int j = 0; j < count; j++)
+		{
+			red[j] = 0;
+			green[j] = 0;
+			blue[j] = 0;
+		}
+		const double* wi[3] = { &wi_x[0], &wi_y[0], &wi_z[0] };
+		const double* wo[3] = { &wo_x[0], &wo_y[0], &wo_z[0] };
+
+		// Each pass adds one light per pixel: every light in turn, or one
+		// picked from the light tree and weighted by its probability. Only
+		// samples that face their light are gathered for the lookup; as the
+		// light moves round, the rest of the sphere costs a dot product.
+		int passes = scene.light_samples > 0 ? scene.light_samples : (int)scene.lights.size();
+		for (int pass = 0; pass < passes; pass++)
+		{
+			int lit_count = 0;
+			for (int j = 0; j < count; j++)
+			{
+				int s = i + j;
+				Vector3 intersection = Vector3(gbuffer.px[s], gbuffer.py[s], gbuffer.pz[s]);
+				Vector3 normal = Vector3(gbuffer.nx[s], gbuffer.ny[s], gbuffer.nz[s]);
+
+				int k = lit_count;
+				light[k] = pass;
+				weight[k] = 1.0;
+				if (scene.light_samples > 0)
+				{
+					double pdf;
+					double u = sample_random(scene.frame, gbuffer.pixel[s], pass);
+					light[k] = scene.light_tree.sample(intersection, normal, u, pdf);
+					weight[k] = 1.0 / (pdf * scene.light_samples);
+				}
+				if (light[k] < 0)
+				{
+					continue;
+				}
+				Vector3 toLight = (scene.lights[light[k]].position - intersection).normal();
+
+				// Only process points that face the light
+				if (normal.dot_product(toLight) <= 0)
+				{
+					continue;
+				}
+
+				// worldToTangent * toLight, with the normal as z
+				wi_x[k] = gbuffer.tx[s] * toLight.x + gbuffer.ty[s] * toLight.y + gbuffer.tz[s] * toLight.z;
+				wi_y[k] = gbuffer.bx[s] * toLight.x + gbuffer.by[s] * toLight.y + gbuffer.bz[s] * toLight.z;
+				wi_z[k] = normal.dot_product(toLight);
+				wo_x[k] = gbuffer.wox[s];
+				wo_y[k] = gbuffer.woy[s];
+				wo_z[k] = gbuffer.woz[s];
+				lit[k] = j;
+				lit_pixel[k] = gbuffer.pixel[s];
+				lit_count++;
+			}
+			if (lit_count == 0)
+			{
+				continue;
+			}
+
+			PROFILE_SCOPE(PROFILE_LOOKUP);
+			PROFILE_COUNT(PROFILE_LOOKUPS, lit_count);
+			if (scene.preview1)
+			{
+				eval_aniso_analytic_brdf_batch(*scene.preview1, *scene.preview2, wi, wo, lit_count, &rgb[0]);
+			}
+			else
+			{
+				lookup_blend_brdf_batch(*scene.blend, &lit_pixel[0], wi, wo, lit_count, scene.interpolate, &rgb[0]);
+			}
+
+			for (int k = 0; k < lit_count; k++)
+			{
+				int j = lit[k];
+				Vector3 color = scene.lights[light[k]].color;
+				red[j] += rgb[3*k] * color.x * weight[k];
+				green[j] += rgb[3*k + 1] * color.y * weight[k];
+				blue[j] += rgb[3*k + 2] * color.z * weight[k];
+			}
+		}
+
+		if (scene.environment && scene.environment_transfer)
+		{
+			PROFILE_SCOPE(PROFILE_ENVIRONMENT);
+			for (int j = 0; j < count; j++)
+			{
+				double r, g, b;
+				scene.environment_transfer->shade(i + j, scene.environment_sh, r, g, b);
+				red[j] += r;
+				green[j] += g;
+				blue[j] += b;
+			}
+		}
+
+		float* red_row = image.hdr_row(Image::RED, row);
+		float* green_row = image.hdr_row(Image::GREEN, row);
+		float* blue_row = image.hdr_row(Image::BLUE, row);
+		if (accumulate)
+		{
+			double share = 1.0 / (scene.supersample * scene.supersample);
+			for (int j = 0; j < count; j++)
+			{
+				int x = gbuffer.pixel[i + j] % size;
+				red_row[x] += (float)(red[j] * share);
+				green_row[x] += (float)(green[j] * share);
+				blue_row[x] += (float)(blue[j] * share);
+			}
+		}
+		else
+		{
+			for (int j = 0; j < count; j++)
+			{
+				int x = gbuffer.pixel[i + j] % size;
+				red_row[x] = (float)red[j];
+				green_row[x] = (float)green[j];
+				blue_row[x] = (float)blue[j];
+			}
+		}
+		i += count;
+	}
+}
+
+void render_frame(ThreadPool& pool, Scene& scene, GBuffer& gbuffer, Image& image)
+{
+	int num_tasks = (gbuffer.count + SAMPLES_PER_TASK - 1) / SAMPLES_PER_TASK;
+	pool.parallel_for(num_tasks, [&](int task)
+	{
+		int begin = task * SAMPLES_PER_TASK;
+		shade_samples(scene, gbuffer, image, begin,
+			std::min(begin + SAMPLES_PER_TASK, gbuffer.count));
+	});
+}
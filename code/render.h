@@ -0,0 +1,65 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include "analyticbrdf.h"
+#include "brdfblend.h"
+#include "envmap.h"
+#include "gbuffer.h"
+#include "image.h"
+#include "lights.h"
+#include "threadpool.h"
+#include "vector3.h"
+#include <vector>
+
+// G-buffer samples shaded by one pool task.
+#define SAMPLES_PER_TASK 1024
+
+// Everything a frame needs to shade a pixel. Only the lights change between
+// frames.
+struct Scene {
+	// The materials and their weights per sample.
+	const BRDFBlend* blend;
+	// Blend the eight table entries around each lookup (--interpolate).
+	bool interpolate;
+	// Fitted stand-ins shaded instead of the tables when set (--preview).
+	const AnalyticBRDF* preview1;
+	const AnalyticBRDF* preview2;
+	Vector3 camera;
+	std::vector<Light> lights;
+	// Tree over `lights`, used when light_samples > 0.
+	LightTree light_tree;
+	// Lights picked per pixel from the tree, or 0 to evaluate every light.
+	int light_samples;
+	int frame;
+	// Environment lighting, if any: the projection of the loaded map, the
+	// per-sample transfer vectors, and the map as turned for this frame,
+	// in output units.
+	const Environment* environment;
+	const EnvironmentTransfer* environment_transfer;
+	double environment_scale;
+	double environment_sh[3 * SH_COEFFS];
+	// Samples per pixel side where a pixel is supersampled, or 1.
+	int supersample;
+	Vector3 sphere;
+	double radius;
+	int img_size;
+};
+
+// Turn the lights and environment about the view axis, once over the
+// course of the animation.
+void animate_lights(Scene&, const std::vector<Light>& lights, int image_number, int num_images);
+
+// Shade G-buffer samples [begin, end). Each sample only depends on the
+// scene, so ranges can be shaded in any order and on any thread. The BRDF
+// is looked up one scanline at a time through the batched kernel.
+//
+// Each sample's value is stored in its pixel, or with `accumulate` added to
+// it as one of supersample^2; a range must then hold all of a pixel's
+// samples. Samples get the environment term only if the scene has transfer
+// vectors for them.
+void shade_samples(Scene&, GBuffer&, Image&, int begin, int end, bool accumulate = false);
+
+// Shade a whole frame on the pool, split into SAMPLES_PER_TASK ranges.
+void render_frame(ThreadPool&, Scene&, GBuffer&, Image&);
+
+#endif
@@ -0,0 +1,242 @@
+#include "sh.h"
+#include <math.h>
+#include <string.h>
+
+#define PI	3.1415926535897932384626433832795
+
+// Most directions used by sh_rotate(): 2l+1 for the highest band.
+#define SH_POINTS (2 * SH_BANDS - 1)
+
+// Basis functions at `dir` with normalisation constants `scale`. The
+// associated Legendre functions are built with the sin(theta)^m factor
+// split off, and sin(theta)^m cos(m phi), sin(theta)^m sin(m phi) come from
+// x and y directly, so no trigonometry is needed.
+static void eval_basis(const double* dir, const double* scale, double* out)
+{
+	double x = dir[0], y = dir[1], z = dir[2];
+	double c = 1.0, s = 0.0;
+	double diagonal = 1.0;
+	for (int m = 0; m < SH_BANDS; m++)
+	{
+		if (m > 0)
+		{
+			double next_c = x * c - y * s;
+			s = x * s + y * c;
+			c = next_c;
+			diagonal *= 2 * m - 1;
+		}
+		double before = 0.0;
+		double legendre = diagonal;
+		for (int l = m; l < SH_BANDS; l++)
+		{
+			if (l == m + 1)
+			{
+				before = legendre;
+				legendre = z * (2 * m + 1) * legendre;
+			}
+			else if (l > m + 1)
+			{
+				double next = ((2 * l - 1) * z * legendre - (l + m - 1) * before) / (l - m);
+				before = legendre;
+				legendre = next;
+			}
+			int index = l * (l + 1);
+			if (m == 0)
+			{
+				out[index] = scale[index] * legendre;
+			}
+			else
+			{
+				out[index + m] = scale[index + m] * legendre * c;
+				out[index - m] = scale[index - m] * legendre * s;
+			}
+		}
+	}
+}
+
+// Invert the n x n matrix `a` (row stride SH_POINTS) in place with
+// Gauss-Jordan elimination and partial pivoting.
+static void invert(double* a, int n)
+{
+	double work[SH_POINTS][2 * SH_POINTS];
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			work[i][j] = a[i * SH_POINTS + j];
+			work[i][n + j] = i == j ? 1.0 : 0.0;
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		int pivot = i;
+		for (int r = i + 1; r < n; r++)
+		{
+			if (fabs(work[r][i]) > fabs(work[pivot][i]))
+				pivot = r;
+		}
+		for (int j = 0; j < 2 * n; j++)
+		{
+			double t = work[i][j];
+			work[i][j] = work[pivot][j];
+			work[pivot][j] = t;
+		}
+		double d = work[i][i];
+		for (int j = 0; j < 2 * n; j++)
+		{
+			work[i][j] /= d;
+		}
+		for (int r = 0; r < n; r++)
+		{
+			if (r == i)
+				continue;
+			double f = work[r][i];
+			for (int j = 0; j < 2 * n; j++)
+			{
+				work[r][j] -= f * work[i][j];
+			}
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			a[i * SH_POINTS + j] = work[i][n + j];
+		}
+	}
+}
+
+// Normalisation constants, plus the fixed directions and inverse basis
+// matrices used by sh_rotate(). Built once, on first use.
+struct SHTables {
+	double scale[SH_COEFFS];
+	double points[SH_POINTS][3];
+	// Per band, the inverse of the matrix of Y_lm at the first 2l+1 points.
+	double inverse[SH_BANDS][SH_POINTS][SH_POINTS];
+
+	SHTables()
+	{
+		for (int l = 0; l < SH_BANDS; l++)
+		{
+			for (int m = -l; m <= l; m++)
+			{
+				int am = m < 0 ? -m : m;
+				// (l - |m|)! / (l + |m|)!
+				double ratio = 1.0;
+				for (int k = l - am + 1; k <= l + am; k++)
+				{
+					ratio /= k;
+				}
+				double k_lm = sqrt((2 * l + 1) / (4.0 * PI) * ratio);
+				scale[l * (l + 1) + m] = m == 0 ? k_lm : sqrt(2.0) * k_lm;
+			}
+		}
+
+		// Points on a golden-angle spiral.
+		for (int i = 0; i < SH_POINTS; i++)
+		{
+			double z = 1.0 - (2.0 * i + 1.0) / SH_POINTS;
+			double r = sqrt(1.0 - z * z);
+			double phi = i * 2.39996322972865332 + 0.3;
+			points[i][0] = r * cos(phi);
+			points[i][1] = r * sin(phi);
+			points[i][2] = z;
+		}
+
+		memset(inverse, 0, sizeof(inverse));
+		for (int l = 0; l < SH_BANDS; l++)
+		{
+			for (int k = 0; k < 2 * l + 1; k++)
+			{
+				double basis[SH_COEFFS];
+				eval_basis(points[k], scale, basis);
+				for (int m = -l; m <= l; m++)
+				{
+					inverse[l][k][m + l] = basis[l * (l + 1) + m];
+				}
+			}
+			invert(&inverse[l][0][0], 2 * l + 1);
+		}
+	}
+};
+
+static const SHTables& sh_tables()
+{
+	static const SHTables tables;
+	return tables;
+}
+
+void sh_eval(const double* dir, double* out)
+{
+	eval_basis(dir, sh_tables().scale, out);
+}
+
+void sh_rotate_z(const double* in, int channels, double angle, double* out)
+{
+	for (int channel = 0; channel < channels; channel++)
+	{
+		const double* a = in + channel * SH_COEFFS;
+		double* b = out + channel * SH_COEFFS;
+		for (int l = 0; l < SH_BANDS; l++)
+		{
+			int index = l * (l + 1);
+			b[index] = a[index];
+			for (int m = 1; m <= l; m++)
+			{
+				double c = cos(m * angle);
+				double s = sin(m * angle);
+				double cos_term = a[index + m];
+				double sin_term = a[index - m];
+				b[index + m] = cos_term * c - sin_term * s;
+				b[index - m] = sin_term * c + cos_term * s;
+			}
+		}
+	}
+}
+
+void sh_rotate(const double* in, int channels, const double* x, const double* y, const double* z, double* out)
+{
+	const SHTables& tables = sh_tables();
+
+	// The rotated function at point p is the local one at R^T p.
+	double basis[SH_POINTS][SH_COEFFS];
+	for (int k = 0; k < SH_POINTS; k++)
+	{
+		const double* p = tables.points[k];
+		double local[3] = {
+			x[0] * p[0] + x[1] * p[1] + x[2] * p[2],
+			y[0] * p[0] + y[1] * p[1] + y[2] * p[2],
+			z[0] * p[0] + z[1] * p[1] + z[2] * p[2]
+		};
+		eval_basis(local, tables.scale, basis[k]);
+	}
+
+	for (int channel = 0; channel < channels; channel++)
+	{
+		const double* a = in + channel * SH_COEFFS;
+		double* b = out + channel * SH_COEFFS;
+		for (int l = 0; l < SH_BANDS; l++)
+		{
+			int index = l * (l + 1);
+			int n = 2 * l + 1;
+			double values[SH_POINTS];
+			for (int k = 0; k < n; k++)
+			{
+				values[k] = 0.0;
+				for (int m = -l; m <= l; m++)
+				{
+					values[k] += a[index + m] * basis[k][index + m];
+				}
+			}
+			for (int m = -l; m <= l; m++)
+			{
+				double sum = 0.0;
+				for (int k = 0; k < n; k++)
+				{
+					sum += tables.inverse[l][m + l][k] * values[k];
+				}
+				b[index + m] = sum;
+			}
+		}
+	}
+}
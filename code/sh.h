@@ -0,0 +1,22 @@
+#ifndef __SH_H__
+#define __SH_H__
+
+// Real spherical harmonics up to band SH_BANDS - 1. Coefficient l*(l+1)+m
+// holds band l, order m; positive orders go with cos(m*phi) and negative
+// ones with sin(|m|*phi), phi being measured about z from x.
+#define SH_BANDS 5
+#define SH_COEFFS (SH_BANDS * SH_BANDS)
+
+// Basis functions at the unit vector `dir`.
+void sh_eval(const double* dir, double* out);
+
+// Rotate `channels` consecutive coefficient vectors by `angle` about z.
+void sh_rotate_z(const double* in, int channels, double angle, double* out);
+
+// Rotate `channels` consecutive coefficient vectors from a local frame into
+// the frame where the local axes are x, y and z. Each band is evaluated at
+// 2l+1 fixed directions and projected back, which needs no rotation
+// matrices for the higher bands.
+void sh_rotate(const double* in, int channels, const double* x, const double* y, const double* z, double* out);
+
+#endif
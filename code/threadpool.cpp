@@ -0,0 +1,184 @@
+#include "threadpool.h"
+#include <memory>
+
+// Index of the queue owned by the current thread, or -1 if the thread
+// does not belong to `current_pool`.
+static thread_local ThreadPool* current_pool = NULL;
+static thread_local int current_queue = -1;
+
+ThreadPool::ThreadPool(int threads)
+{
+	if (threads < 1)
+	{
+		threads = default_threads();
+	}
+	queued = 0;
+	next_queue = 0;
+	stopping = false;
+
+	// The caller of parallel_for() is the last worker, so only threads - 1
+	// are spawned. There is always at least one queue to submit into.
+	int spawned = threads - 1;
+	int num_queues = spawned > 0 ? spawned : 1;
+	for (int i = 0; i < num_queues; i++)
+	{
+		queues.push_back(new Queue());
+	}
+	for (int i = 0; i < spawned; i++)
+	{
+		workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		stopping = true;
+	}
+	sleep_signal.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+	for (size_t i = 0; i < queues.size(); i++)
+	{
+		delete queues[i];
+	}
+}
+
+int ThreadPool::size()
+{
+	return (int)workers.size() + 1;
+}
+
+int ThreadPool::default_threads()
+{
+	int threads = (int)std::thread::hardware_concurrency();
+	return threads > 0 ? threads : 1;
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	int index;
+	if (current_pool == this && current_queue >= 0)
+	{
+		index = current_queue;
+	}
+	else
+	{
+		index = (int)(next_queue++ % queues.size());
+	}
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->lock);
+		queues[index]->tasks.push_back(task);
+	}
+	queued++;
+	{
+		// Taking the lock orders this against a worker that has just
+		// checked `queued` and is about to sleep.
+		std::lock_guard<std::mutex> guard(sleep_lock);
+	}
+	sleep_signal.notify_one();
+}
+
+// Take a task from our own queue (newest first) or steal one from another
+// queue (oldest first).
+bool ThreadPool::pop(int own, std::function<void()>& task)
+{
+	int num_queues = (int)queues.size();
+	if (own >= 0)
+	{
+		Queue* queue = queues[own];
+		std::lock_guard<std::mutex> guard(queue->lock);
+		if (!queue->tasks.empty())
+		{
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+			return true;
+		}
+	}
+	int start = own >= 0 ? own + 1 : 0;
+	for (int i = 0; i < num_queues; i++)
+	{
+		Queue* queue = queues[(start + i) % num_queues];
+		std::lock_guard<std::mutex> guard(queue->lock);
+		if (!queue->tasks.empty())
+		{
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::run_one()
+{
+	std::function<void()> task;
+	int own = current_pool == this ? current_queue : -1;
+	if (!pop(own, task))
+	{
+		return false;
+	}
+	queued--;
+	task();
+	return true;
+}
+
+void ThreadPool::worker_loop(int index)
+{
+	current_pool = this;
+	current_queue = index;
+	while (true)
+	{
+		if (run_one())
+		{
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		sleep_signal.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0)
+		{
+			return;
+		}
+	}
+}
+
+// Run body(0) .. body(count - 1) on the pool and return once all of them
+// have finished. The calling thread executes tasks while it waits.
+void ThreadPool::parallel_for(int count, std::function<void(int)> body)
+{
+	struct Group {
+		std::atomic<int> remaining;
+		std::mutex lock;
+		std::condition_variable done;
+	};
+	// Shared so that a worker finishing the last task never touches the
+	// group after the caller has returned.
+	std::shared_ptr<Group> group = std::make_shared<Group>();
+	group->remaining = count;
+
+	for (int i = 0; i < count; i++)
+	{
+		submit([i, &body, group]
+		{
+			body(i);
+			std::lock_guard<std::mutex> guard(group->lock);
+			if (--group->remaining == 0)
+			{
+				group->done.notify_all();
+			}
+		});
+	}
+
+	while (group->remaining > 0)
+	{
+		if (run_one())
+		{
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(group->lock);
+		group->done.wait(guard, [&group] { return group->remaining == 0; });
+	}
+}
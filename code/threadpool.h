@@ -0,0 +1,45 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool. Each worker owns a deque: it pushes and pops its own
+// work at the back and, when empty, steals from the front of the others.
+// The thread that calls parallel_for() takes part in the work, so a pool
+// created with one thread runs everything serially on the caller.
+class ThreadPool {
+private:
+	struct Queue {
+		std::deque<std::function<void()> > tasks;
+		std::mutex lock;
+	};
+
+	std::vector<Queue*> queues;
+	std::vector<std::thread> workers;
+	std::atomic<int> queued;
+	std::atomic<unsigned int> next_queue;
+	std::mutex sleep_lock;
+	std::condition_variable sleep_signal;
+	bool stopping;
+
+	bool pop(int, std::function<void()>&);
+	void worker_loop(int);
+
+public:
+	ThreadPool(int);
+	~ThreadPool();
+	int size();
+	void submit(std::function<void()>);
+	bool run_one();
+	void parallel_for(int, std::function<void(int)>);
+
+	static int default_threads();
+};
+
+#endif
@@ -4,32 +4,123 @@
 #include "math.h"
 #include <stdexcept>
 
-struct Vector3 {
-	double x;
-	double y;
-	double z;
-
-	Vector3();
-	Vector3(double);
-	Vector3(double, double, double);
-	~Vector3();
-
-	void normalize();
-	double magnitude();
-	Vector3 cross_product(Vector3);
-	Vector3 normal();
-	double dot_product(Vector3);
-	double angle_between(Vector3);
-
-	Vector3 operator-();
-	Vector3 operator+(const Vector3&);
-	Vector3 operator-(const Vector3&);
-	Vector3 operator*(double);
-	Vector3 operator/(double);
-	void operator+=(const Vector3&);
-	void operator-=(const Vector3&);
-	void operator*=(double);
-	void operator/=(double);
+// A 3-vector on scalar type T. Everything is inline so that the vector
+// arithmetic of a hot loop compiles down to plain scalar code wherever it
+// is used.
+template <typename T>
+struct Vector3T {
+	T x;
+	T y;
+	T z;
+
+	Vector3T() = default;
+	constexpr explicit Vector3T(T val) : x(val), y(val), z(val) {}
+	constexpr Vector3T(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
+	// Conversion between scalar types, e.g. from the double reference.
+	template <typename U>
+	constexpr explicit Vector3T(const Vector3T<U>& other) : x((T)other.x), y((T)other.y), z((T)other.z) {}
+
+	void normalize()
+	{
+		T len = sqrt(x*x+y*y+z*z);
+		x = x / len;
+		y = y / len;
+		z = z / len;
+	}
+
+	T magnitude() const
+	{
+		return sqrt(x*x+y*y+z*z);
+	}
+
+	constexpr Vector3T cross_product(const Vector3T& other) const
+	{
+		return Vector3T(
+			y*other.z - z*other.y,
+			z*other.x - x*other.z,
+			x*other.y - y*other.x
+		);
+	}
+
+	Vector3T normal() const
+	{
+		T len = sqrt(x*x+y*y+z*z);
+		return Vector3T(
+			x / len,
+			y / len,
+			z / len
+		);
+	}
+
+	constexpr T dot_product(const Vector3T& other) const
+	{
+		return x * other.x +
+			y * other.y +
+			z * other.z;
+	}
+
+	T angle_between(const Vector3T& other) const
+	{
+		return acos(dot_product(other) / (magnitude() * other.magnitude()));
+	}
+
+	constexpr Vector3T operator-() const
+	{
+		return Vector3T(-x, -y, -z);
+	}
+
+	constexpr Vector3T operator+(const Vector3T& other) const
+	{
+		return Vector3T(x + other.x, y + other.y, z + other.z);
+	}
+
+	constexpr Vector3T operator-(const Vector3T& other) const
+	{
+		return Vector3T(x - other.x, y - other.y, z - other.z);
+	}
+
+	constexpr Vector3T operator*(T scale) const
+	{
+		return Vector3T(x * scale, y * scale, z * scale);
+	}
+
+	constexpr Vector3T operator/(T scale) const
+	{
+		return Vector3T(x / scale, y / scale, z / scale);
+	}
+
+	void operator+=(const Vector3T& other)
+	{
+		x += other.x;
+		y += other.y;
+		z += other.z;
+	}
+
+	void operator-=(const Vector3T& other)
+	{
+		x -= other.x;
+		y -= other.y;
+		z -= other.z;
+	}
+
+	void operator*=(T scale)
+	{
+		x *= scale;
+		y *= scale;
+		z *= scale;
+	}
+
+	void operator/=(T scale)
+	{
+		x /= scale;
+		y /= scale;
+		z /= scale;
+	}
 };
 
+// Double is the reference precision; float halves the width of vectorised
+// code. brdf_bench checks the float variants against it.
+typedef Vector3T<double> Vector3;
+typedef Vector3T<float> Vector3f;
+
 #endif